@@ -0,0 +1,892 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "map.hpp"
+#include "cow_map.hpp"
+#include "concurrent_map.hpp"
+#include "sharded_map.hpp"
+#include "skiplist_map.hpp"
+#include "buffered_map.hpp"
+#include "mapped_map.hpp"
+#include "durable_map.hpp"
+#include "paged_map.hpp"
+
+/**
+ * usage: benchmark [section|all] [elements] [max threads]
+ */
+
+typedef sjtu::map<int, int> Map;
+
+int elements = 1000000;
+unsigned max_threads = 0;
+// keeps lookups from being optimized away
+volatile size_t sink;
+
+double now() {
+  return std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void fill(Map &map, int n) {
+  for (int i = 0; i < n; i++) {
+    map.insert(Map::value_type(rand(), i));
+  }
+}
+
+/**
+ * the thread counts of a scaling curve: powers of two up to max_threads.
+ */
+unsigned next_threads(unsigned threads) {
+  if (threads >= max_threads) return 0;
+  return threads * 2 > max_threads ? max_threads : threads * 2;
+}
+
+void bench_copy() {
+  Map map;
+  fill(map, elements);
+  printf("copy constructor, %d elements\n", (int)map.size());
+  printf("%8s %12s %10s\n", "threads", "time(ms)", "speedup");
+  size_t threshold = Map::parallel_copy_threshold;
+  Map::parallel_copy_threshold = 0;
+  double base = 0;
+  for (unsigned threads = 1; threads; threads = next_threads(threads)) {
+    Map::copy_threads = threads;
+    double start = now();
+    {
+      Map copy(map);
+    }
+    double time = now() - start;
+    if (threads == 1) base = time;
+    printf("%8u %12.1f %10.2f\n", threads, time, base / time);
+  }
+  Map::parallel_copy_threshold = threshold;
+  Map::copy_threads = 0;
+  puts("");
+}
+
+/**
+ * one policy: fill, then run each read/write mix over the filled map.
+ * a write erases a random key or inserts it back, so the size stays put.
+ */
+template<class Balance>
+void bench_policy(const char *name) {
+  typedef sjtu::map<int, int, std::less<int>, Balance> Policy;
+  const int reads[] = {100, 90, 50, 10};
+  Policy map;
+  srand(1);
+  double start = now();
+  for (int i = 0; i < elements; i++) {
+    map.insert(typename Policy::value_type(rand() % (2 * elements), i));
+  }
+  double time = now() - start;
+  printf("%-10s %8s %12.2f %14.3f\n", name, "fill", elements / time / 1000,
+         (double)map.rotation_count() / elements);
+  for (int read : reads) {
+    size_t rotations = map.rotation_count();
+    start = now();
+    for (int i = 0; i < elements; i++) {
+      int key = rand() % (2 * elements);
+      if (rand() % 100 < read) {
+        sink += map.count(key);
+      } else {
+        typename Policy::iterator it = map.find(key);
+        if (it == map.end()) map.insert(typename Policy::value_type(key, i));
+        else map.erase(it);
+      }
+    }
+    time = now() - start;
+    char mix[16];
+    snprintf(mix, sizeof(mix), "%d%%", read);
+    printf("%-10s %8s %12.2f %14.3f\n", name, mix, elements / time / 1000,
+           (double)(map.rotation_count() - rotations) / elements);
+  }
+}
+
+void bench_balance() {
+  printf("balancing policies, %d operations per row\n", elements);
+  printf("%-10s %8s %12s %14s\n", "policy", "reads", "Mops/s", "rotations/op");
+  bench_policy<sjtu::avl_balance>("avl");
+  bench_policy<sjtu::wavl_balance>("wavl");
+  bench_policy<sjtu::red_black_balance>("red-black");
+  puts("");
+}
+
+/**
+ * a batch of inserts in key order, then at random, then erases,
+ *   outside and inside bulk mode; only the ordered inserts are deferred.
+ */
+void bench_bulk() {
+  printf("batch of %d ordered inserts, %d random inserts and %d erases\n",
+         elements, elements, elements);
+  printf("%8s %12s %12s %12s\n", "mode", "ordered(ms)", "random(ms)", "erase(ms)");
+  for (int bulk = 0; bulk < 2; bulk++) {
+    Map map;
+    srand(1);
+    if (bulk) map.begin_bulk();
+    double start = now();
+    for (int i = 0; i < elements; i++) {
+      map.insert(Map::value_type(i, i));
+    }
+    double ordered = now() - start;
+    start = now();
+    fill(map, elements);
+    double random = now() - start;
+    start = now();
+    for (int i = 0; i < elements; i++) {
+      Map::iterator it = map.find(rand() % (2 * elements));
+      if (it != map.end()) map.erase(it);
+    }
+    if (bulk) map.end_bulk();
+    printf("%8s %12.1f %12.1f %12.1f\n", bulk ? "bulk" : "eager", ordered, random, now() - start);
+  }
+  puts("");
+}
+
+/**
+ * elements random pairs into an empty map and into one already holding
+ *   elements keys: insert one by one, then insert_batch on 1, 4 and 16 threads.
+ */
+void bench_batch() {
+  const unsigned threads[] = {1, 4, 16};
+  std::vector<Map::value_type> batch;
+  srand(2);
+  for (int i = 0; i < elements; i++) batch.push_back(Map::value_type(rand(), i));
+  printf("batch insert of %d random pairs, ms\n", elements);
+  printf("%8s %12s %12s %12s %12s\n", "into", "insert", "batch(1)", "batch(4)", "batch(16)");
+  for (int filled = 0; filled < 2; filled++) {
+    Map base;
+    srand(1);
+    if (filled) fill(base, elements);
+    Map map(base);
+    double start = now();
+    for (const Map::value_type &x : batch) map.insert(x);
+    double one_by_one = now() - start;
+    printf("%8s %12.1f", filled ? "filled" : "empty", one_by_one);
+    for (unsigned t : threads) {
+      Map::parallel_threads = t;
+      Map target(base);
+      start = now();
+      target.insert_batch(batch.begin(), batch.end());
+      double time = now() - start;
+      if (target.size() != map.size()) fprintf(stderr, "batch insert lost elements\n");
+      printf(" %7.1f(%.1fx)", time, one_by_one / time);
+    }
+    printf("\n");
+  }
+  Map::parallel_threads = 0;
+  puts("");
+}
+
+/**
+ * sum every value through an iterator, forward then backward.
+ */
+template<class Scan>
+void bench_scan_mode(const char *name, const Scan &map) {
+  double forward = 1e18, backward = 1e18;
+  for (int round = 0; round < 5; round++) {
+    size_t sum = 0;
+    double start = now();
+    for (typename Scan::const_iterator it = map.cbegin(); it != map.cend(); ++it) {
+      sum += it->second;
+    }
+    double time = now() - start;
+    if (time < forward) forward = time;
+    start = now();
+    typename Scan::const_iterator it = map.cend();
+    for (size_t i = map.size(); i; i--) {
+      --it;
+      sum += it->second;
+    }
+    time = now() - start;
+    if (time < backward) backward = time;
+    sink += sum;
+  }
+  printf("%10s %10zu %14.2f %14.2f\n", name, sizeof(typename Scan::iterator),
+         forward * 1e6 / map.size(), backward * 1e6 / map.size());
+}
+
+/**
+ * both maps are filled in key order before either is scanned,
+ *   so their nodes sit in memory alike, in scan order,
+ *   and the iterators' own cost is not hidden behind cache misses.
+ */
+void bench_scan() {
+  typedef sjtu::map<int, int, std::less<int>, sjtu::avl_balance, false> Unchecked;
+  Map checked;
+  Unchecked unchecked;
+  for (int i = 0; i < elements; i++) {
+    checked.insert(Map::value_type(i, i));
+  }
+  for (int i = 0; i < elements; i++) {
+    unchecked.insert(Unchecked::value_type(i, i));
+  }
+  printf("iterator scan, %d elements, best of 5\n", elements);
+  printf("%10s %10s %14s %14s\n", "iterators", "bytes", "forward(ns)", "backward(ns)");
+  bench_scan_mode("checked", checked);
+  bench_scan_mode("unchecked", unchecked);
+  puts("");
+}
+
+/**
+ * sum the values with parallel_reduce and bump them with parallel_for_each,
+ *   against a plain iterator walk.
+ */
+void bench_parallel() {
+  Map map;
+  fill(map, elements);
+  printf("parallel algorithms, %d elements\n", (int)map.size());
+  printf("%8s %12s %10s %12s %10s\n", "threads", "reduce(ms)", "speedup", "for_each(ms)", "speedup");
+  size_t sum = 0;
+  double start = now();
+  for (Map::const_iterator it = map.cbegin(); it != map.cend(); ++it) {
+    sum += it->second;
+  }
+  double walk = now() - start;
+  sink += sum;
+  printf("%8s %12.1f %10.2f\n", "walk", walk, 1.0);
+  for (unsigned threads = 1; threads; threads = next_threads(threads)) {
+    Map::parallel_threads = threads;
+    start = now();
+    sink += map.parallel_reduce(map.cbegin(), map.cend(), (size_t)0,
+                                [](size_t s, const Map::value_type &x) { return s + x.second; });
+    double reduce = now() - start;
+    start = now();
+    map.parallel_for_each(map.begin(), map.end(), [](Map::value_type &x) { ++x.second; });
+    double for_each = now() - start;
+    printf("%8u %12.1f %10.2f %12.1f %10.2f\n", threads, reduce, walk / reduce, for_each, walk / for_each);
+  }
+  Map::parallel_threads = 0;
+  puts("");
+}
+
+/**
+ * sum the values of a map filled in random order, so that neighbours in key
+ *   order are scattered over memory: through ++, a prefetch_iterator and scan,
+ *   then downwards through a reverse iterator and reverse_scan.
+ */
+void bench_range() {
+  Map map;
+  fill(map, elements);
+  printf("range scan, %d elements in random order, best of 5\n", (int)map.size());
+  printf("%16s %12s %10s\n", "method", "ns/element", "speedup");
+  double walk = 1e18, adaptor = 1e18, scan = 1e18, down = 1e18, reverse = 1e18;
+  for (int round = 0; round < 5; round++) {
+    size_t sum = 0;
+    double start = now();
+    for (Map::const_iterator it = map.cbegin(); it != map.cend(); ++it) {
+      sum += it->second;
+    }
+    double time = now() - start;
+    if (time < walk) walk = time;
+    start = now();
+    for (Map::prefetch_iterator it = map.prefetching(map.cbegin(), map.cend()); it != map.cend(); ++it) {
+      sum += it->second;
+    }
+    time = now() - start;
+    if (time < adaptor) adaptor = time;
+    start = now();
+    map.scan(0, RAND_MAX, [&sum](Map::value_type *const *batch, size_t n) {
+      for (size_t i = 0; i < n; i++) {
+        sum += batch[i]->second;
+      }
+    });
+    time = now() - start;
+    if (time < scan) scan = time;
+    start = now();
+    for (Map::const_reverse_iterator it = map.crbegin(); it != map.crend(); ++it) {
+      sum += it->second;
+    }
+    time = now() - start;
+    if (time < down) down = time;
+    start = now();
+    map.reverse_scan(0, RAND_MAX, [&sum](Map::value_type *const *batch, size_t n) {
+      for (size_t i = 0; i < n; i++) {
+        sum += batch[i]->second;
+      }
+    });
+    time = now() - start;
+    if (time < reverse) reverse = time;
+    sink += sum;
+  }
+  printf("%16s %12.2f %10.2f\n", "iterator", walk * 1e6 / map.size(), 1.0);
+  printf("%16s %12.2f %10.2f\n", "prefetching", adaptor * 1e6 / map.size(), walk / adaptor);
+  printf("%16s %12.2f %10.2f\n", "scan", scan * 1e6 / map.size(), walk / scan);
+  printf("%16s %12.2f %10.2f\n", "reverse iterator", down * 1e6 / map.size(), 1.0);
+  printf("%16s %12.2f %10.2f\n", "reverse scan", reverse * 1e6 / map.size(), down / reverse);
+  puts("");
+}
+
+/**
+ * the way a map used to be shared: every call under one mutex.
+ */
+struct locked_map {
+  std::mutex lock;
+  Map content;
+
+  size_t count(int key) {
+    std::lock_guard<std::mutex> guard(lock);
+    return content.count(key);
+  }
+
+  void insert(const Map::value_type &value) {
+    std::lock_guard<std::mutex> guard(lock);
+    content.insert(value);
+  }
+
+  void erase(int key) {
+    std::lock_guard<std::mutex> guard(lock);
+    Map::iterator it = content.find(key);
+    if (it != content.end()) content.erase(it);
+  }
+};
+
+/**
+ * elements operations split over threads threads, read percent of them
+ *   lookups, the rest an insert or an erase of a random key; return Mops/s.
+ */
+template<class Shared>
+double run_mix(Shared &shared, unsigned threads, int read) {
+  std::thread *workers = new std::thread[threads];
+  double start = now();
+  for (unsigned t = 0; t < threads; t++) {
+    workers[t] = std::thread([&shared, threads, read, t]() {
+      unsigned seed = t * 7919 + read;
+      size_t found = 0;
+      for (int i = 0; i < elements / (int)threads; i++) {
+        int key = rand_r(&seed) % (2 * elements);
+        if ((int)(rand_r(&seed) % 100) < read) {
+          found += shared.count(key);
+        } else if (rand_r(&seed) % 2) {
+          shared.insert(Map::value_type(key, i));
+        } else {
+          shared.erase(key);
+        }
+      }
+      sink += found;
+    });
+  }
+  for (unsigned t = 0; t < threads; t++) workers[t].join();
+  double time = now() - start;
+  delete[] workers;
+  return elements / time / 1000;
+}
+
+void bench_concurrent() {
+  typedef sjtu::concurrent_map<int, int> Concurrent;
+  typedef sjtu::concurrent_map<int, int, std::less<int>, sjtu::avl_balance, true, true> Optimistic;
+  const int reads[] = {100, 90, 50, 10};
+  locked_map locked;
+  Concurrent concurrent;
+  Optimistic optimistic;
+  srand(1);
+  for (int i = 0; i < elements; i++) {
+    int key = rand() % (2 * elements);
+    locked.content.insert(Map::value_type(key, i));
+    concurrent.insert(Map::value_type(key, i));
+    optimistic.insert(Map::value_type(key, i));
+  }
+  printf("shared map, %d operations per row, Mops/s\n", elements);
+  printf("%8s %8s %12s %14s %12s\n", "threads", "reads", "mutex", "reader-writer", "optimistic");
+  for (unsigned threads = 1; threads; threads = next_threads(threads)) {
+    for (int read : reads) {
+      char mix[16];
+      snprintf(mix, sizeof(mix), "%d%%", read);
+      double a = run_mix(locked, threads, read);
+      double b = run_mix(concurrent, threads, read);
+      double c = run_mix(optimistic, threads, read);
+      printf("%8u %8s %12.2f %14.2f %12.2f\n", threads, mix, a, b, c);
+    }
+  }
+  puts("");
+}
+
+void bench_sharded() {
+  typedef sjtu::concurrent_map<int, int> Concurrent;
+  typedef sjtu::sharded_map<int, int> Sharded;
+  const int reads[] = {90, 50, 10};
+  Concurrent concurrent;
+  Sharded sharded;
+  srand(1);
+  for (int i = 0; i < elements; i++) {
+    int key = rand() % (2 * elements);
+    concurrent.insert(Map::value_type(key, i));
+    sharded.insert(Map::value_type(key, i));
+  }
+  printf("sharded map, %d operations per row, %zu shards, Mops/s\n", elements, sharded.shard_count());
+  printf("%8s %8s %14s %12s\n", "threads", "reads", "reader-writer", "sharded");
+  for (unsigned threads = 1; threads; threads = next_threads(threads)) {
+    for (int read : reads) {
+      char mix[16];
+      snprintf(mix, sizeof(mix), "%d%%", read);
+      double a = run_mix(concurrent, threads, read);
+      double b = run_mix(sharded, threads, read);
+      printf("%8u %8s %14.2f %12.2f\n", threads, mix, a, b);
+    }
+  }
+  puts("");
+}
+
+void bench_skiplist() {
+  typedef sjtu::skiplist_map<int, int> Skiplist;
+  const int reads[] = {90, 50, 10};
+  locked_map locked;
+  Skiplist skiplist;
+  srand(1);
+  for (int i = 0; i < elements; i++) {
+    int key = rand() % (2 * elements);
+    locked.content.insert(Map::value_type(key, i));
+    skiplist.insert(Map::value_type(key, i));
+  }
+  printf("skiplist map, %d operations per row, Mops/s\n", elements);
+  printf("%8s %8s %12s %12s\n", "threads", "reads", "mutex", "skiplist");
+  for (unsigned threads = 1; threads; threads = next_threads(threads)) {
+    for (int read : reads) {
+      char mix[16];
+      snprintf(mix, sizeof(mix), "%d%%", read);
+      double a = run_mix(locked, threads, read);
+      double b = run_mix(skiplist, threads, read);
+      printf("%8u %8s %12.2f %12.2f\n", threads, mix, a, b);
+    }
+  }
+  puts("");
+}
+
+void bench_buffered() {
+  typedef sjtu::concurrent_map<int, int> Concurrent;
+  typedef sjtu::buffered_map<int, int> Merged;
+  typedef sjtu::buffered_map<int, int, std::less<int>, sjtu::avl_balance, true, true> Flushing;
+  const int reads[] = {0, 10, 50};
+  Concurrent concurrent;
+  Merged merged;
+  Flushing flushing;
+  srand(1);
+  for (int i = 0; i < elements; i++) {
+    int key = rand() % (2 * elements);
+    concurrent.insert(Map::value_type(key, i));
+    merged.insert(Map::value_type(key, i));
+    flushing.insert(Map::value_type(key, i));
+  }
+  merged.flush();
+  flushing.flush();
+  printf("write-combining map, %d operations per row, buffers of %zu keys, Mops/s\n",
+         elements, Merged::buffer_capacity);
+  printf("%8s %8s %14s %12s %14s\n", "threads", "reads", "reader-writer", "buffered", "flush-on-read");
+  for (unsigned threads = 1; threads; threads = next_threads(threads)) {
+    for (int read : reads) {
+      char mix[16];
+      snprintf(mix, sizeof(mix), "%d%%", read);
+      double a = run_mix(concurrent, threads, read);
+      double b = run_mix(merged, threads, read);
+      merged.flush();
+      double c = run_mix(flushing, threads, read);
+      flushing.flush();
+      printf("%8u %8s %14.2f %12.2f %14.2f\n", threads, mix, a, b, c);
+    }
+  }
+  puts("");
+}
+
+/**
+ * lookups where a share of the keys is missing: at() and catch against
+ *   find_ptr, try_at and contains, which cost a miss the descent only.
+ */
+void bench_miss() {
+  Map map;
+  std::vector<int> present, keys(elements);
+  for (int i = 0; i < elements; i++) {
+    present.push_back(rand() / 2 * 2);
+    map[present.back()] = i;
+  }
+  printf("lookups, %d elements, Mops/s by share of misses\n", (int)map.size());
+  printf("%8s %12s %12s %12s %12s\n", "misses", "at+catch", "find_ptr", "try_at", "contains");
+  const Map &lookup = map;
+  size_t sum = 0;
+  // warm the tree up, so the first column is not charged for it
+  for (int key : present) sum += lookup.contains(key);
+  const int shares[] = {0, 50, 90, 100};
+  for (int share : shares) {
+    // the map holds even keys only, so an odd one misses
+    for (size_t i = 0; i < keys.size(); i++) {
+      keys[i] = (int)(i % 100) < share ? present[i] | 1 : present[i];
+    }
+    double start = now();
+    for (int key : keys) {
+      try{
+        sum += lookup.at(key);
+      } catch (sjtu::index_out_of_bound &) {
+        ++sum;
+      }
+    }
+    double at = now() - start;
+    start = now();
+    for (int key : keys) {
+      const int *found = lookup.find_ptr(key);
+      sum += found ? *found : 1;
+    }
+    double pointer = now() - start;
+    start = now();
+    for (int key : keys) {
+      int value = 1;
+      lookup.try_at(key, value);
+      sum += value;
+    }
+    double tried = now() - start;
+    start = now();
+    for (int key : keys) sum += lookup.contains(key);
+    double contains = now() - start;
+    sink = sum;
+    double ops = keys.size() / 1e3;
+    printf("%7d%% %12.2f %12.2f %12.2f %12.2f\n", share, ops / at, ops / pointer, ops / tried, ops / contains);
+  }
+  puts("");
+}
+
+/**
+ * a copy of a cow_map and one write to it, against a deep copy of a map,
+ *   and the same with a snapshot; then a full scan and random lookups
+ *   on each, and on a snapshot.
+ */
+void bench_cow() {
+  typedef sjtu::cow_map<int, int> Cow;
+  Map map;
+  fill(map, elements);
+  Cow cow(map);
+  std::vector<int> keys;
+  for (Map::const_iterator it = map.cbegin(); it != map.cend(); ++it) keys.push_back(it->first);
+  printf("copy-on-write, %d elements\n", (int)map.size());
+  printf("%-28s %12s %12s\n", "", "sjtu::map", "cow_map");
+  const int rounds = 1000;
+  double start = now();
+  for (int i = 0; i < 3; i++) {
+    Map copy(map);
+    copy[keys[rand() % keys.size()]] = i;
+  }
+  double deep = (now() - start) / 3;
+  start = now();
+  for (int i = 0; i < rounds; i++) {
+    Cow copy(cow);
+    copy[keys[rand() % keys.size()]] = i;
+  }
+  double shared = (now() - start) / rounds;
+  printf("%-28s %12.3f %12.3f\n", "copy and write, ms", deep, shared);
+  // a reader takes a snapshot while the writer goes on
+  start = now();
+  for (int i = 0; i < rounds; i++) {
+    Cow::view frozen = cow.snapshot();
+    cow[keys[rand() % keys.size()]] = i;
+  }
+  printf("%-28s %12.3f %12.3f\n", "snapshot and write, ms", deep, (now() - start) / rounds);
+  Cow::view frozen = cow.snapshot();
+  start = now();
+  size_t sum = 0;
+  for (Map::const_iterator it = map.cbegin(); it != map.cend(); ++it) sum += it->second;
+  double scan = now() - start;
+  start = now();
+  for (Cow::const_iterator it = cow.cbegin(); it != cow.cend(); ++it) sum += it->second;
+  printf("%-28s %12.1f %12.1f\n", "scan, ms", scan, now() - start);
+  start = now();
+  for (Cow::const_iterator it = frozen.cbegin(); it != frozen.cend(); ++it) sum += it->second;
+  printf("%-28s %12s %12.1f\n", "snapshot scan, ms", "", now() - start);
+  start = now();
+  for (int i = 0; i < 1000000; i++) sum += map.at(keys[rand() % keys.size()]);
+  double lookup = now() - start;
+  start = now();
+  for (int i = 0; i < 1000000; i++) sum += static_cast<const Cow &>(cow).at(keys[rand() % keys.size()]);
+  printf("%-28s %12.2f %12.2f\n", "lookups, Mops/s", 1e3 / lookup, 1e3 / (now() - start));
+  start = now();
+  for (int i = 0; i < 1000000; i++) sum += frozen.at(keys[rand() % keys.size()]);
+  printf("%-28s %12s %12.2f\n", "snapshot lookups, Mops/s", "", 1e3 / (now() - start));
+  sink = sum;
+  puts("");
+}
+
+/**
+ * save a map to memory, then get it back: by load, which builds the tree
+ *   in one pass, against inserting the pairs back one by one, in key order
+ *   as they were saved.
+ */
+void bench_persist() {
+  Map map;
+  fill(map, elements);
+  std::stringstream stream;
+  double start = now();
+  map.save(stream);
+  double save = now() - start;
+  std::string saved = stream.str();
+  printf("save and load, %d elements, %zu bytes, ms\n", (int)map.size(), saved.size());
+  printf("%12s %12s %12s %12s\n", "save", "load", "insert", "speedup");
+  std::stringstream in(saved);
+  Map loaded;
+  start = now();
+  loaded.load(in);
+  double load = now() - start;
+  if (loaded.size() != map.size()) fprintf(stderr, "load lost elements\n");
+  std::vector<Map::value_type> pairs;
+  for (Map::const_iterator it = map.cbegin(); it != map.cend(); ++it) pairs.push_back(*it);
+  Map inserted;
+  start = now();
+  for (const Map::value_type &x : pairs) inserted.insert(x);
+  double insert = now() - start;
+  printf("%12.1f %12.1f %12.1f %11.1fx\n", save, load, insert, insert / load);
+  puts("");
+}
+
+/**
+ * startup from a file: load into a map against mapping it,
+ *   then random lookups on each.
+ */
+void bench_mapped() {
+  typedef sjtu::mapped_map<int, int> Mapped;
+  const char *saved = "benchmark_saved.bin";
+  const char *flat = "benchmark_mapped.bin";
+  Map map;
+  fill(map, elements);
+  {
+    std::ofstream out(saved, std::ios::binary);
+    map.save(out);
+  }
+  double start = now();
+  Mapped::write(map, flat);
+  double write = now() - start;
+  printf("startup from a file, %d elements: write, load and open in ms, then lookups in Mops/s\n", (int)map.size());
+  printf("%12s %12s %12s %12s %12s\n", "write", "load", "open", "map", "mapped");
+  start = now();
+  Map loaded;
+  {
+    std::ifstream in(saved, std::ios::binary);
+    loaded.load(in);
+  }
+  double load = now() - start;
+  start = now();
+  Mapped mapped(flat);
+  double open = now() - start;
+  std::vector<int> keys;
+  srand(3);
+  for (int i = 0; i < elements; i++) keys.push_back(rand());
+  size_t found = 0;
+  start = now();
+  for (int key : keys) found += loaded.count(key);
+  double tree = elements / (now() - start) / 1000;
+  start = now();
+  for (int key : keys) found += mapped.count(key);
+  double flat_lookups = elements / (now() - start) / 1000;
+  sink = found;
+  printf("%12.1f %12.1f %12.3f %12.2f %12.2f\n", write, load, open, tree, flat_lookups);
+  std::remove(saved);
+  std::remove(flat);
+  puts("");
+}
+
+/**
+ * each of threads threads assigns its share of writes random keys,
+ *   return the writes per second.
+ */
+template<class Durable>
+double run_durable(unsigned threads, int writes) {
+  const char *path = "benchmark_durable";
+  double time;
+  {
+    Durable map(path);
+    std::vector<std::thread> pool;
+    double start = now();
+    for (unsigned t = 0; t < threads; t++) {
+      pool.emplace_back([&map, t, threads, writes]() {
+        unsigned seed = t + 1;
+        for (int i = t; i < writes; i += threads) map.assign(rand_r(&seed), i);
+      });
+    }
+    for (std::thread &t : pool) t.join();
+    time = now() - start;
+  }
+  std::remove((std::string(path) + ".checkpoint").c_str());
+  for (int g = 1; g < 100; g++) std::remove((std::string(path) + ".log." + std::to_string(g)).c_str());
+  return writes / time * 1000;
+}
+
+/**
+ * durable writes with and without group commit. writers mostly wait
+ *   on the disk, so the thread counts do not stop at the cores.
+ */
+void bench_durable() {
+  typedef sjtu::durable_map<int, int> Grouped;
+  typedef sjtu::durable_map<int, int, std::less<int>, sjtu::avl_balance, true, false> Single;
+  const unsigned threads[] = {1, 4, 16, 64};
+  int writes = elements / 100;
+  printf("durable writes, %d per row, writes/s\n", writes);
+  printf("%8s %14s %14s %10s\n", "threads", "group commit", "sync each", "speedup");
+  for (unsigned t : threads) {
+    double a = run_durable<Grouped>(t, writes);
+    double b = run_durable<Single>(t, writes);
+    printf("%8u %14.0f %14.0f %9.1fx\n", t, a, b, a / b);
+  }
+  puts("");
+}
+
+/**
+ * one process publishes a map to shared memory, others attach:
+ *   what that costs, and the memory each attached process no longer holds.
+ */
+void bench_shared() {
+  typedef sjtu::mapped_map<int, int> Mapped;
+  const char *name = "/sjtu_map_benchmark";
+  Map map;
+  fill(map, elements);
+  double start = now();
+  Mapped::publish(map, name);
+  double publish = now() - start;
+  start = now();
+  Mapped attached = Mapped::attach(name);
+  double attach = now() - start;
+  std::vector<int> keys;
+  srand(3);
+  for (int i = 0; i < elements; i++) keys.push_back(rand());
+  size_t found = 0;
+  start = now();
+  for (int key : keys) found += attached.count(key);
+  double lookups = elements / (now() - start) / 1000;
+  sink = found;
+  Mapped::unpublish(name);
+  double shared = attached.bytes() / 1048576.0;
+  double own = map.size() * sizeof(Map::node) / 1048576.0;
+  printf("shared memory map, %d elements: publish and attach in ms, lookups in Mops/s, memory in MiB\n", (int)map.size());
+  printf("%12s %12s %12s %14s %14s\n", "publish", "attach", "lookups", "shared once", "map a process");
+  printf("%12.1f %12.3f %12.2f %14.1f %14.1f\n", publish, attach, lookups, shared, own);
+  puts("");
+}
+
+/**
+ * drop the pages of the file at path from the kernel's cache,
+ *   so the next reads go to the disk.
+ */
+void drop_cache(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+/**
+ * a paged map ten times the size of its buffer pool: cold scans prefetching
+ *   0, 8 and 32 leaves ahead, random lookups over all of it, and lookups
+ *   in a working set that fits the pool, against sjtu::map.
+ */
+void bench_paged() {
+  typedef sjtu::paged_map<int, int> Paged;
+  const char *path = "benchmark_paged.bin";
+  std::remove(path);
+  std::vector<int> keys;
+  srand(1);
+  for (int i = 0; i < elements; i++) keys.push_back(rand());
+  // about 360 elements to a leaf, filled two thirds on average
+  size_t pool = std::max<size_t>(Paged::min_pool, elements / 360 / 10);
+  double start = now();
+  {
+    Paged map(path, pool);
+    for (int i = 0; i < elements; i++) map.assign(keys[i], i);
+  }
+  double build = elements / (now() - start) / 1000;
+  struct stat status;
+  stat(path, &status);
+  size_t pages = status.st_size / Paged::page_size;
+  printf("paged map, %d elements in %zu pages, a pool of %zu pages (%.1fx smaller)\n",
+         elements, pages, pool, (double)pages / pool);
+  printf("%-28s %12s %12s\n", "", "result", "page reads");
+  printf("%-28s %6.2f Mops/s %12s\n", "build by assign", build, "");
+  Paged map(path, pool);
+  const unsigned prefetch[] = {0, 8, 32};
+  for (unsigned leaves : prefetch) {
+    Paged::prefetch_leaves = leaves;
+    drop_cache(path);
+    size_t reads = map.page_reads();
+    start = now();
+    size_t sum = 0;
+    for (Paged::const_iterator it = map.cbegin(); it != map.cend(); ++it) sum += it->second;
+    sink = sum;
+    char name[32];
+    snprintf(name, sizeof(name), "cold scan, prefetch %u", leaves);
+    printf("%-28s %9.1f ms %12zu\n", name, now() - start, map.page_reads() - reads);
+  }
+  Paged::prefetch_leaves = 8;
+  std::vector<int> probes;
+  for (int i = 0; i < elements; i++) probes.push_back(keys[rand() % elements]);
+  size_t found = 0;
+  size_t reads = map.page_reads();
+  start = now();
+  for (int key : probes) found += map.count(key);
+  printf("%-28s %6.2f Mops/s %12zu\n", "lookups, all keys", elements / (now() - start) / 1000, map.page_reads() - reads);
+  // the keys of the first leaves, a third of the pool's worth
+  std::vector<int> sorted(keys);
+  std::sort(sorted.begin(), sorted.end());
+  sorted.resize(std::min<size_t>(sorted.size(), pool / 3 * 240));
+  Map memory;
+  for (int key : sorted) memory.insert(Map::value_type(key, 0));
+  probes.clear();
+  for (int i = 0; i < elements; i++) probes.push_back(sorted[rand() % sorted.size()]);
+  for (int key : sorted) found += map.count(key);
+  reads = map.page_reads();
+  start = now();
+  for (int key : probes) found += map.count(key);
+  printf("%-28s %6.2f Mops/s %12zu\n", "lookups, working set", elements / (now() - start) / 1000, map.page_reads() - reads);
+  start = now();
+  for (int key : probes) found += memory.count(key);
+  printf("%-28s %6.2f Mops/s %12s\n", "same keys, sjtu::map", elements / (now() - start) / 1000, "");
+  sink = found;
+  std::remove(path);
+  puts("");
+}
+
+struct section {
+  const char *name;
+  void (*run)();
+};
+
+const section sections[] = {
+        {"copy", bench_copy},
+        {"cow", bench_cow},
+        {"balance", bench_balance},
+        {"bulk", bench_bulk},
+        {"batch", bench_batch},
+        {"scan", bench_scan},
+        {"parallel", bench_parallel},
+        {"range", bench_range},
+        {"concurrent", bench_concurrent},
+        {"sharded", bench_sharded},
+        {"skiplist", bench_skiplist},
+        {"buffered", bench_buffered},
+        {"miss", bench_miss},
+        {"persist", bench_persist},
+        {"mapped", bench_mapped},
+        {"shared", bench_shared},
+        {"durable", bench_durable},
+        {"paged", bench_paged},
+};
+
+int main(int argc, char **argv) {
+  const char *which = argc > 1 ? argv[1] : "all";
+  if (argc > 2) elements = atoi(argv[2]);
+  max_threads = argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+  if (max_threads == 0) max_threads = 1;
+  bool found = false;
+  for (const section &s : sections) {
+    if (!strcmp(which, "all") || !strcmp(which, s.name)) {
+      s.run();
+      found = true;
+    }
+  }
+  if (!found) {
+    fprintf(stderr, "unknown section %s\n", which);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,339 @@
+/**
+ * a write-combining front end of sjtu::map
+ */
+#ifndef SJTU_BUFFERED_MAP_HPP
+#define SJTU_BUFFERED_MAP_HPP
+
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
+#include "map.hpp"
+
+namespace sjtu {
+
+/**
+ * any number of threads may call any member at once.
+ *
+ * a write does not touch the shared map: it is recorded in a sorted buffer
+ *   of the writing thread's own, where it combines with the earlier writes
+ *   to the same key (an erase after an assign leaves one erase, and so on).
+ *   a buffer that reaches buffer_capacity keys is merged into the shared map
+ *   under one exclusive lock, in key order; flush() merges every buffer.
+ *   so a writer takes the shared lock once per buffer_capacity keys,
+ *   and otherwise only the lock of its own buffer, which nobody else
+ *   takes but a reader or a flush.
+ *
+ * reads see the buffered writes:
+ *   by default through a merged view, the shared map overlaid with every
+ *   buffer (the reader's own first), at the price of looking into each
+ *   non-empty buffer; with FlushOnRead, a read that finds anything
+ *   buffered flushes first and then reads the shared map alone.
+ * the writes of one thread take effect in its order; writes to the same key
+ *   by different threads between two flushes take effect in the order
+ *   their buffers are merged, and until then the merged view shows
+ *   the reader's own, or else any one of them.
+ *
+ * a thread's buffer is found through a small per-thread cache and outlives
+ *   the thread, so whatever it left buffered is merged by the next flush.
+ */
+template<
+        class Key,
+        class T,
+        class Compare = std::less<Key>,
+        class Balance = avl_balance,
+        bool Checked = true,
+        bool FlushOnRead = false
+>
+class buffered_map {
+ public:
+  typedef map<Key, T, Compare, Balance, Checked> base;
+  typedef typename base::value_type value_type;
+
+  inline static size_t buffer_capacity = 256;
+
+ private:
+  enum operation { assigned, inserted, erased };
+
+  /**
+   * what a buffer holds for a key: the net effect of the writes to it.
+   */
+  struct record {
+    operation op;
+    std::optional<T> value;
+  };
+
+  typedef map<Key, record, Compare, Balance, Checked> records;
+
+  struct alignas(64) buffer {
+    std::mutex lock;
+    std::thread::id owner;
+    std::atomic<size_t> size{0};
+    records pending;
+    buffer *next = nullptr;
+  };
+
+  struct alignas(64) padded_lock {
+    mutable std::shared_mutex lock;
+  };
+
+  inline static std::atomic<unsigned long long> serials{0};
+
+  padded_lock guard;
+  unsigned long long serial;
+  std::atomic<buffer *> buffers{nullptr};
+  mutable base content;
+
+  /**
+   * the buffer of this thread, made on first use.
+   * the cache holds the last few maps the thread wrote to, by serial,
+   *   so a map at the address of a destroyed one is never mistaken for it.
+   */
+  buffer &mine() {
+    struct cached {
+      unsigned long long serial = 0;
+      buffer *b = nullptr;
+    };
+    static constexpr unsigned cache_size = 4;
+    static thread_local cached cache[cache_size];
+    static thread_local unsigned victim = 0;
+    for (const cached &c : cache) {
+      if (c.serial == serial) { return *c.b; }
+    }
+    std::thread::id me = std::this_thread::get_id();
+    buffer *b = buffers.load();
+    while (b && b->owner != me) { b = b->next; }
+    if (!b) {
+      b = new buffer;
+      b->owner = me;
+      b->next = buffers.load();
+      while (!buffers.compare_exchange_weak(b->next, b)) {}
+    }
+    cache[victim] = cached{serial, b};
+    victim = (victim + 1) % cache_size;
+    return *b;
+  }
+
+  /**
+   * fold a write into what r already holds for its key.
+   */
+  static void combine(record &r, operation op, const T *value) {
+    if (op == inserted && r.op != erased) { return; }
+    r.op = op == inserted ? assigned : op;
+    if (value) {
+      r.value = *value;
+    } else {
+      r.value.reset();
+    }
+  }
+
+  void apply(const Key &key, const record &r) const {
+    if (r.op == assigned) {
+      content[key] = *r.value;
+    } else if (r.op == inserted) {
+      content.insert(value_type(key, *r.value));
+    } else {
+      typename base::iterator it = content.find(key);
+      if (it != content.end()) { content.erase(it); }
+    }
+  }
+
+  /**
+   * move what b holds into the shared map; the caller holds the shared lock
+   *   to itself, so no reader sees a write in both places or in neither.
+   */
+  void merge(buffer &b) const {
+    records taken;
+    {
+      std::lock_guard<std::mutex> lock(b.lock);
+      taken.concatenate(std::move(b.pending));
+      b.size.store(0, std::memory_order_relaxed);
+    }
+    for (typename records::const_iterator it = taken.cbegin(); it != taken.cend(); ++it) {
+      apply(it->first, it->second);
+    }
+  }
+
+  void record_write(const Key &key, operation op, const T *value) {
+    buffer &b = mine();
+    size_t size;
+    {
+      std::lock_guard<std::mutex> lock(b.lock);
+      typename records::iterator it = b.pending.find(key);
+      if (it == b.pending.end()) {
+        record r{op, std::nullopt};
+        if (value) { r.value = *value; }
+        b.pending.insert(typename records::value_type(key, r));
+      } else {
+        combine(it->second, op, value);
+      }
+      size = b.pending.size();
+      b.size.store(size, std::memory_order_relaxed);
+    }
+    if (size >= buffer_capacity) {
+      std::unique_lock<std::shared_mutex> lock(guard.lock);
+      merge(b);
+    }
+  }
+
+  bool buffered() const {
+    for (buffer *b = buffers.load(); b; b = b->next) {
+      if (b->size.load(std::memory_order_relaxed)) { return true; }
+    }
+    return false;
+  }
+
+  /**
+   * with FlushOnRead, flush if anything is buffered.
+   */
+  void before_read() const {
+    if (FlushOnRead && buffered()) { flush(); }
+  }
+
+  /**
+   * the value of key as the merged view has it, if key is there;
+   *   the caller holds the shared lock.
+   */
+  std::optional<T> look(const Key &key) const {
+    typename base::const_iterator shared = content.find(key);
+    std::optional<T> found;
+    if (shared != content.cend()) { found = shared->second; }
+    if (FlushOnRead) { return found; }
+    buffer *own = nullptr;
+    std::thread::id me = std::this_thread::get_id();
+    for (buffer *b = buffers.load(); b; b = b->next) {
+      if (b->owner == me) { own = b; }
+    }
+    bool recorded = false;
+    auto consult = [&](buffer *b) {
+      if (!b || recorded || !b->size.load(std::memory_order_relaxed)) { return; }
+      std::lock_guard<std::mutex> lock(b->lock);
+      typename records::const_iterator it = b->pending.find(key);
+      if (it == b->pending.cend()) { return; }
+      recorded = true;
+      if (it->second.op == erased) {
+        found.reset();
+      } else if (it->second.op == assigned || !found) {
+        found = it->second.value;
+      }
+    };
+    consult(own);
+    for (buffer *b = buffers.load(); b && !recorded; b = b->next) {
+      if (b != own) { consult(b); }
+    }
+    return found;
+  }
+
+ public:
+  buffered_map() : serial(++serials) {}
+
+  buffered_map(const buffered_map &other) = delete;
+
+  buffered_map &operator=(const buffered_map &other) = delete;
+
+  /**
+   * nobody may use a map while it is destroyed,
+   *   so whatever is still buffered is dropped with it.
+   */
+  ~buffered_map() {
+    buffer *b = buffers.load();
+    while (b) {
+      buffer *next = b->next;
+      delete b;
+      b = next;
+    }
+  }
+
+  /**
+   * merge every buffer into the shared map, under one exclusive lock.
+   * what the map holds stays the same, only where it is held changes.
+   */
+  void flush() const {
+    std::unique_lock<std::shared_mutex> lock(guard.lock);
+    for (buffer *b = buffers.load(); b; b = b->next) {
+      if (b->size.load(std::memory_order_relaxed)) { merge(*b); }
+    }
+  }
+
+  /**
+   * insert value unless its key is there by the time the buffer is merged.
+   */
+  void insert(const value_type &value) {
+    record_write(value.first, inserted, &value.second);
+  }
+
+  /**
+   * insert key or overwrite its value.
+   */
+  void assign(const Key &key, const T &value) {
+    record_write(key, assigned, &value);
+  }
+
+  void erase(const Key &key) {
+    record_write(key, erased, nullptr);
+  }
+
+  /**
+   * copy the value of key into value, return false if key does not exist.
+   */
+  bool find(const Key &key, T &value) const {
+    before_read();
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    std::optional<T> found = look(key);
+    if (!found) { return false; }
+    value = *found;
+    return true;
+  }
+
+  size_t count(const Key &key) const {
+    before_read();
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    return look(key).has_value() ? 1 : 0;
+  }
+
+  /**
+   * throw index_out_of_bound if key does not exist.
+   */
+  T at(const Key &key) const {
+    before_read();
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    if (std::optional<T> found = look(key)) { return *found; }
+    index_out_of_bound index_out_of_bound;
+    throw index_out_of_bound;
+  }
+
+  T operator[](const Key &key) const {
+    return at(key);
+  }
+
+  /**
+   * flush, then call fn(map) with the shared map shared with other readers,
+   *   return what fn returns.
+   */
+  template<class Fn>
+  auto read(Fn fn) const {
+    flush();
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    return fn(static_cast<const base &>(content));
+  }
+
+  /**
+   * a copy of the whole map with everything buffered so far in it.
+   */
+  base snapshot() const {
+    return read([](const base &map) { return map; });
+  }
+
+  size_t size() const {
+    return read([](const base &map) { return map.size(); });
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,385 @@
+/**
+ * a thread-safe front end of sjtu::map
+ */
+#ifndef SJTU_CONCURRENT_MAP_HPP
+#define SJTU_CONCURRENT_MAP_HPP
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+#include "map.hpp"
+#include "epoch.hpp"
+
+namespace sjtu {
+
+/**
+ * any number of threads may call any member at once:
+ *   readers share the map, a writer has it to itself.
+ *
+ * nothing that points into the map (an iterator, a reference to a value)
+ *   can leave the lock, so lookups return copies, writes that need the old
+ *   value take a function, and whatever else should run under one lock
+ *   goes through read(fn) or write(fn).
+ * the batched inserts and erases take the lock once for the whole batch.
+ *
+ * the lock sits on a cache line of its own, so taking it does not
+ *   invalidate the line holding the map's root and size for the other cores.
+ *
+ * with Optimistic, find, count and at take no lock, seqlock style:
+ *   writers, still one at a time, make a version odd while they work,
+ *   a reader searches the tree as it is and starts over if the version
+ *   moved meanwhile. many readers then share no cache line that is written
+ *   on every read, only writers touch the lock.
+ * so that a reader never follows a pointer into freed memory,
+ *   readers pin themselves in an epoch_domain of the map's own while they
+ *   search, and the nodes writers erase are retired to it.
+ * the reader compares keys and copies a value before it knows the copy
+ *   is consistent, so Optimistic needs a trivially copyable Key and T.
+ * as with any seqlock, readers rely on words being loaded and stored whole:
+ *   links are loaded with acquire and stored with release (see node_link),
+ *   and values are copied a word at a time with relaxed atomics by
+ *   find, assign and update. a value changed through write(fn) is not,
+ *   so a reader racing with it is formally a data race.
+ */
+template<
+        class Key,
+        class T,
+        class Compare = std::less<Key>,
+        class Balance = avl_balance,
+        bool Checked = true,
+        bool Optimistic = false
+>
+class concurrent_map {
+ public:
+  typedef map<Key, T, Compare, Balance, Checked, Optimistic> base;
+  typedef typename base::value_type value_type;
+
+ private:
+  struct alignas(64) padded_lock {
+    mutable std::shared_mutex lock;
+  };
+
+  struct alignas(64) padded_version {
+    std::atomic<unsigned long long> count{2};
+  };
+
+  padded_lock guard;
+  padded_version version;
+  mutable epoch_domain epochs;
+  alignas(64) base content;
+
+  /**
+   * copy a value a word at a time with relaxed atomics, so that a reader
+   *   copying it while the writer stores it is no data race;
+   *   a torn copy is thrown away by the version check as before.
+   */
+  static void copy_words(T &to, const T &from) {
+#ifdef __GNUC__
+    typedef typename std::conditional<alignof(T) % sizeof(unsigned long) == 0 && sizeof(T) % sizeof(unsigned long) == 0,
+            unsigned long,
+            typename std::conditional<alignof(T) % sizeof(unsigned) == 0 && sizeof(T) % sizeof(unsigned) == 0,
+                    unsigned, unsigned char>::type>::type word;
+    word *target = reinterpret_cast<word *>(&to);
+    const word *source = reinterpret_cast<const word *>(&from);
+    for (size_t i = 0; i < sizeof(T) / sizeof(word); ++i) {
+      __atomic_store_n(target + i, __atomic_load_n(source + i, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    }
+#else
+    std::memcpy(&to, &from, sizeof(T));
+#endif
+  }
+
+  void prepare() {
+    if (Optimistic) { content.reclaim_through(epochs); }
+  }
+
+  /**
+   * call look(map, complete) until it ran with no writer in between,
+   *   return what it returned that time.
+   */
+  template<class Look>
+  auto optimistic(Look look) const {
+    epoch_domain::guard pinned(epochs);
+    for (;;) {
+      unsigned long long start = version.count.load(std::memory_order_acquire);
+      if (start & 1) {
+        std::this_thread::yield();
+        continue;
+      }
+      bool complete;
+      auto result = look(content, complete);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (complete && version.count.load(std::memory_order_relaxed) == start) { return result; }
+    }
+  }
+
+  /**
+   * makes the version odd while a write is under way.
+   */
+  struct writing {
+    concurrent_map *owner;
+
+    explicit writing(concurrent_map *owner) : owner(owner) {
+      if (!Optimistic) { return; }
+      owner->version.count.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    ~writing() {
+      if (!Optimistic) { return; }
+      owner->version.count.fetch_add(1, std::memory_order_release);
+    }
+  };
+
+  /**
+   * call fn() with the map to ourselves, return what fn returns.
+   */
+  template<class Fn>
+  auto exclusive(Fn fn) {
+    std::unique_lock<std::shared_mutex> lock(guard.lock);
+    writing writing(this);
+    return fn();
+  }
+
+ public:
+  concurrent_map() {
+    prepare();
+  }
+
+  explicit concurrent_map(base &&other) : content(std::move(other)) {
+    prepare();
+  }
+
+  explicit concurrent_map(const base &other) : content(other) {
+    prepare();
+  }
+
+  concurrent_map(const concurrent_map &other) : content(other.snapshot()) {
+    prepare();
+  }
+
+  /**
+   * the copy is taken and the old content freed outside our lock,
+   *   under it the trees only change hands in O(1)
+   *   (with Optimistic, the old nodes are retired instead).
+   */
+  concurrent_map &operator=(const concurrent_map &other) {
+    if (this == &other) { return *this; }
+    base copy = other.snapshot();
+    base old;
+    exclusive([&]() {
+      if (Optimistic) {
+        content.clear();
+      } else {
+        old.concatenate(std::move(content));
+      }
+      content.concatenate(std::move(copy));
+    });
+    return *this;
+  }
+
+  /**
+   * call fn(map) with the map shared with other readers, return what fn returns.
+   */
+  template<class Fn>
+  auto read(Fn fn) const {
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    return fn(static_cast<const base &>(content));
+  }
+
+  /**
+   * call fn(map) with the map to itself, return what fn returns.
+   */
+  template<class Fn>
+  auto write(Fn fn) {
+    return exclusive([&]() { return fn(content); });
+  }
+
+  /**
+   * a copy of the whole map, consistent at one point in time.
+   */
+  base snapshot() const {
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    return content;
+  }
+
+  /**
+   * throw index_out_of_bound if key does not exist.
+   */
+  T at(const Key &key) const {
+    if constexpr (Optimistic) {
+      T value;
+      if (find(key, value)) { return value; }
+      index_out_of_bound index_out_of_bound;
+      throw index_out_of_bound;
+    }
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    return content.at(key);
+  }
+
+  T operator[](const Key &key) const {
+    return at(key);
+  }
+
+  /**
+   * copy the value of key into value, return false if key does not exist.
+   */
+  bool find(const Key &key, T &value) const {
+    if constexpr (Optimistic) {
+      static_assert(std::is_trivially_copyable<Key>::value, "optimistic reads compare keys without the lock");
+      static_assert(std::is_trivially_copyable<T>::value, "optimistic reads copy values that may be changing");
+      auto look = [&key](const base &map, bool &complete) {
+        pair<bool, T> result(false, T());
+        if (auto p = map.probe(key, complete)) {
+          result.first = true;
+          copy_words(result.second, p->second);
+        }
+        return result;
+      };
+      pair<bool, T> result = optimistic(look);
+      if (result.first) { value = result.second; }
+      return result.first;
+    }
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    typename base::const_iterator it = content.find(key);
+    if (it == content.cend()) { return false; }
+    value = it->second;
+    return true;
+  }
+
+  size_t count(const Key &key) const {
+    if constexpr (Optimistic) {
+      static_assert(std::is_trivially_copyable<Key>::value, "optimistic reads compare keys without the lock");
+      auto look = [&key](const base &map, bool &complete) { return (size_t)(map.probe(key, complete) != nullptr); };
+      return optimistic(look);
+    }
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    return content.count(key);
+  }
+
+  bool empty() const {
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    return content.empty();
+  }
+
+  size_t size() const {
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    return content.size();
+  }
+
+  /**
+   * as map::scan, with the values read-only.
+   */
+  template<class Visitor>
+  size_t scan(const Key &lo, const Key &hi, Visitor visitor) const {
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    return static_cast<const base &>(content).scan(lo, hi, visitor);
+  }
+
+  void clear() {
+    std::unique_lock<std::shared_mutex> lock(guard.lock);
+    writing writing(this);
+    content.clear();
+  }
+
+  /**
+   * return false if the key already exists, leaving it alone.
+   */
+  bool insert(const value_type &value) {
+    std::unique_lock<std::shared_mutex> lock(guard.lock);
+    writing writing(this);
+    return content.insert(value).second;
+  }
+
+  /**
+   * insert key or overwrite its value.
+   */
+  void assign(const Key &key, const T &value) {
+    std::unique_lock<std::shared_mutex> lock(guard.lock);
+    writing writing(this);
+    if constexpr (Optimistic) {
+      copy_words(content[key], value);
+    } else {
+      content[key] = value;
+    }
+  }
+
+  /**
+   * call fn(value) on the value of key, default-constructing it first
+   *   if key does not exist.
+   * with Optimistic, fn works on a copy that is stored back afterwards.
+   */
+  template<class Fn>
+  void update(const Key &key, Fn fn) {
+    std::unique_lock<std::shared_mutex> lock(guard.lock);
+    writing writing(this);
+    if constexpr (Optimistic) {
+      T &slot = content[key];
+      T value = slot;
+      fn(value);
+      copy_words(slot, value);
+    } else {
+      fn(content[key]);
+    }
+  }
+
+  /**
+   * return the number of erased elements, 0 or 1.
+   */
+  size_t erase(const Key &key) {
+    std::unique_lock<std::shared_mutex> lock(guard.lock);
+    writing writing(this);
+    typename base::iterator it = content.find(key);
+    if (it == content.end()) { return 0; }
+    content.erase(it);
+    return 1;
+  }
+
+  size_t erase_range(const Key &lo, const Key &hi) {
+    std::unique_lock<std::shared_mutex> lock(guard.lock);
+    writing writing(this);
+    return content.erase_range(lo, hi);
+  }
+
+  /**
+   * insert the value_types in [first, last) under one lock,
+   *   return how many were new.
+   * an exception leaves the ones before it inserted.
+   */
+  template<class InputIterator>
+  size_t insert(InputIterator first, InputIterator last) {
+    std::unique_lock<std::shared_mutex> lock(guard.lock);
+    writing writing(this);
+    size_t inserted = 0;
+    for (; first != last; ++first) {
+      if (content.insert(*first).second) { ++inserted; }
+    }
+    return inserted;
+  }
+
+  /**
+   * erase the keys in [first, last) under one lock,
+   *   return how many existed.
+   */
+  template<class InputIterator>
+  size_t erase(InputIterator first, InputIterator last) {
+    std::unique_lock<std::shared_mutex> lock(guard.lock);
+    writing writing(this);
+    size_t erased = 0;
+    for (; first != last; ++first) {
+      typename base::iterator it = content.find(*first);
+      if (it != content.end()) {
+        content.erase(it);
+        ++erased;
+      }
+    }
+    return erased;
+  }
+};
+
+}
+
+#endif
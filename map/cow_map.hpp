@@ -0,0 +1,1198 @@
+/**
+ * a copy-on-write map: copies share nodes, writes copy the paths they touch
+ */
+#ifndef SJTU_COW_MAP_HPP
+#define SJTU_COW_MAP_HPP
+
+#include <atomic>
+#include "map.hpp"
+
+namespace sjtu {
+
+/**
+ * copies share every node in O(1); a write copies the nodes on its path
+ *   that another map or view still reaches, O(log n) of them, and leaves
+ *   the rest shared.
+ *
+ * the tree is an AVL tree of its own, without the in-order threads of
+ *   sjtu::map: a thread ties a node to its neighbours, and a shared node
+ *   cannot point into one copy alone. an iterator finds its neighbour by a
+ *   descent from the root instead, so stepping costs O(log n).
+ *
+ * a node counts the parents and roots pointing at it, and whatever only one
+ *   of them reaches is written in place. it also counts the iterators at it,
+ *   which keep it allocated after it leaves every tree: an iterator whose
+ *   node was copied away by a write finds the copy by its key.
+ *
+ * iterators keep the guarantees of sjtu::map: one stays valid until its
+ *   element is erased, and a write through it copies the path first,
+ *   so it reaches this map alone. a reference to a value (from at(),
+ *   operator[] or *it) must not be written through once the map has been
+ *   copied or snapshotted since it was taken; take it again instead.
+ */
+template<
+        class Key,
+        class T,
+        class Compare = std::less<Key>,
+        bool Checked = true
+>
+class cow_map {
+ public:
+  typedef map<Key, T, Compare> base;
+  typedef typename base::value_type value_type;
+
+ private:
+  static constexpr unsigned long long owner = 1;
+  static constexpr unsigned long long pin = 1ull << 32;
+  static constexpr unsigned long long owners = pin - 1;
+  // above the height of any AVL tree that fits in memory
+  static constexpr int max_height = 96;
+
+  struct node {
+    value_type data;
+    node *left;
+    node *right;
+    int height;
+    /**
+     * the parents and roots pointing here in the low half,
+     *   the iterators here in the high half.
+     */
+    std::atomic<unsigned long long> refs;
+
+    node(const value_type &data, node *left = nullptr, node *right = nullptr, int height = 1)
+            : data(data), left(left), right(right), height(height), refs(owner) {}
+  };
+
+  /**
+   * a root as a map or a view holds it.
+   * shape changes whenever a node leaves the tree, and an iterator that saw
+   *   another shape looks its node up again; shared means some node may be
+   *   reachable from another tree too, so writes must own their paths.
+   */
+  struct tree {
+    node *root = nullptr;
+    size_t number = 0;
+    unsigned long long shape = 0;
+    mutable bool shared = false;
+  };
+
+  static void acquire(node *p) {
+    if (p) { p->refs.fetch_add(owner, std::memory_order_relaxed); }
+  }
+
+  /**
+   * drop a reference from a parent or a root. the last one releases the
+   *   children, and frees the node unless an iterator is still at it.
+   */
+  static void release(node *p) {
+    while (p) {
+      node *left = p->left, *right = p->right;
+      unsigned long long before = p->refs.fetch_sub(owner, std::memory_order_acq_rel);
+      if ((before & owners) != 1) { return; }
+      if (before == owner) { delete p; }
+      release(left);
+      p = right;
+    }
+  }
+
+  static void pin_node(node *p) {
+    if (p) { p->refs.fetch_add(pin, std::memory_order_relaxed); }
+  }
+
+  static void unpin(node *p) {
+    if (p && p->refs.fetch_sub(pin, std::memory_order_acq_rel) == pin) { delete p; }
+  }
+
+  static int height(const node *p) {
+    return p ? p->height : 0;
+  }
+
+  static void update(node *p) {
+    int l = height(p->left), r = height(p->right);
+    p->height = (l > r ? l : r) + 1;
+  }
+
+  static node *rotate_right(node *t) {
+    node *l = t->left;
+    t->left = l->right;
+    l->right = t;
+    update(t);
+    update(l);
+    return l;
+  }
+
+  static node *rotate_left(node *t) {
+    node *r = t->right;
+    t->right = r->left;
+    r->left = t;
+    update(t);
+    update(r);
+    return r;
+  }
+
+  /**
+   * restore the AVL bound at t, whose children differ in height by 2 at most.
+   * every node a rotation writes must be owned by the caller.
+   */
+  static node *balance(node *t) {
+    int diff = height(t->left) - height(t->right);
+    if (diff > 1) {
+      if (height(t->left->left) < height(t->left->right)) { t->left = rotate_left(t->left); }
+      return rotate_right(t);
+    }
+    if (diff < -1) {
+      if (height(t->right->right) < height(t->right->left)) { t->right = rotate_right(t->right); }
+      return rotate_left(t);
+    }
+    update(t);
+    return t;
+  }
+
+  /**
+   * make the node at link reachable from this tree alone, copying it if
+   *   another tree reaches it too; link itself must be owned.
+   * if the copy throws, nothing changes.
+   */
+  static void own(tree &t, node *&link) {
+    node *p = link;
+    if (!p || (p->refs.load(std::memory_order_acquire) & owners) == 1) { return; }
+    node *q = new node(p->data, p->left, p->right, p->height);
+    acquire(p->left);
+    acquire(p->right);
+    link = q;
+    release(p);
+    ++t.shape;
+  }
+
+  /**
+   * own the child of p off the path and its children,
+   *   which is all a rotation at p writes once the path side shrank.
+   */
+  static void own_sibling(tree &t, node *p, bool path_right) {
+    node *&sibling = path_right ? p->left : p->right;
+    own(t, sibling);
+    if (sibling) {
+      own(t, sibling->left);
+      own(t, sibling->right);
+    }
+  }
+
+  static node *locate(const tree &t, const Key &key) {
+    node *p = t.root;
+    Compare compare;
+    while (p) {
+      if (compare(p->data.first, key)) { p = p->right; }
+      else if (compare(key, p->data.first)) { p = p->left; }
+      else { return p; }
+    }
+    return nullptr;
+  }
+
+  /**
+   * the nearest node after key (up) or before it, nullptr if there is none.
+   */
+  static node *neighbour(const tree &t, const Key &key, bool up) {
+    node *p = t.root, *found = nullptr;
+    Compare compare;
+    while (p) {
+      if (up ? compare(key, p->data.first) : compare(p->data.first, key)) {
+        found = p;
+        p = up ? p->left : p->right;
+      } else {
+        p = up ? p->right : p->left;
+      }
+    }
+    return found;
+  }
+
+  /**
+   * the node of the largest key, or of the smallest.
+   */
+  static node *edge(const tree &t, bool largest) {
+    node *p = t.root;
+    while (p && (largest ? p->right : p->left)) { p = largest ? p->right : p->left; }
+    return p;
+  }
+
+  /**
+   * the node of key with the path to it owned, nullptr if key does not exist.
+   */
+  static node *owned(tree &t, const Key &key) {
+    node **link = &t.root;
+    Compare compare;
+    while (*link) {
+      if (t.shared) { own(t, *link); }
+      node *p = *link;
+      if (compare(p->data.first, key)) { link = &p->right; }
+      else if (compare(key, p->data.first)) { link = &p->left; }
+      else { return p; }
+    }
+    return nullptr;
+  }
+
+  /**
+   * insert along an owned path, then rebalance it bottom up.
+   * the rotations after an insert only write nodes on the path.
+   */
+  static pair<node *, bool> insert(tree &t, const value_type &value) {
+    if (t.shared) {
+      if (node *p = locate(t, value.first)) { return pair<node *, bool>(p, false); }
+    }
+    node **path[max_height];
+    int depth = 0;
+    node **link = &t.root;
+    Compare compare;
+    while (*link) {
+      if (t.shared) { own(t, *link); }
+      path[depth++] = link;
+      node *p = *link;
+      if (compare(p->data.first, value.first)) { link = &p->right; }
+      else if (compare(value.first, p->data.first)) { link = &p->left; }
+      else { return pair<node *, bool>(p, false); }
+    }
+    node *fresh = new node(value);
+    *link = fresh;
+    ++t.number;
+    while (depth) {
+      node **l = path[--depth];
+      *l = balance(*l);
+    }
+    return pair<node *, bool>(fresh, true);
+  }
+
+  /**
+   * erase in two passes: the first owns the path to key (and on to its
+   *   successor) with every sibling a rotation may write, and may throw
+   *   without changing anything; the second relinks and rebalances,
+   *   and neither allocates nor compares.
+   */
+  static bool erase(tree &t, const Key &key) {
+    node **path[max_height];
+    int depth = 0;
+    node **link = &t.root;
+    Compare compare;
+    bool shared = t.shared;
+    while (true) {
+      if (!*link) { return false; }
+      if (shared) { own(t, *link); }
+      path[depth++] = link;
+      node *p = *link;
+      if (compare(p->data.first, key)) {
+        if (shared) { own_sibling(t, p, true); }
+        link = &p->right;
+      } else if (compare(key, p->data.first)) {
+        if (shared) { own_sibling(t, p, false); }
+        link = &p->left;
+      } else {
+        break;
+      }
+    }
+    int found = depth - 1;
+    node *x = *path[found];
+    if (x->left && x->right) {
+      if (shared) { own_sibling(t, x, true); }
+      link = &x->right;
+      while (true) {
+        if (shared) { own(t, *link); }
+        path[depth++] = link;
+        node *p = *link;
+        if (!p->left) { break; }
+        if (shared) { own_sibling(t, p, false); }
+        link = &p->left;
+      }
+    }
+    if (depth - 1 == found) {
+      *path[found] = x->left ? x->left : x->right;
+      depth = found;
+    } else {
+      // the successor m takes the place of x
+      node *m = *path[depth - 1];
+      *path[depth - 1] = m->right;
+      m->left = x->left;
+      m->right = x->right;
+      *path[found] = m;
+      if (depth - 1 > found + 1) { path[found + 1] = &m->right; }
+      --depth;
+    }
+    x->left = x->right = nullptr;
+    release(x);
+    --t.number;
+    ++t.shape;
+    while (depth) {
+      node **l = path[--depth];
+      *l = balance(*l);
+    }
+    return true;
+  }
+
+  /**
+   * own the nodes a rotation at p would write, then restore the AVL bound.
+   */
+  static node *rebalance(tree &t, node *p) {
+    int diff = height(p->left) - height(p->right);
+    if (diff > 1) {
+      own(t, p->left);
+      own(t, p->left->right);
+    } else if (diff < -1) {
+      own(t, p->right);
+      own(t, p->right->left);
+    }
+    return balance(p);
+  }
+
+  /**
+   * the tree of l, then the single node m, then r, every key of l less than
+   *   m's and every key of r greater: m goes down the spine of the taller
+   *   one to where the heights meet, O(|height(l) - height(r)|).
+   * l, m and r are references the caller hands over, and the result is one;
+   *   whatever else reaches a node on the way down is left alone, since
+   *   every node written is owned first. on an exception all three go.
+   */
+  static node *join(tree &t, node *l, node *m, node *r) {
+    int hl = height(l), hr = height(r);
+    if (hl <= hr + 1 && hr <= hl + 1) {
+      m->left = l;
+      m->right = r;
+      update(m);
+      return m;
+    }
+    bool down_right = hl > hr;
+    node *&top = down_right ? l : r;
+    try {
+      own(t, top);
+    } catch (...) {
+      release(l);
+      release(m);
+      release(r);
+      throw;
+    }
+    node *&inner = down_right ? top->right : top->left;
+    node *below = inner;
+    inner = nullptr;
+    try {
+      below = down_right ? join(t, below, m, r) : join(t, l, m, below);
+    } catch (...) {
+      release(top);
+      throw;
+    }
+    inner = below;
+    try {
+      return rebalance(t, top);
+    } catch (...) {
+      release(top);
+      throw;
+    }
+  }
+
+  /**
+   * cut the tree p, a reference the caller hands over, into the keys
+   *   less than key, the node of key (nullptr if none) and the keys greater,
+   *   each a reference handed back, by joining the subtrees off the search
+   *   path in O(log n). on an exception p goes and nothing is handed back.
+   */
+  static void split(tree &t, node *p, const Key &key, node *&less, node *&equal, node *&greater) {
+    if (!p) {
+      less = equal = greater = nullptr;
+      return;
+    }
+    Compare compare;
+    bool right, left;
+    try {
+      right = compare(p->data.first, key);
+      left = !right && compare(key, p->data.first);
+      own(t, p);
+    } catch (...) {
+      release(p);
+      throw;
+    }
+    node *l = p->left, *r = p->right;
+    p->left = p->right = nullptr;
+    p->height = 1;
+    node *below;
+    if (right) {
+      try {
+        split(t, r, key, below, equal, greater);
+      } catch (...) {
+        release(l);
+        release(p);
+        throw;
+      }
+      try {
+        less = join(t, l, p, below);
+      } catch (...) {
+        release(equal);
+        release(greater);
+        throw;
+      }
+    } else if (left) {
+      try {
+        split(t, l, key, less, equal, below);
+      } catch (...) {
+        release(r);
+        release(p);
+        throw;
+      }
+      try {
+        greater = join(t, below, p, r);
+      } catch (...) {
+        release(less);
+        release(equal);
+        throw;
+      }
+    } else {
+      less = l;
+      equal = p;
+      greater = r;
+    }
+  }
+
+  static size_t count_nodes(const node *p) {
+    size_t n = 0;
+    for (; p; p = p->right) { n += count_nodes(p->left) + 1; }
+    return n;
+  }
+
+  /**
+   * erase the nodes from first up to end (nullptr for all the rest),
+   *   first coming before end, and return how many went.
+   * one node goes by erase; more are split off at both ends and the rest
+   *   joined back, O(log n) plus the O(k) count of what was cut.
+   * the cuts work on a reference of their own to the root, so every node
+   *   they write is a copy and the tree stays whole until the new root
+   *   replaces it: if a copy throws, nothing changes.
+   */
+  static size_t cut(tree &t, node *first, const node *end) {
+    if (neighbour(t, first->data.first, true) == end) {
+      // a shared node may be freed by another thread once the path is copied
+      Key key = first->data.first;
+      erase(t, key);
+      return 1;
+    }
+    node *less, *equal, *rest, *stop = nullptr, *after = nullptr;
+    acquire(t.root);
+    split(t, t.root, first->data.first, less, equal, rest);
+    if (end) {
+      node *middle;
+      try {
+        split(t, rest, end->data.first, middle, stop, after);
+      } catch (...) {
+        release(less);
+        release(equal);
+        throw;
+      }
+      rest = middle;
+    }
+    size_t erased = count_nodes(rest) + 1;
+    release(equal);
+    release(rest);
+    node *root = stop ? join(t, less, stop, after) : less;
+    release(t.root);
+    t.root = root;
+    t.number -= erased;
+    ++t.shape;
+    return erased;
+  }
+
+  /**
+   * a perfectly balanced tree of the next n elements of it.
+   */
+  static node *build(typename base::const_iterator &it, size_t n) {
+    if (!n) { return nullptr; }
+    node *left = build(it, n / 2);
+    node *p;
+    try {
+      p = new node(*it, left);
+    } catch (...) {
+      release(left);
+      throw;
+    }
+    ++it;
+    try {
+      p->right = build(it, n - n / 2 - 1);
+    } catch (...) {
+      release(p);
+      throw;
+    }
+    update(p);
+    return p;
+  }
+
+  /**
+   * what every iterator holds: its tree, its node (nullptr past the end),
+   *   pinned, and the shape of the tree when the node was last found in it.
+   */
+  class position {
+   public:
+    const tree *owner = nullptr;
+    mutable node *at = nullptr;
+    mutable unsigned long long stamp = 0;
+
+    position() {}
+
+    position(const tree *owner, node *at) : owner(owner), at(at), stamp(owner->shape) {
+      pin_node(at);
+    }
+
+    position(const position &other) : owner(other.owner), at(other.at), stamp(other.stamp) {
+      pin_node(at);
+    }
+
+    position &operator=(const position &other) {
+      pin_node(other.at);
+      unpin(at);
+      owner = other.owner;
+      at = other.at;
+      stamp = other.stamp;
+      return *this;
+    }
+
+    ~position() {
+      unpin(at);
+    }
+
+    void point(node *p) const {
+      pin_node(p);
+      unpin(at);
+      at = p;
+      stamp = owner->shape;
+    }
+
+    /**
+     * the node, looked up again by its key if a node left the tree since.
+     */
+    node *current() const {
+      if (at && stamp != owner->shape) {
+        node *p = locate(*owner, at->data.first);
+        if (Checked && !p) {
+          invalid_iterator invalid_iterator;
+          throw invalid_iterator;
+        }
+        point(p);
+      }
+      return at;
+    }
+
+    /**
+     * step toward larger keys (up) or smaller ones.
+     * toward_end says whether the step heads for the end this iterator
+     *   sits on past its last element: it may land there, but not leave it
+     *   that way; stepping the other way never lands on it.
+     */
+    void move(bool up, bool toward_end) const {
+      if (Checked && !owner) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      node *p = current(), *q = nullptr;
+      if (p) {
+        q = neighbour(*owner, p->data.first, up);
+      } else if (!toward_end) {
+        q = edge(*owner, !up);
+      }
+      if (Checked && (toward_end ? !p : !q)) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      point(q);
+    }
+
+    bool operator==(const position &rhs) const {
+      return owner == rhs.owner && current() == rhs.current();
+    }
+  };
+
+  /**
+   * the node of an iterator, with the path to it owned first if the tree
+   *   is shared, so that a write through it reaches this map alone.
+   */
+  static node *writable(const position &where) {
+    node *p = where.current();
+    if (Checked && !p) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    tree &t = const_cast<tree &>(*where.owner);
+    if (t.shared) { where.point(owned(t, p->data.first)); }
+    return where.at;
+  }
+
+  tree t;
+  unsigned long long revision = 0;
+
+ public:
+  class const_iterator;
+
+  class iterator {
+    friend cow_map;
+    friend const_iterator;
+   private:
+    position where;
+
+    iterator(tree *owner, node *at) : where(owner, at) {}
+
+   public:
+    iterator() {}
+
+    iterator(const iterator &other) = default;
+
+    iterator &operator=(const iterator &other) = default;
+
+    iterator operator++(int) {
+      iterator it(*this);
+      where.move(true, true);
+      return it;
+    }
+
+    iterator &operator++() {
+      where.move(true, true);
+      return *this;
+    }
+
+    iterator operator--(int) {
+      iterator it(*this);
+      where.move(false, false);
+      return it;
+    }
+
+    iterator &operator--() {
+      where.move(false, false);
+      return *this;
+    }
+
+    value_type &operator*() const {
+      return writable(where)->data;
+    }
+
+    value_type *operator->() const {
+      return &writable(where)->data;
+    }
+
+    bool operator==(const iterator &rhs) const {
+      return where == rhs.where;
+    }
+
+    bool operator==(const const_iterator &rhs) const {
+      return where == rhs.where;
+    }
+
+    bool operator!=(const iterator &rhs) const {
+      return !(where == rhs.where);
+    }
+
+    bool operator!=(const const_iterator &rhs) const {
+      return !(where == rhs.where);
+    }
+  };
+
+  class const_iterator {
+    friend cow_map;
+    friend iterator;
+   private:
+    position where;
+
+    const_iterator(const tree *owner, node *at) : where(owner, at) {}
+
+   public:
+    const_iterator() {}
+
+    const_iterator(const const_iterator &other) = default;
+
+    const_iterator(const iterator &other) : where(other.where) {}
+
+    const_iterator &operator=(const const_iterator &other) = default;
+
+    const_iterator operator++(int) {
+      const_iterator it(*this);
+      where.move(true, true);
+      return it;
+    }
+
+    const_iterator &operator++() {
+      where.move(true, true);
+      return *this;
+    }
+
+    const_iterator operator--(int) {
+      const_iterator it(*this);
+      where.move(false, false);
+      return it;
+    }
+
+    const_iterator &operator--() {
+      where.move(false, false);
+      return *this;
+    }
+
+    const value_type &operator*() const {
+      return where.current()->data;
+    }
+
+    const value_type *operator->() const {
+      return &where.current()->data;
+    }
+
+    bool operator==(const iterator &rhs) const {
+      return where == rhs.where;
+    }
+
+    bool operator==(const const_iterator &rhs) const {
+      return where == rhs.where;
+    }
+
+    bool operator!=(const iterator &rhs) const {
+      return !(where == rhs.where);
+    }
+
+    bool operator!=(const const_iterator &rhs) const {
+      return !(where == rhs.where);
+    }
+  };
+
+  class const_reverse_iterator;
+
+  /**
+   * walks the map from the largest key down; rend() is past the smallest.
+   */
+  class reverse_iterator {
+    friend cow_map;
+    friend const_reverse_iterator;
+   private:
+    position where;
+
+    reverse_iterator(tree *owner, node *at) : where(owner, at) {}
+
+   public:
+    reverse_iterator() {}
+
+    reverse_iterator(const reverse_iterator &other) = default;
+
+    reverse_iterator &operator=(const reverse_iterator &other) = default;
+
+    reverse_iterator operator++(int) {
+      reverse_iterator it(*this);
+      where.move(false, true);
+      return it;
+    }
+
+    reverse_iterator &operator++() {
+      where.move(false, true);
+      return *this;
+    }
+
+    reverse_iterator operator--(int) {
+      reverse_iterator it(*this);
+      where.move(true, false);
+      return it;
+    }
+
+    reverse_iterator &operator--() {
+      where.move(true, false);
+      return *this;
+    }
+
+    value_type &operator*() const {
+      return writable(where)->data;
+    }
+
+    value_type *operator->() const {
+      return &writable(where)->data;
+    }
+
+    bool operator==(const reverse_iterator &rhs) const {
+      return where == rhs.where;
+    }
+
+    bool operator==(const const_reverse_iterator &rhs) const {
+      return where == rhs.where;
+    }
+
+    bool operator!=(const reverse_iterator &rhs) const {
+      return !(where == rhs.where);
+    }
+
+    bool operator!=(const const_reverse_iterator &rhs) const {
+      return !(where == rhs.where);
+    }
+  };
+
+  class const_reverse_iterator {
+    friend cow_map;
+    friend reverse_iterator;
+   private:
+    position where;
+
+    const_reverse_iterator(const tree *owner, node *at) : where(owner, at) {}
+
+   public:
+    const_reverse_iterator() {}
+
+    const_reverse_iterator(const const_reverse_iterator &other) = default;
+
+    const_reverse_iterator(const reverse_iterator &other) : where(other.where) {}
+
+    const_reverse_iterator &operator=(const const_reverse_iterator &other) = default;
+
+    const_reverse_iterator operator++(int) {
+      const_reverse_iterator it(*this);
+      where.move(false, true);
+      return it;
+    }
+
+    const_reverse_iterator &operator++() {
+      where.move(false, true);
+      return *this;
+    }
+
+    const_reverse_iterator operator--(int) {
+      const_reverse_iterator it(*this);
+      where.move(true, false);
+      return it;
+    }
+
+    const_reverse_iterator &operator--() {
+      where.move(true, false);
+      return *this;
+    }
+
+    const value_type &operator*() const {
+      return where.current()->data;
+    }
+
+    const value_type *operator->() const {
+      return &where.current()->data;
+    }
+
+    bool operator==(const reverse_iterator &rhs) const {
+      return where == rhs.where;
+    }
+
+    bool operator==(const const_reverse_iterator &rhs) const {
+      return where == rhs.where;
+    }
+
+    bool operator!=(const reverse_iterator &rhs) const {
+      return !(where == rhs.where);
+    }
+
+    bool operator!=(const const_reverse_iterator &rhs) const {
+      return !(where == rhs.where);
+    }
+  };
+
+  cow_map() {}
+
+  /**
+   * build from a plain map in O(n).
+   */
+  explicit cow_map(const base &other) {
+    typename base::const_iterator it = other.cbegin();
+    t.root = build(it, other.size());
+    t.number = other.size();
+  }
+
+  cow_map(const cow_map &other) : revision(other.revision) {
+    t.root = other.t.root;
+    acquire(t.root);
+    t.number = other.t.number;
+    t.shared = other.t.shared = true;
+  }
+
+  cow_map &operator=(const cow_map &other) {
+    if (this == &other) { return *this; }
+    acquire(other.t.root);
+    release(t.root);
+    t.root = other.t.root;
+    t.number = other.t.number;
+    t.shared = other.t.shared = true;
+    ++t.shape;
+    ++revision;
+    return *this;
+  }
+
+  ~cow_map() {
+    release(t.root);
+  }
+
+  /**
+   * a read-only, point-in-time view of a cow_map.
+   * it holds the root it was taken from, so the nodes it reaches stay as
+   *   they were, and can be read from any thread while the map it came
+   *   from goes on being written.
+   */
+  class view {
+    friend cow_map;
+   private:
+    tree t;
+    unsigned long long revision;
+
+    view(const tree &source, unsigned long long revision) : revision(revision) {
+      t.root = source.root;
+      acquire(t.root);
+      t.number = source.number;
+      t.shared = true;
+    }
+
+   public:
+    view(const view &other) : view(other.t, other.revision) {}
+
+    view &operator=(const view &other) {
+      acquire(other.t.root);
+      release(t.root);
+      t.root = other.t.root;
+      t.number = other.t.number;
+      ++t.shape;
+      revision = other.revision;
+      return *this;
+    }
+
+    ~view() {
+      release(t.root);
+    }
+
+    /**
+     * the number of writes the map had seen when the view was taken.
+     */
+    unsigned long long version() const {
+      return revision;
+    }
+
+    const T &at(const Key &key) const {
+      if (node *p = locate(t, key)) { return p->data.second; }
+      index_out_of_bound index_out_of_bound;
+      throw index_out_of_bound;
+    }
+
+    const T &operator[](const Key &key) const {
+      return at(key);
+    }
+
+    const_iterator cbegin() const {
+      return const_iterator(&t, edge(t, false));
+    }
+
+    const_iterator cend() const {
+      return const_iterator(&t, nullptr);
+    }
+
+    const_reverse_iterator crbegin() const {
+      return const_reverse_iterator(&t, edge(t, true));
+    }
+
+    const_reverse_iterator crend() const {
+      return const_reverse_iterator(&t, nullptr);
+    }
+
+    bool empty() const {
+      return t.number == 0;
+    }
+
+    size_t size() const {
+      return t.number;
+    }
+
+    size_t count(const Key &key) const {
+      return locate(t, key) ? 1 : 0;
+    }
+
+    const_iterator find(const Key &key) const {
+      return const_iterator(&t, locate(t, key));
+    }
+  };
+
+  /**
+   * freeze the current content in O(1).
+   * later writes to the map copy the O(log n) nodes on their paths,
+   *   and a node is freed once neither the map nor any view reaches it.
+   */
+  view snapshot() {
+    t.shared = true;
+    return view(t, revision);
+  }
+
+  /**
+   * the number of writes so far.
+   */
+  unsigned long long version() const {
+    return revision;
+  }
+
+  /**
+   * how many maps and views share the root, 0 for an empty map.
+   */
+  int use_count() const {
+    return t.root ? (int)(t.root->refs.load(std::memory_order_relaxed) & owners) : 0;
+  }
+
+  /**
+   * at() and operator[] on a map that is not const hand out a reference
+   *   to write through, so they count as writes: the path is copied if the
+   *   map is shared, and the version moves on, even if the caller only reads.
+   * to read without that, use the const overloads or the three below.
+   */
+  T &at(const Key &key) {
+    ++revision;
+    if (node *p = owned(t, key)) { return p->data.second; }
+    index_out_of_bound index_out_of_bound;
+    throw index_out_of_bound;
+  }
+
+  const T &at(const Key &key) const {
+    if (node *p = locate(t, key)) { return p->data.second; }
+    index_out_of_bound index_out_of_bound;
+    throw index_out_of_bound;
+  }
+
+  T &operator[](const Key &key) {
+    ++revision;
+    if (node *p = owned(t, key)) { return p->data.second; }
+    return insert(t, value_type(key, T())).first->data.second;
+  }
+
+  const T &operator[](const Key &key) const {
+    return at(key);
+  }
+
+  /**
+   * the value of key, nullptr if key does not exist.
+   * there is no overload that is not const: nothing is copied, even on a
+   *   shared map, and the version stays.
+   */
+  const T *find_ptr(const Key &key) const {
+    node *p = locate(t, key);
+    return p ? &p->data.second : nullptr;
+  }
+
+  /**
+   * copy the value of key into value, return false if key does not exist.
+   */
+  bool try_at(const Key &key, T &value) const {
+    const T *found = find_ptr(key);
+    if (!found) { return false; }
+    value = *found;
+    return true;
+  }
+
+  bool contains(const Key &key) const {
+    return locate(t, key) != nullptr;
+  }
+
+  iterator begin() {
+    return iterator(&t, edge(t, false));
+  }
+
+  const_iterator cbegin() const {
+    return const_iterator(&t, edge(t, false));
+  }
+
+  iterator end() {
+    return iterator(&t, nullptr);
+  }
+
+  const_iterator cend() const {
+    return const_iterator(&t, nullptr);
+  }
+
+  reverse_iterator rbegin() {
+    return reverse_iterator(&t, edge(t, true));
+  }
+
+  const_reverse_iterator crbegin() const {
+    return const_reverse_iterator(&t, edge(t, true));
+  }
+
+  reverse_iterator rend() {
+    return reverse_iterator(&t, nullptr);
+  }
+
+  const_reverse_iterator crend() const {
+    return const_reverse_iterator(&t, nullptr);
+  }
+
+  bool empty() const {
+    return t.number == 0;
+  }
+
+  size_t size() const {
+    return t.number;
+  }
+
+  void clear() {
+    release(t.root);
+    t.root = nullptr;
+    t.number = 0;
+    t.shared = false;
+    ++t.shape;
+    ++revision;
+  }
+
+  pair<iterator, bool> insert(const value_type &value) {
+    ++revision;
+    pair<node *, bool> result = insert(t, value);
+    return pair<iterator, bool>(iterator(&t, result.first), result.second);
+  }
+
+  void erase(iterator pos) {
+    node *p = pos.where.current();
+    if (!p || (Checked && pos.where.owner != &t)) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    ++revision;
+    // pos pins the node, so its key outlives the erase
+    erase(t, p->data.first);
+  }
+
+  /**
+   * erase [first, last) in O(log n + k), as erase_range does.
+   */
+  iterator erase(iterator first, iterator last) {
+    if (Checked && (first.where.owner != &t || last.where.owner != &t)) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    if (first == last) { return last; }
+    Compare compare;
+    node *from = first.where.current(), *to = last.where.current();
+    if (!from || (to && !compare(from->data.first, to->data.first))) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    ++revision;
+    cut(t, from, to);
+    return last;
+  }
+
+  /**
+   * erase every element whose key lies in [lo, hi), O(log n + k):
+   *   the tree is split at both ends and joined again, which copies
+   *   O(log n) nodes whether or not the map is shared, so a range of one
+   *   element is erased alone instead.
+   * return the number of erased elements.
+   */
+  size_t erase_range(const Key &lo, const Key &hi) {
+    ++revision;
+    Compare compare;
+    node *first = locate(t, lo);
+    if (!first) { first = neighbour(t, lo, true); }
+    if (!first || !compare(first->data.first, hi)) { return 0; }
+    node *end = locate(t, hi);
+    if (!end) { end = neighbour(t, hi, true); }
+    return cut(t, first, end);
+  }
+
+  size_t count(const Key &key) const {
+    return locate(t, key) ? 1 : 0;
+  }
+
+  iterator find(const Key &key) {
+    return iterator(&t, locate(t, key));
+  }
+
+  const_iterator find(const Key &key) const {
+    return const_iterator(&t, locate(t, key));
+  }
+};
+
+}
+
+#endif
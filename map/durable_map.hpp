@@ -0,0 +1,589 @@
+/**
+ * a front end of sjtu::map that survives restarts
+ */
+#ifndef SJTU_DURABLE_MAP_HPP
+#define SJTU_DURABLE_MAP_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "map.hpp"
+
+namespace sjtu {
+
+/**
+ * any number of threads may call any member at once, as with concurrent_map.
+ *
+ * the map lives in memory; every write that changes it is appended to
+ *   a write-ahead log, and returns once the log holds it on disk.
+ * with GroupCommit, a writer appends its record to a buffer in memory and
+ *   waits; one waiting writer at a time writes out everything buffered
+ *   with one fdatasync and wakes the others, so the writers that came
+ *   while a sync was under way share the next one. without it, every
+ *   write syncs its own record while holding the map.
+ *   a reader may see a write shortly before the write is on disk.
+ *
+ * checkpoint() saves the whole map with map::save and starts a new log,
+ *   so recovery does not replay everything ever written; one also runs
+ *   once the log grows past checkpoint_bytes. the write that set that one
+ *   off is on disk already, so it succeeds even if the checkpoint fails:
+ *   checkpoint_failed() tells, and the logs are kept until one succeeds.
+ * on disk, for a map at path:
+ *   path.checkpoint: the generation g it seals, then the map as map::save
+ *   writes it;
+ *   path.log.1, path.log.2, ...: the logs, of which only those past g
+ *   are still needed.
+ * a new map at path recovers: it loads the checkpoint, replays the logs
+ *   after it in order, cuts the last one after its last whole record
+ *   (a record torn by a crash was never acknowledged) and goes on
+ *   appending to it.
+ *
+ * Key and T must be trivially copyable: records and checkpoints hold
+ *   them raw. an error writing the log throws runtime_error, and so does
+ *   every write after it, as the map may hold what the log does not.
+ */
+template<
+        class Key,
+        class T,
+        class Compare = std::less<Key>,
+        class Balance = avl_balance,
+        bool Checked = true,
+        bool GroupCommit = true
+>
+class durable_map {
+  static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<T>::value,
+                "log records hold keys and values raw");
+
+ public:
+  typedef map<Key, T, Compare, Balance, Checked> base;
+  typedef typename base::value_type value_type;
+
+  inline static size_t checkpoint_bytes = 64 << 20;
+
+ private:
+  enum operation : std::uint32_t { inserted = 1, assigned, erased };
+
+  struct log_header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t order;
+    std::uint32_t key_size;
+    std::uint32_t value_size;
+  };
+
+  inline static const char log_magic[8] = {'s', 'j', 't', 'u', 'w', 'a', 'l', '\0'};
+  static constexpr std::uint32_t log_version = 1;
+  static constexpr std::uint32_t log_order = 0x01020304;
+  /**
+   * a record: the operation, a checksum of the rest, the key, the value.
+   */
+  static constexpr size_t record_size = 8 + sizeof(Key) + sizeof(T);
+
+  struct alignas(64) padded_lock {
+    mutable std::shared_mutex lock;
+  };
+
+  padded_lock guard;
+  base content;
+  std::string path;
+
+  /**
+   * the log: what is appended but not yet written, and how far
+   *   appending and syncing have got, in records.
+   */
+  std::mutex log_lock;
+  std::condition_variable synced;
+  std::vector<char> pending;
+  unsigned long long appended = 0;
+  unsigned long long durable = 0;
+  bool flushing = false;
+  bool broken = false;
+  int fd = -1;
+  unsigned long long generation = 0;
+  std::atomic<size_t> log_size{0};
+
+  std::mutex checkpointing;
+  std::atomic<bool> automatic_failed{false};
+
+  static void failed() {
+    runtime_error runtime_error;
+    throw runtime_error;
+  }
+
+  std::string log_path(unsigned long long g) const {
+    return path + ".log." + std::to_string(g);
+  }
+
+  std::string checkpoint_path() const {
+    return path + ".checkpoint";
+  }
+
+  static std::uint32_t checksum(const char *p, size_t n) {
+    std::uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i) {
+      h = (h ^ (unsigned char)p[i]) * 16777619u;
+    }
+    return h;
+  }
+
+  static void encode(char *at, operation op, const Key &key, const T *value) {
+    std::memset(at, 0, record_size);
+    std::uint32_t code = op;
+    std::memcpy(at, &code, 4);
+    std::memcpy(at + 8, &key, sizeof(Key));
+    if (value) { std::memcpy(at + 8 + sizeof(Key), value, sizeof(T)); }
+    std::uint32_t sum = checksum(at + 8, record_size - 8) ^ code;
+    std::memcpy(at + 4, &sum, 4);
+  }
+
+  static bool write_all(int fd, const char *p, size_t n) {
+    while (n) {
+      ssize_t written = ::write(fd, p, n);
+      if (written < 0 && errno == EINTR) { continue; }
+      if (written <= 0) { return false; }
+      p += written;
+      n -= written;
+    }
+    return true;
+  }
+
+  /**
+   * make the entries of the directory holding path durable.
+   */
+  void sync_directory() const {
+    size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    int dir = open(directory.c_str(), O_RDONLY);
+    if (dir < 0) { failed(); }
+    bool ok = fsync(dir) == 0;
+    close(dir);
+    if (!ok) { failed(); }
+  }
+
+  void apply(operation op, const Key &key, const T &value) {
+    if (op == inserted) {
+      content.insert(value_type(key, value));
+    } else if (op == assigned) {
+      content[key] = value;
+    } else {
+      typename base::iterator it = content.find(key);
+      if (it != content.end()) { content.erase(it); }
+    }
+  }
+
+  /**
+   * apply the records of log g, return false if it does not exist.
+   * a torn or corrupt tail is cut off if g is the last log, an error otherwise.
+   */
+  bool replay(unsigned long long g) {
+    int in = open(log_path(g).c_str(), O_RDWR);
+    if (in < 0) { return false; }
+    struct stat status;
+    log_header header;
+    if (fstat(in, &status) != 0 || ::read(in, &header, sizeof(header)) != (ssize_t)sizeof(header)
+        || std::memcmp(header.magic, log_magic, sizeof(log_magic)) != 0 || header.version != log_version
+        || header.order != log_order || header.key_size != sizeof(Key) || header.value_size != sizeof(T)) {
+      close(in);
+      failed();
+    }
+    size_t whole = sizeof(header);
+    std::vector<char> chunk(record_size << 12);
+    bool torn = false;
+    while (!torn) {
+      ssize_t got = ::read(in, chunk.data(), chunk.size());
+      if (got < 0) {
+        close(in);
+        failed();
+      }
+      if (got == 0) { break; }
+      size_t n = got;
+      while (n % record_size) {
+        ssize_t more = ::read(in, chunk.data() + n, record_size - n % record_size);
+        if (more <= 0) { break; }
+        n += more;
+      }
+      for (size_t at = 0; at + record_size <= n; at += record_size) {
+        const char *r = chunk.data() + at;
+        std::uint32_t code, sum;
+        std::memcpy(&code, r, 4);
+        std::memcpy(&sum, r + 4, 4);
+        if (code < inserted || code > erased || sum != (checksum(r + 8, record_size - 8) ^ code)) {
+          torn = true;
+          break;
+        }
+        Key key;
+        T value;
+        std::memcpy(&key, r + 8, sizeof(Key));
+        std::memcpy(&value, r + 8 + sizeof(Key), sizeof(T));
+        apply(operation(code), key, value);
+        whole += record_size;
+      }
+      if (n % record_size) { torn = true; }
+    }
+    bool last = access(log_path(g + 1).c_str(), F_OK) != 0;
+    if (whole != (size_t)status.st_size) {
+      if (!last || ftruncate(in, whole) != 0 || fsync(in) != 0) {
+        close(in);
+        failed();
+      }
+    }
+    close(in);
+    return true;
+  }
+
+  /**
+   * make log g, empty, the one appended to.
+   */
+  void start_log(unsigned long long g) {
+    int next = open(log_path(g).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (next < 0) { failed(); }
+    log_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, log_magic, sizeof(log_magic));
+    header.version = log_version;
+    header.order = log_order;
+    header.key_size = sizeof(Key);
+    header.value_size = sizeof(T);
+    if (!write_all(next, reinterpret_cast<const char *>(&header), sizeof(header)) || fdatasync(next) != 0) {
+      close(next);
+      std::remove(log_path(g).c_str());
+      failed();
+    }
+    sync_directory();
+    if (fd >= 0) { close(fd); }
+    fd = next;
+    generation = g;
+    log_size = sizeof(header);
+  }
+
+  /**
+   * load the checkpoint, replay the logs after it, open the last one.
+   */
+  void recover() {
+    unsigned long long sealed = 0;
+    std::ifstream in(checkpoint_path(), std::ios::binary);
+    if (in) {
+      in.read(reinterpret_cast<char *>(&sealed), sizeof(sealed));
+      if (!in) { failed(); }
+      content.load(in);
+    }
+    unsigned long long g = sealed + 1;
+    while (replay(g)) { ++g; }
+    if (g == sealed + 1) {
+      start_log(g);
+      return;
+    }
+    generation = g - 1;
+    fd = open(log_path(generation).c_str(), O_WRONLY | O_APPEND);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) { failed(); }
+    log_size = status.st_size;
+  }
+
+  /**
+   * append the record of a write that changed the map;
+   *   the caller holds the map to itself. return its number.
+   */
+  unsigned long long append(operation op, const Key &key, const T *value) {
+    std::lock_guard<std::mutex> lock(log_lock);
+    if (broken) { failed(); }
+    if (!GroupCommit) {
+      char record[record_size];
+      encode(record, op, key, value);
+      if (!write_all(fd, record, record_size) || fdatasync(fd) != 0) {
+        broken = true;
+        failed();
+      }
+      log_size += record_size;
+      return durable = ++appended;
+    }
+    try {
+      pending.resize(pending.size() + record_size);
+    } catch (...) {
+      broken = true;
+      throw;
+    }
+    encode(pending.data() + pending.size() - record_size, op, key, value);
+    log_size += record_size;
+    return ++appended;
+  }
+
+  /**
+   * write out what is pending and sync it; log_lock is held through
+   *   lock, and let go meanwhile.
+   */
+  void flush(std::unique_lock<std::mutex> &lock) {
+    flushing = true;
+    std::vector<char> batch;
+    batch.swap(pending);
+    unsigned long long upto = appended;
+    int out = fd;
+    lock.unlock();
+    bool ok = write_all(out, batch.data(), batch.size()) && fdatasync(out) == 0;
+    lock.lock();
+    flushing = false;
+    if (ok) {
+      durable = upto;
+    } else {
+      broken = true;
+    }
+    synced.notify_all();
+  }
+
+  /**
+   * return once record mine is on disk.
+   */
+  void commit(unsigned long long mine) {
+    std::unique_lock<std::mutex> lock(log_lock);
+    while (durable < mine) {
+      if (broken) { failed(); }
+      if (flushing) {
+        synced.wait(lock);
+      } else {
+        flush(lock);
+      }
+    }
+  }
+
+  /**
+   * everything appended is on disk; the caller holds the map to itself.
+   */
+  void drain() {
+    std::unique_lock<std::mutex> lock(log_lock);
+    while (flushing) { synced.wait(lock); }
+    if (durable < appended) { flush(lock); }
+    if (broken) { failed(); }
+  }
+
+  /**
+   * seal the current log with a checkpoint of the map.
+   * only starting the new log holds the map to itself: the copy is taken
+   *   afterwards, with readers going on, and so may hold writes the new log
+   *   holds too. replaying a log over any state it went through gives the
+   *   same map (an insert is logged only when it inserted), so that is
+   *   harmless once those writes are on disk, which the copy waits for.
+   */
+  void run_checkpoint() {
+    unsigned long long sealed;
+    {
+      std::unique_lock<std::shared_mutex> lock(guard.lock);
+      drain();
+      sealed = generation;
+      std::lock_guard<std::mutex> log(log_lock);
+      start_log(sealed + 1);
+    }
+    base copy;
+    unsigned long long seen;
+    {
+      std::shared_lock<std::shared_mutex> lock(guard.lock);
+      copy = content;
+      std::lock_guard<std::mutex> log(log_lock);
+      seen = appended;
+    }
+    commit(seen);
+    std::string temporary = checkpoint_path() + ".tmp";
+    try {
+      {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&sealed), sizeof(sealed));
+        copy.save(out);
+        out.close();
+        if (!out) { failed(); }
+      }
+      int written = open(temporary.c_str(), O_RDONLY);
+      bool ok = written >= 0 && fsync(written) == 0;
+      if (written >= 0) { close(written); }
+      if (!ok || std::rename(temporary.c_str(), checkpoint_path().c_str()) != 0) { failed(); }
+    } catch (...) {
+      std::remove(temporary.c_str());
+      throw;
+    }
+    sync_directory();
+    for (unsigned long long g = sealed; g > 0 && std::remove(log_path(g).c_str()) == 0; --g) {}
+  }
+
+  /**
+   * a failure is only recorded: the write that got here is on disk.
+   */
+  void checkpoint_if_due() noexcept {
+    if (log_size.load(std::memory_order_relaxed) < checkpoint_bytes) { return; }
+    std::unique_lock<std::mutex> one(checkpointing, std::try_to_lock);
+    if (!one.owns_lock() || log_size.load() < checkpoint_bytes) { return; }
+    try {
+      run_checkpoint();
+      automatic_failed = false;
+    } catch (...) {
+      automatic_failed = true;
+    }
+  }
+
+  /**
+   * the write is not made: return once what it saw is on disk.
+   */
+  void unchanged(std::unique_lock<std::shared_mutex> &lock) {
+    unsigned long long seen;
+    {
+      std::lock_guard<std::mutex> log(log_lock);
+      seen = appended;
+    }
+    lock.unlock();
+    commit(seen);
+  }
+
+ public:
+  /**
+   * open the map at path (see above), recovering what it held.
+   * throw runtime_error if its files cannot be read or written.
+   */
+  explicit durable_map(const std::string &path) : path(path) {
+    try {
+      recover();
+    } catch (...) {
+      if (fd >= 0) { close(fd); }
+      throw;
+    }
+  }
+
+  durable_map(const durable_map &other) = delete;
+
+  durable_map &operator=(const durable_map &other) = delete;
+
+  /**
+   * every write has returned once on disk, so nothing is left to do
+   *   but close the log.
+   */
+  ~durable_map() {
+    if (fd >= 0) { close(fd); }
+  }
+
+  /**
+   * save the map and start a new log; the old logs are removed.
+   * throw runtime_error if the checkpoint cannot be written,
+   *   leaving the logs as they were.
+   */
+  void checkpoint() {
+    std::lock_guard<std::mutex> one(checkpointing);
+    run_checkpoint();
+    automatic_failed = false;
+  }
+
+  /**
+   * return true if the last checkpoint run by a write failed
+   *   (and none has succeeded since).
+   */
+  bool checkpoint_failed() const {
+    return automatic_failed;
+  }
+
+  /**
+   * return false if the key already exists, leaving it alone.
+   */
+  bool insert(const value_type &value) {
+    std::unique_lock<std::shared_mutex> lock(guard.lock);
+    if (!content.insert(value).second) {
+      unchanged(lock);
+      return false;
+    }
+    unsigned long long mine = append(inserted, value.first, &value.second);
+    lock.unlock();
+    commit(mine);
+    checkpoint_if_due();
+    return true;
+  }
+
+  /**
+   * insert key or overwrite its value.
+   */
+  void assign(const Key &key, const T &value) {
+    std::unique_lock<std::shared_mutex> lock(guard.lock);
+    content[key] = value;
+    unsigned long long mine = append(assigned, key, &value);
+    lock.unlock();
+    commit(mine);
+    checkpoint_if_due();
+  }
+
+  /**
+   * return the number of erased elements, 0 or 1.
+   */
+  size_t erase(const Key &key) {
+    std::unique_lock<std::shared_mutex> lock(guard.lock);
+    typename base::iterator it = content.find(key);
+    if (it == content.end()) {
+      unchanged(lock);
+      return 0;
+    }
+    content.erase(it);
+    unsigned long long mine = append(erased, key, nullptr);
+    lock.unlock();
+    commit(mine);
+    checkpoint_if_due();
+    return 1;
+  }
+
+  /**
+   * copy the value of key into value, return false if key does not exist.
+   */
+  bool find(const Key &key, T &value) const {
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    typename base::const_iterator it = content.find(key);
+    if (it == content.cend()) { return false; }
+    value = it->second;
+    return true;
+  }
+
+  size_t count(const Key &key) const {
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    return content.count(key);
+  }
+
+  /**
+   * throw index_out_of_bound if key does not exist.
+   */
+  T at(const Key &key) const {
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    return content.at(key);
+  }
+
+  T operator[](const Key &key) const {
+    return at(key);
+  }
+
+  /**
+   * call fn(map) with the map shared with other readers, return what fn returns.
+   */
+  template<class Fn>
+  auto read(Fn fn) const {
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    return fn(static_cast<const base &>(content));
+  }
+
+  base snapshot() const {
+    return read([](const base &map) { return map; });
+  }
+
+  size_t size() const {
+    std::shared_lock<std::shared_mutex> lock(guard.lock);
+    return content.size();
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+};
+
+}
+
+#endif
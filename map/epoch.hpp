@@ -0,0 +1,253 @@
+/**
+ * epoch-based reclamation of memory read by threads that take no lock
+ */
+#ifndef SJTU_EPOCH_HPP
+#define SJTU_EPOCH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sjtu {
+
+/**
+ * a reader pins itself (with a guard) for as long as it follows pointers
+ *   into the shared structure; a writer that unlinked a block retires it
+ *   instead of freeing it. the domain counts epochs, and moves to the next
+ *   one only when every pinned thread has seen the current one, so a block
+ *   retired at epoch e is unreachable to everybody at epoch e + 2.
+ *
+ * every thread taking part is registered: it owns a participant,
+ *   holding the epoch it is pinned at (0 while outside) and its own list
+ *   of retired blocks, so retiring takes no lock and shares nothing.
+ *   a thread is registered the first time it pins or retires in a domain
+ *   and leaves at exit, handing its participant (with whatever is still
+ *   waiting on it) to the next thread that registers.
+ * a thread frees its list in batches, once it has collect_batch blocks
+ *   (or twice as many as the last batch left waiting), from the front,
+ *   which is in epoch order. readers never wait, writers never wait
+ *   for readers: a stalled reader only makes the lists longer.
+ *
+ * whatever is still retired when the domain is destroyed is freed then,
+ *   nobody may be pinned in a domain while it is destroyed.
+ */
+class epoch_domain {
+ public:
+  inline static size_t collect_batch = 64;
+
+  struct retired {
+    unsigned long long epoch;
+    void *pointer;
+    void (*free)(void *);
+  };
+
+  struct alignas(64) participant {
+    std::atomic<unsigned long long> pinned{0};
+    std::atomic<bool> taken{true};
+    participant *next = nullptr;
+    alignas(64) unsigned depth = 0;
+    size_t threshold = collect_batch;
+    std::vector<retired> limbo;
+  };
+
+ private:
+  /**
+   * the serials of the domains alive, so that a thread exiting
+   *   leaves only those.
+   */
+  inline static std::mutex registry;
+  inline static std::vector<unsigned long long> alive;
+  inline static std::atomic<unsigned long long> serials{0};
+
+  struct membership {
+    epoch_domain *domain;
+    unsigned long long serial;
+    participant *self;
+  };
+
+  /**
+   * the participants of a thread, left at its exit.
+   */
+  struct memberships {
+    std::vector<membership> list;
+
+    ~memberships() {
+      std::lock_guard<std::mutex> lock(registry);
+      for (const membership &m : list) {
+        if (std::find(alive.begin(), alive.end(), m.serial) != alive.end()) { m.domain->leave(m.self); }
+      }
+    }
+  };
+
+  alignas(64) std::atomic<unsigned long long> current{1};
+  std::atomic<participant *> participants{nullptr};
+  unsigned long long serial;
+
+ public:
+  epoch_domain() : serial(++serials) {
+    std::lock_guard<std::mutex> lock(registry);
+    alive.push_back(serial);
+  }
+
+  epoch_domain(const epoch_domain &other) = delete;
+
+  epoch_domain &operator=(const epoch_domain &other) = delete;
+
+  ~epoch_domain() {
+    {
+      std::lock_guard<std::mutex> lock(registry);
+      alive.erase(std::find(alive.begin(), alive.end(), serial));
+    }
+    participant *p = participants.load();
+    while (p) {
+      for (const retired &r : p->limbo) { r.free(r.pointer); }
+      participant *q = p->next;
+      delete p;
+      p = q;
+    }
+  }
+
+  /**
+   * a participant of our own, a free one if there is one.
+   */
+  participant *enroll() {
+    for (participant *p = participants.load(); p; p = p->next) {
+      bool taken = false;
+      if (!p->taken.load(std::memory_order_relaxed) && p->taken.compare_exchange_strong(taken, true)) { return p; }
+    }
+    participant *p = new participant;
+    p->next = participants.load();
+    while (!participants.compare_exchange_weak(p->next, p)) {}
+    return p;
+  }
+
+  /**
+   * give self back, not pinned; what it cannot free yet stays on it.
+   */
+  void leave(participant *self) {
+    collect(self);
+    self->taken.store(false, std::memory_order_release);
+  }
+
+  /**
+   * the participant of this thread, registered on first use.
+   */
+  participant *local() {
+    static thread_local memberships mine;
+    for (const membership &m : mine.list) {
+      if (m.domain == this && m.serial == serial) { return m.self; }
+    }
+    {
+      std::lock_guard<std::mutex> lock(registry);
+      mine.list.erase(std::remove_if(mine.list.begin(), mine.list.end(), [](const membership &m) {
+        return std::find(alive.begin(), alive.end(), m.serial) == alive.end();
+      }), mine.list.end());
+    }
+    participant *self = enroll();
+    try {
+      mine.list.push_back(membership{this, serial, self});
+    } catch (...) {
+      leave(self);
+      throw;
+    }
+    return self;
+  }
+
+  /**
+   * pins nest, only the outermost one counts.
+   */
+  void pin(participant *self) {
+    if (self->depth++) { return; }
+    self->pinned.store(current.load());
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  void unpin(participant *self) {
+    if (--self->depth) { return; }
+    self->pinned.store(0, std::memory_order_release);
+  }
+
+  /**
+   * keeps what this thread reads in the domain allocated while held.
+   */
+  class guard {
+    epoch_domain &domain;
+    participant *self;
+
+   public:
+    explicit guard(epoch_domain &domain) : domain(domain), self(domain.local()) {
+      domain.pin(self);
+    }
+
+    guard(const guard &other) = delete;
+
+    guard &operator=(const guard &other) = delete;
+
+    ~guard() {
+      domain.unpin(self);
+    }
+  };
+
+  /**
+   * move to the next epoch if every pinned thread is at this one.
+   */
+  bool try_advance() {
+    unsigned long long now = current.load();
+    for (participant *p = participants.load(); p; p = p->next) {
+      unsigned long long pinned = p->pinned.load();
+      if (pinned && pinned != now) { return false; }
+    }
+    return current.compare_exchange_strong(now, now + 1);
+  }
+
+  /**
+   * wait until nobody can be reading what was retired so far.
+   * the calling thread must not be pinned.
+   */
+  void barrier() {
+    unsigned long long target = current.load() + 2;
+    while (current.load() < target) {
+      if (!try_advance()) { std::this_thread::yield(); }
+    }
+  }
+
+  /**
+   * free the blocks of self nobody can be reading any more.
+   */
+  void collect(participant *self) {
+    try_advance();
+    unsigned long long now = current.load();
+    size_t freed = 0;
+    while (freed < self->limbo.size() && self->limbo[freed].epoch + 2 <= now) {
+      self->limbo[freed].free(self->limbo[freed].pointer);
+      ++freed;
+    }
+    self->limbo.erase(self->limbo.begin(), self->limbo.begin() + freed);
+    self->threshold = std::max(collect_batch, 2 * self->limbo.size());
+  }
+
+  /**
+   * call free(pointer) once no thread pinned now can be reading it;
+   *   pointer must be unreachable to whoever pins from now on.
+   * if there is no memory to remember it, waits for the readers instead.
+   */
+  void retire(void *pointer, void (*free)(void *)) noexcept {
+    participant *self;
+    try {
+      self = local();
+      self->limbo.push_back(retired{current.load(), pointer, free});
+    } catch (...) {
+      barrier();
+      free(pointer);
+      return;
+    }
+    if (self->limbo.size() >= self->threshold) { collect(self); }
+  }
+};
+
+}
+
+#endif
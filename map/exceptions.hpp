@@ -7,32 +7,42 @@
 
 namespace sjtu {
 
+/**
+ * an exception holds only pointers to string literals,
+ *   so throwing, copying and catching one by value never allocate;
+ *   what() builds its string only when it is asked for.
+ */
 class exception {
  protected:
-  const std::string variant = "";
-  std::string detail = "";
+  const char *variant = "";
+  const char *detail = "";
  public:
   exception() {}
+  exception(const char *variant, const char *detail = "") : variant(variant), detail(detail) {}
   exception(const exception &ec) : variant(ec.variant), detail(ec.detail) {}
   virtual std::string what() {
-    return variant + " " + detail;
+    return std::string(variant) + " " + detail;
   }
 };
 
 class index_out_of_bound : public exception {
-  /* __________________________ */
+ public:
+  index_out_of_bound() : exception("index_out_of_bound") {}
 };
 
 class runtime_error : public exception {
-  /* __________________________ */
+ public:
+  runtime_error() : exception("runtime_error") {}
 };
 
 class invalid_iterator : public exception {
-  /* __________________________ */
+ public:
+  invalid_iterator() : exception("invalid_iterator") {}
 };
 
 class container_is_empty : public exception {
-  /* __________________________ */
+ public:
+  container_is_empty() : exception("container_is_empty") {}
 };
 }
 
@@ -4,9 +4,25 @@
 #include <vector>
 #include <algorithm>
 #include <map>
+#include <sstream>
+#include <string>
 #include <ctime>
+#include <thread>
+#include <atomic>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "exceptions.hpp"
 #include "map.hpp"
+#include "cow_map.hpp"
+#include "concurrent_map.hpp"
+#include "sharded_map.hpp"
+#include "epoch.hpp"
+#include "skiplist_map.hpp"
+#include "buffered_map.hpp"
+#include "mapped_map.hpp"
+#include "durable_map.hpp"
+#include "paged_map.hpp"
 
 const int MAXN = 50001;
 
@@ -603,6 +619,2056 @@ void tester11() {
   console.pass();
 }
 
+int key_of(const IntA &key) {
+  return key.val;
+}
+
+int key_of(int key) {
+  return key;
+}
+
+const std::string &key_of(const std::string &key) {
+  return key;
+}
+
+template<class StdMap, class SrcMap>
+bool equal_content(const StdMap &stdmap, const SrcMap &srcmap) {
+  if (stdmap.size() != srcmap.size()) return false;
+  auto itB = srcmap.cbegin();
+  for (auto itA = stdmap.begin(); itA != stdmap.end(); ++itA, ++itB) {
+    if (itB == srcmap.cend()) return false;
+    if (key_of(itA -> first) != key_of(itB -> first) || itA -> second != itB -> second) return false;
+  }
+  if (itB != srcmap.cend()) return false;
+  auto itD = srcmap.cend();
+  for (auto itC = stdmap.rbegin(); itC != stdmap.rend(); ++itC) {
+    --itD;
+    if (key_of(itC -> first) != key_of(itD -> first)) return false;
+  }
+  return true;
+}
+
+IntB sum(const IntB &a, const IntB &b) {
+  return IntB(*a.val % 10007 + *b.val % 10007);
+}
+
+void tester12() {
+  TestCore console("Union & Intersection & Difference testing...", 12, 0);
+  console.init();
+  try{
+    for (int round = 0; round < 3; round++) {
+      std::map<IntA, IntB, Compare> stdA, stdB, stdU, stdI, stdD;
+      sjtu::map<IntA, IntB, Compare> srcA, srcB;
+      int n = round == 0 ? 10 : MAXN, m = round == 2 ? 100 : n;
+      for (int i = 0; i < n; i++) {
+        int x = rand() % (2 * n), y = rand();
+        stdA.insert(std::map<IntA, IntB, Compare>::value_type(x, IntB(y)));
+        srcA.insert(sjtu::map<IntA, IntB, Compare>::value_type(x, IntB(y)));
+      }
+      for (int i = 0; i < m; i++) {
+        int x = rand() % (2 * n), y = rand();
+        stdB.insert(std::map<IntA, IntB, Compare>::value_type(x, IntB(y)));
+        srcB.insert(sjtu::map<IntA, IntB, Compare>::value_type(x, IntB(y)));
+      }
+      for (auto &x : stdA) {
+        auto it = stdB.find(x.first);
+        if (it == stdB.end()) {
+          stdU.insert(x);
+          stdD.insert(x);
+        } else {
+          stdU.insert(std::map<IntA, IntB, Compare>::value_type(x.first, sum(x.second, it->second)));
+          stdI.insert(std::map<IntA, IntB, Compare>::value_type(x.first, sum(x.second, it->second)));
+        }
+      }
+      for (auto &x : stdB) {
+        stdU.insert(x);
+      }
+      sjtu::map<IntA, IntB, Compare> copyA(srcA), copyB(srcB);
+      auto srcU = sjtu::map_union(std::move(copyA), std::move(copyB), sum);
+      if (!copyA.empty() || !copyB.empty() || !equal_content(stdU, srcU)) {
+        console.fail();
+        return;
+      }
+      copyA = srcA;
+      copyB = srcB;
+      auto srcI = sjtu::map_intersection(std::move(copyA), std::move(copyB), sum);
+      if (!equal_content(stdI, srcI)) {
+        console.fail();
+        return;
+      }
+      auto srcD = sjtu::map_difference(std::move(srcA), std::move(srcB));
+      if (!equal_content(stdD, srcD)) {
+        console.fail();
+        return;
+      }
+      for (auto &x : stdU) {
+        srcU.erase(srcU.find(x.first));
+        if (stdD.count(x.first)) srcD.erase(srcD.find(x.first));
+      }
+      if (!srcU.empty() || !srcD.empty()) {
+        console.fail();
+        return;
+      }
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.pass();
+}
+
+void tester13() {
+  TestCore console("Split & Concatenate testing...", 13, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  try{
+    std::map<IntA, IntB, Compare> stdmap;
+    sjtu::map<IntA, IntB, Compare> srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      IntB tmp = IntB(rand());
+      stdmap.insert(std::map<IntA, IntB, Compare>::value_type(ret[i], tmp));
+      srcmap.insert(sjtu::map<IntA, IntB, Compare>::value_type(ret[i], tmp));
+    }
+    for (int i = 0; i < 100; i++) {
+      IntA key(ret[rand() % ret.size()] + rand() % 3 - 1);
+      std::map<IntA, IntB, Compare> stdless(stdmap.begin(), stdmap.lower_bound(key));
+      std::map<IntA, IntB, Compare> stdgreater(stdmap.lower_bound(key), stdmap.end());
+      auto srcgreater = srcmap.split(key);
+      if (!equal_content(stdless, srcmap) || !equal_content(stdgreater, srcgreater)) {
+        console.fail();
+        return;
+      }
+      if (i % 2) {
+        srcmap.concatenate(std::move(srcgreater));
+      } else {
+        srcgreater.concatenate(std::move(srcmap));
+        srcmap.concatenate(std::move(srcgreater));
+      }
+      if (!srcgreater.empty() || !equal_content(stdmap, srcmap)) {
+        console.fail();
+        return;
+      }
+    }
+    sjtu::map<IntA, IntB, Compare> overlap;
+    overlap.insert(sjtu::map<IntA, IntB, Compare>::value_type(ret[0], IntB(0)));
+    try{
+      srcmap.concatenate(std::move(overlap));
+    } catch (sjtu::runtime_error error) {
+      console.pass();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.fail();
+}
+
+void tester14() {
+  TestCore console("Range erase testing...", 14, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  try{
+    std::map<IntA, IntB, Compare> stdmap;
+    sjtu::map<IntA, IntB, Compare> srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      IntB tmp = IntB(rand());
+      stdmap.insert(std::map<IntA, IntB, Compare>::value_type(ret[i], tmp));
+      srcmap.insert(sjtu::map<IntA, IntB, Compare>::value_type(ret[i], tmp));
+    }
+    while (stdmap.size() > 100) {
+      IntA lo(ret[rand() % ret.size()]), hi(lo.val - rand() % (RAND_MAX / 50));
+      auto first = stdmap.lower_bound(lo), last = stdmap.lower_bound(hi);
+      size_t count = std::distance(first, last);
+      stdmap.erase(first, last);
+      if (srcmap.erase_range(lo, hi) != count || !equal_content(stdmap, srcmap)) {
+        console.fail();
+        return;
+      }
+    }
+    auto first = srcmap.begin();
+    ++first;
+    auto last = srcmap.find(stdmap.rbegin()->first);
+    stdmap.erase(++stdmap.begin(), --stdmap.end());
+    if (srcmap.erase(first, last) != last || !equal_content(stdmap, srcmap)) {
+      console.fail();
+      return;
+    }
+    srcmap.erase(srcmap.begin(), srcmap.end());
+    if (!srcmap.empty() || srcmap.begin() != srcmap.end()) {
+      console.fail();
+      return;
+    }
+    try{
+      sjtu::map<IntA, IntB, Compare> other;
+      srcmap.erase(other.begin(), other.end());
+    } catch (sjtu::invalid_iterator error) {
+      console.pass();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.fail();
+}
+
+void tester15() {
+  TestCore console("Parallel copy testing...", 15, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::map<int, IntB> Map;
+  size_t threshold = Map::parallel_copy_threshold;
+  try{
+    std::map<int, IntB> stdmap;
+    Map srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      IntB tmp = IntB(rand());
+      stdmap.insert(std::map<int, IntB>::value_type(ret[i], tmp));
+      srcmap.insert(Map::value_type(ret[i], tmp));
+    }
+    Map::parallel_copy_threshold = 0;
+    for (unsigned threads = 1; threads <= 8; threads++) {
+      Map::copy_threads = threads;
+      Map tmp1(srcmap), tmp2;
+      tmp2 = tmp1;
+      for (int i = 0; i < 1000; i++) {
+        auto it = tmp1.find(ret[rand() % ret.size()]);
+        if (it != tmp1.end()) tmp1.erase(it);
+      }
+      if (!equal_content(stdmap, srcmap) || !equal_content(stdmap, tmp2)) {
+        console.fail();
+        Map::parallel_copy_threshold = threshold;
+        Map::copy_threads = 0;
+        return;
+      }
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    Map::parallel_copy_threshold = threshold;
+    Map::copy_threads = 0;
+    return;
+  }
+  Map::parallel_copy_threshold = threshold;
+  Map::copy_threads = 0;
+  console.pass();
+}
+
+void tester16() {
+  TestCore console("Copy-on-write testing...", 16, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::cow_map<IntA, IntB, Compare> Map;
+  int live = IntA::counter;
+  try{
+    std::map<IntA, IntB, Compare> stdmap;
+    sjtu::map<IntA, IntB, Compare> build;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      IntB tmp = IntB(rand());
+      stdmap.insert(std::map<IntA, IntB, Compare>::value_type(ret[i], tmp));
+      build.insert(sjtu::map<IntA, IntB, Compare>::value_type(ret[i], tmp));
+    }
+    const Map srcmap(build);
+    Map tmp1(srcmap), tmp2;
+    tmp2 = tmp1;
+    if (srcmap.use_count() != 3 || !equal_content(stdmap, tmp2)) {
+      console.fail();
+      return;
+    }
+    std::map<IntA, IntB, Compare> std1(stdmap);
+    for (int i = 0; i < 1000; i++) {
+      IntA key(ret[rand() % ret.size()]);
+      if (std1.count(key)) {
+        std1.erase(key);
+        tmp1.erase_range(key, IntA(key.val - 1));
+      }
+    }
+    auto it = tmp2.find(ret[0]);
+    it->second = IntB(-1);
+    std::map<IntA, IntB, Compare> std2(stdmap);
+    std2[ret[0]] = IntB(-1);
+    Map tmp3(tmp2);
+    it->second = IntB(-2);
+    std2[ret[0]] = IntB(-2);
+    if (srcmap.use_count() != 1 || tmp3.use_count() != 1 || !equal_content(stdmap, srcmap)
+        || !equal_content(std1, tmp1) || !equal_content(std2, tmp2) || tmp3.at(ret[0]) != IntB(-1)) {
+      console.fail();
+      return;
+    }
+    // copies written at random stay apart, and an iterator outlives
+    //   the copying of its node
+    Map copies[4];
+    std::map<IntA, IntB, Compare> stdcopies[4];
+    for (int i = 0; i < (int)ret.size(); i += 2) {
+      copies[0][ret[i]] = IntB(i);
+      stdcopies[0][ret[i]] = IntB(i);
+    }
+    for (int i = 1; i < 4; i++) {
+      copies[i] = copies[0];
+      stdcopies[i] = stdcopies[0];
+    }
+    auto held = copies[0].find(ret[0]);
+    for (int i = 0; i < 3000; i++) {
+      int from = rand() % 4, to = rand() % 4;
+      if (i % 100 == 0) {
+        copies[to] = copies[from];
+        stdcopies[to] = stdcopies[from];
+        continue;
+      }
+      int key = ret[rand() % ret.size()];
+      if (key == ret[0]) continue;
+      if (rand() % 3) {
+        copies[to][key] = IntB(-i);
+        stdcopies[to][key] = IntB(-i);
+      } else if (stdcopies[to].count(key)) {
+        stdcopies[to].erase(key);
+        copies[to].erase(copies[to].find(key));
+      }
+    }
+    for (int i = 0; i < 4; i++) {
+      if (!equal_content(stdcopies[i], copies[i])) {
+        console.fail();
+        return;
+      }
+    }
+    auto stdheld = stdcopies[0].find(ret[0]);
+    for (int i = 0; i < 100 && stdheld != stdcopies[0].end(); i++, ++held, ++stdheld) {
+      if (held->first.val != stdheld->first.val || held->second != stdheld->second) {
+        console.fail();
+        return;
+      }
+    }
+    auto erased = copies[1].begin();
+    Map keep(copies[1]);
+    copies[1].erase(copies[1].begin());
+    int thrown = 0;
+    try{
+      ++erased;
+    } catch(sjtu::invalid_iterator &) {
+      ++thrown;
+    }
+    try{
+      copies[1].erase(keep.begin());
+    } catch(sjtu::invalid_iterator &) {
+      ++thrown;
+    }
+    auto rit = keep.crbegin();
+    for (auto stdit = stdcopies[1].rbegin(); stdit != stdcopies[1].rend(); ++stdit, ++rit) {
+      if (rit->first.val != stdit->first.val) thrown = 0;
+    }
+    if (thrown != 2 || rit != keep.crend() || keep.size() != stdcopies[1].size()) {
+      console.fail();
+      return;
+    }
+    // find_ptr reads a shared map without copying it, and ranges are cut
+    //   out of a shared map by split and join, leaving the other copy whole
+    Map whole(copies[2]);
+    std::map<IntA, IntB, Compare> stdwhole(stdcopies[2]);
+    unsigned long long version = whole.version();
+    for (auto &x : stdwhole) {
+      const IntB *found = whole.find_ptr(x.first);
+      if (!found || *found != x.second || !whole.contains(x.first)) {
+        console.fail();
+        return;
+      }
+    }
+    IntB value(0);
+    if (whole.version() != version || whole.use_count() != 2 || whole.find_ptr(IntA(-1))
+        || whole.try_at(IntA(-1), value) || !whole.try_at(stdwhole.begin()->first, value)
+        || value != stdwhole.begin()->second) {
+      console.fail();
+      return;
+    }
+    for (int i = 0; i < 40 && stdwhole.size() > 600; i++) {
+      auto from = stdwhole.begin();
+      std::advance(from, rand() % (stdwhole.size() - 300));
+      IntA lo(from->first.val + i % 2), hi(std::next(from, rand() % 300)->first.val + i % 3);
+      size_t n = std::distance(stdwhole.lower_bound(lo), stdwhole.lower_bound(hi));
+      stdwhole.erase(stdwhole.lower_bound(lo), stdwhole.lower_bound(hi));
+      if (whole.erase_range(lo, hi) != n) {
+        console.fail();
+        return;
+      }
+      from = stdwhole.begin();
+      std::advance(from, rand() % stdwhole.size());
+      auto to = from;
+      for (int j = rand() % 300; j > 0 && to != stdwhole.end(); j--) ++to;
+      Map::iterator first = whole.find(from->first), last = to == stdwhole.end() ? whole.end() : whole.find(to->first);
+      if (whole.erase(first, last) != last) {
+        console.fail();
+        return;
+      }
+      stdwhole.erase(from, to);
+    }
+    if (!equal_content(stdwhole, whole) || !equal_content(stdcopies[2], copies[2])) {
+      console.fail();
+      return;
+    }
+    tmp2.clear();
+    Map tmp4(tmp2);
+    if (tmp4.use_count() != 0 || !tmp4.empty() || tmp4.begin() != tmp4.end()) {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  if (IntA::counter != live) {
+    console.fail();
+    return;
+  }
+  console.pass();
+}
+
+void tester17() {
+  TestCore console("Snapshot testing...", 17, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::cow_map<int, int> Map;
+  try{
+    std::map<int, int> stdmap;
+    Map srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      stdmap[ret[i]] = i;
+      srcmap[ret[i]] = i;
+    }
+    Map::view first = srcmap.snapshot();
+    std::map<int, int> stdfirst(stdmap);
+    std::atomic<bool> ok(true);
+    std::thread readers[4];
+    for (auto &reader : readers) {
+      reader = std::thread([&ok, &stdfirst, first]() {
+        for (int round = 0; round < 3; round++) {
+          if (first.size() != stdfirst.size()) ok = false;
+          auto it = first.cbegin();
+          for (auto &x : stdfirst) {
+            if (it->first != x.first || it->second != x.second) ok = false;
+            ++it;
+          }
+        }
+      });
+    }
+    for (int i = 0; i < 10000; i++) {
+      int key = ret[rand() % ret.size()];
+      if (rand() % 2) {
+        srcmap.erase_range(key, key + 1);
+        stdmap.erase(key);
+      } else {
+        srcmap[key] = -i;
+        stdmap[key] = -i;
+      }
+    }
+    for (auto &reader : readers) reader.join();
+    Map::view second = srcmap.snapshot();
+    if (!ok || second.version() <= first.version() || second.size() != stdmap.size()
+        || first.size() != stdfirst.size() || srcmap.use_count() != 2) {
+      console.fail();
+      return;
+    }
+    auto it = second.cbegin();
+    for (auto &x : stdmap) {
+      if (it->first != x.first || it->second != x.second || first.count(x.first) != stdfirst.count(x.first)) {
+        console.fail();
+        return;
+      }
+      ++it;
+    }
+    // periodic snapshots under a live writer: each view keeps its version,
+    //   and releasing the views frees the nodes only they reached
+    typedef sjtu::cow_map<IntA, int, Compare> Named;
+    int live = IntA::counter;
+    {
+      Named named;
+      std::map<int, int, std::greater<int>> stdnamed;
+      std::vector<Named::view> views;
+      std::vector<std::map<int, int, std::greater<int>>> stdviews;
+      for (int i = 0; i < (int)ret.size(); i++) {
+        int key = ret[i] % 1000;
+        if (rand() % 4) {
+          named[key] = i;
+          stdnamed[key] = i;
+        } else {
+          named.erase_range(IntA(key), IntA(key - 1));
+          stdnamed.erase(key);
+        }
+        if (i % 2500 == 0) {
+          views.push_back(named.snapshot());
+          stdviews.push_back(stdnamed);
+        }
+      }
+      for (int i = 0; i < (int)views.size(); i++) {
+        auto it = views[i].cbegin();
+        for (auto &x : stdviews[i]) {
+          if (it == views[i].cend() || it->first.val != x.first || it->second != x.second) {
+            console.fail();
+            return;
+          }
+          ++it;
+        }
+        if (it != views[i].cend()) {
+          console.fail();
+          return;
+        }
+      }
+      while (!views.empty()) {
+        views.erase(views.begin() + rand() % views.size());
+      }
+      if (IntA::counter - live != (int)named.size()) {
+        console.fail();
+        return;
+      }
+    }
+    if (IntA::counter != live) {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.pass();
+}
+
+template<class Balance>
+bool balance_check(const std::vector<int> &ret) {
+  typedef sjtu::map<IntA, IntB, Compare, Balance> Map;
+  std::map<IntA, IntB, Compare> stdmap;
+  Map srcmap;
+  for (int i = 0; i < (int)ret.size(); i++) {
+    IntB tmp = IntB(rand());
+    stdmap.insert(std::map<IntA, IntB, Compare>::value_type(ret[i], tmp));
+    srcmap.insert(typename Map::value_type(ret[i], tmp));
+  }
+  for (int i = 0; i < (int)ret.size(); i++) {
+    int key = ret[rand() % ret.size()];
+    if (rand() % 2) {
+      if (stdmap.count(key)) {
+        stdmap.erase(stdmap.find(key));
+        srcmap.erase(srcmap.find(key));
+      }
+    } else {
+      IntB tmp = IntB(rand());
+      stdmap.insert(std::map<IntA, IntB, Compare>::value_type(key, tmp));
+      srcmap.insert(typename Map::value_type(key, tmp));
+    }
+  }
+  if (!equal_content(stdmap, srcmap)) return false;
+  Map copy(srcmap);
+  auto greater = copy.split(IntA(ret[0]));
+  copy.concatenate(std::move(greater));
+  copy.erase_range(IntA(ret[1]), IntA(ret[1] - 100));
+  stdmap.erase(stdmap.lower_bound(IntA(ret[1])), stdmap.lower_bound(IntA(ret[1] - 100)));
+  return equal_content(stdmap, copy);
+}
+
+void tester18() {
+  TestCore console("Balancing policy testing...", 18, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  try{
+    if (!balance_check<sjtu::wavl_balance>(ret) || !balance_check<sjtu::red_black_balance>(ret)) {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.pass();
+}
+
+void tester19() {
+  TestCore console("Bulk append testing...", 19, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  try{
+    std::map<IntA, IntB, Compare> stdmap;
+    sjtu::map<IntA, IntB, Compare> srcmap;
+    srcmap.begin_bulk();
+    for (int i = 2 * MAXN - 1; i >= 0; i--) {
+      IntB tmp = IntB(rand());
+      stdmap.insert(std::map<IntA, IntB, Compare>::value_type(i, tmp));
+      srcmap.insert(sjtu::map<IntA, IntB, Compare>::value_type(i, tmp));
+      const sjtu::map<IntA, IntB, Compare> &constmap = srcmap;
+      if (i % 1000 == 0 && (*constmap.at(i).val != *tmp.val || constmap.find(i + 1) == constmap.cend())) {
+        console.fail();
+        return;
+      }
+    }
+    for (int i = 0; i < (int)ret.size(); i++) {
+      if (stdmap.count(ret[i])) {
+        stdmap.erase(stdmap.find(ret[i]));
+        srcmap.erase(srcmap.find(ret[i]));
+      }
+      if (srcmap.count(ret[i]) || srcmap.size() != stdmap.size()) {
+        console.fail();
+        return;
+      }
+    }
+    if (!equal_content(stdmap, srcmap)) {
+      console.fail();
+      return;
+    }
+    auto greater = srcmap.split(IntA(MAXN));
+    srcmap.concatenate(std::move(greater));
+    srcmap.end_bulk();
+    for (int i = 0; i < 100; i++) {
+      IntB tmp = IntB(rand());
+      stdmap.insert(std::map<IntA, IntB, Compare>::value_type(-i - 1, tmp));
+      srcmap.insert(sjtu::map<IntA, IntB, Compare>::value_type(-i - 1, tmp));
+    }
+    if (!equal_content(stdmap, srcmap)) {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.pass();
+}
+
+void tester20() {
+  TestCore console("Unchecked iterator testing...", 20, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::map<IntA, IntB, Compare, sjtu::avl_balance, false> Map;
+  try{
+    std::map<IntA, IntB, Compare> stdmap;
+    Map srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      IntB tmp = IntB(rand());
+      stdmap.insert(std::map<IntA, IntB, Compare>::value_type(ret[i], tmp));
+      srcmap.insert(Map::value_type(ret[i], tmp));
+    }
+    for (int i = 0; i < (int)ret.size() / 2; i++) {
+      if (stdmap.count(ret[i])) {
+        stdmap.erase(stdmap.find(ret[i]));
+        srcmap.erase(srcmap.find(ret[i]));
+      }
+    }
+    if (sizeof(Map::iterator) != sizeof(void *) || sizeof(Map::const_iterator) != sizeof(void *)
+        || !equal_content(stdmap, srcmap)) {
+      console.fail();
+      return;
+    }
+    Map::iterator it = srcmap.end();
+    for (auto itA = stdmap.rbegin(); itA != stdmap.rend(); ++itA) {
+      it--;
+      if (it->first.val != itA->first.val || *it->second.val != *itA->second.val) {
+        console.fail();
+        return;
+      }
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.pass();
+}
+
+void tester21() {
+  TestCore console("Parallel algorithm testing...", 21, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::map<int, long long> Map;
+  Map::parallel_threshold = 0;
+  Map::parallel_threads = 4;
+  try{
+    std::map<int, long long> stdmap;
+    Map srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      stdmap[ret[i]] = i;
+      srcmap[ret[i]] = i;
+    }
+    srcmap.parallel_for_each(srcmap.begin(), srcmap.end(), [](Map::value_type &x) { x.second = x.second * 3 + x.first; });
+    for (auto &x : stdmap) x.second = x.second * 3 + x.first;
+    if (!equal_content(stdmap, srcmap)) {
+      console.fail();
+      return;
+    }
+    for (int round = 0; round < 20; round++) {
+      int a = ret[rand() % ret.size()], b = ret[rand() % ret.size()];
+      if (b < a) std::swap(a, b);
+      long long sum = srcmap.parallel_reduce(srcmap.find(a), srcmap.find(b), 0ll,
+                                             [](long long s, const Map::value_type &x) { return s + x.second; });
+      std::vector<int> keys = srcmap.parallel_reduce(srcmap.find(a), srcmap.find(b), std::vector<int>(),
+              [](std::vector<int> v, const Map::value_type &x) { v.push_back(x.first); return v; },
+              [](std::vector<int> l, std::vector<int> r) { l.insert(l.end(), r.begin(), r.end()); return l; });
+      long long stdsum = 0;
+      std::vector<int> stdkeys;
+      for (auto it = stdmap.find(a); it != stdmap.find(b); ++it) {
+        stdsum += it->second;
+        stdkeys.push_back(it->first);
+      }
+      if (sum != stdsum || keys != stdkeys) {
+        console.fail();
+        return;
+      }
+    }
+    bool thrown = false;
+    try {
+      srcmap.parallel_for_each(srcmap.find(ret[1]), srcmap.find(ret[0]), [](Map::value_type &) {});
+      srcmap.parallel_for_each(srcmap.find(ret[0]), srcmap.find(ret[1]), [](Map::value_type &) {});
+    } catch (sjtu::invalid_iterator) {
+      thrown = true;
+    }
+    if (!thrown) {
+      console.fail();
+      return;
+    }
+    thrown = false;
+    int bad = ret[ret.size() / 2];
+    try {
+      const Map &constmap = srcmap;
+      constmap.parallel_for_each(constmap.cbegin(), constmap.cend(), [bad](const Map::value_type &x) {
+        if (x.first == bad) throw x.first;
+      });
+    } catch (int key) {
+      thrown = key == bad;
+    }
+    if (!thrown || srcmap.parallel_reduce(srcmap.cend(), srcmap.cend(), 7ll,
+                                                     [](long long s, const Map::value_type &) { return s + 1; }) != 7) {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    Map::parallel_threshold = 1 << 15;
+    Map::parallel_threads = 0;
+    return;
+  }
+  Map::parallel_threshold = 1 << 15;
+  Map::parallel_threads = 0;
+  console.pass();
+}
+
+void tester22() {
+  TestCore console("Range scan testing...", 22, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::map<int, int> Map;
+  try{
+    std::map<int, int> stdmap;
+    Map srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      stdmap[ret[i]] = i;
+      srcmap[ret[i]] = i;
+    }
+    for (int round = 0; round < 40; round++) {
+      int a = ret[rand() % ret.size()], b = round % 4 ? ret[rand() % ret.size()] : a + 1;
+      if (b < a) std::swap(a, b);
+      std::vector<std::pair<int, int>> seen;
+      size_t n = srcmap.scan(a, b, [&seen](Map::value_type *const *batch, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+          batch[i]->second++;
+          seen.emplace_back(batch[i]->first, batch[i]->second);
+        }
+      });
+      std::vector<std::pair<int, int>> expect;
+      for (auto it = stdmap.lower_bound(a); it != stdmap.lower_bound(b); ++it) {
+        it->second++;
+        expect.emplace_back(it->first, it->second);
+      }
+      if (n != expect.size() || seen != expect) {
+        console.fail();
+        return;
+      }
+    }
+    Map::prefetch_iterator it = srcmap.prefetching(srcmap.cbegin(), srcmap.cend());
+    Map::prefetch_iterator middle = it;
+    auto half = std::next(stdmap.begin(), stdmap.size() / 2);
+    for (auto x = stdmap.begin(); x != stdmap.end(); ++x) {
+      if (x == half) middle = it;
+      if (it == srcmap.cend() || it->first != x->first || (*it).second != x->second) {
+        console.fail();
+        return;
+      }
+      ++it;
+    }
+    // a copy keeps its place while the original moves on past their block
+    for (auto x = half; x != stdmap.end(); ++x, ++middle) {
+      if (middle == srcmap.cend() || middle->first != x->first) {
+        console.fail();
+        return;
+      }
+    }
+    bool thrown = false;
+    try {
+      ++it;
+    } catch (sjtu::invalid_iterator) {
+      thrown = true;
+    }
+    if (it != srcmap.cend() || !thrown) {
+      console.fail();
+      return;
+    }
+    srcmap.begin_bulk();
+    int top = stdmap.rbegin()->first;
+    for (int i = 1; i <= 1000; i++) {
+      stdmap[top + i] = i;
+      srcmap[top + i] = i;
+    }
+    const Map &constmap = srcmap;
+    size_t n = 0;
+    bool ok = true;
+    auto expect = stdmap.lower_bound(top - 100);
+    constmap.scan(top - 100, top + 500, [&](const Map::value_type *const *batch, size_t count) {
+      for (size_t i = 0; i < count; i++, n++, ++expect) {
+        if (batch[i]->first != expect->first || batch[i]->second != expect->second) ok = false;
+      }
+    });
+    int near = std::prev(stdmap.find(top), 5)->first;
+    auto down = stdmap.lower_bound(top + 500);
+    size_t m = constmap.reverse_scan(top - 100, top + 500, [&](const Map::value_type *const *batch, size_t count) {
+      for (size_t i = 0; i < count; i++) {
+        if (batch[i]->first != (--down)->first) ok = false;
+      }
+    });
+    if (m != n) ok = false;
+    Map::prefetch_iterator pit = constmap.prefetching(constmap.find(near), constmap.cend());
+    Map::prefetch_iterator copy = pit;
+    for (auto x = stdmap.find(near); x != stdmap.end(); ++x, ++pit) {
+      if (pit == constmap.cend() || pit->first != x->first) ok = false;
+    }
+    // reversed ranges are refused while appends are pending, too
+    int refused = 0;
+    try {
+      constmap.prefetching(constmap.find(top + 10), constmap.find(near));
+    } catch (sjtu::invalid_iterator) {
+      refused++;
+    }
+    try {
+      constmap.prefetching(constmap.crend(), constmap.crbegin());
+    } catch (sjtu::invalid_iterator) {
+      refused++;
+    }
+    try {
+      constmap.parallel_reduce(constmap.cend(), constmap.find(top + 10), 0L,
+                               [](long s, const Map::value_type &v) { return s + v.second; });
+    } catch (sjtu::invalid_iterator) {
+      refused++;
+    }
+    try {
+      srcmap.parallel_for_each(srcmap.find(top + 20), srcmap.find(top + 10), [](Map::value_type &v) { v.second++; });
+    } catch (sjtu::invalid_iterator) {
+      refused++;
+    }
+    if (refused != 4) ok = false;
+    srcmap.end_bulk();
+    if (!ok || n != (size_t)std::distance(stdmap.lower_bound(top - 100), stdmap.lower_bound(top + 500))
+        || pit != constmap.cend() || copy->first != near || !equal_content(stdmap, srcmap)) {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.pass();
+}
+
+void tester23() {
+  TestCore console("Reverse iterator testing...", 23, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::map<IntA, IntB, Compare> Map;
+  try{
+    std::map<IntA, IntB, Compare> stdmap;
+    Map srcmap;
+    bool thrown = false;
+    try {
+      ++srcmap.rend();
+    } catch (sjtu::invalid_iterator) {
+      thrown = true;
+    }
+    if (!thrown || srcmap.rbegin() != srcmap.rend()) {
+      console.fail();
+      return;
+    }
+    for (int i = 0; i < (int)ret.size(); i++) {
+      IntB tmp = IntB(rand());
+      stdmap.insert(std::map<IntA, IntB, Compare>::value_type(ret[i], tmp));
+      srcmap.insert(Map::value_type(ret[i], tmp));
+    }
+    for (int i = 0; i < (int)ret.size() / 4; i++) {
+      auto it = srcmap.rbegin();
+      auto itA = stdmap.rbegin();
+      for (int j = rand() % 5; j; j--, ++it) ++itA;
+      srcmap.erase((++it).base());
+      stdmap.erase(std::next(itA).base());
+    }
+    Map::const_reverse_iterator it = srcmap.crbegin();
+    for (auto itA = stdmap.rbegin(); itA != stdmap.rend(); ++itA, it++) {
+      if (it == srcmap.crend() || it->first.val != itA->first.val || *(*it).second.val != *itA->second.val) {
+        console.fail();
+        return;
+      }
+    }
+    thrown = false;
+    try {
+      it++;
+    } catch (sjtu::invalid_iterator) {
+      thrown = true;
+    }
+    --it;
+    if (!thrown || it->first.val != stdmap.begin()->first.val) {
+      console.fail();
+      return;
+    }
+    thrown = false;
+    try {
+      --srcmap.rbegin();
+    } catch (sjtu::invalid_iterator) {
+      thrown = true;
+    }
+    Map::reverse_prefetch_iterator pit = srcmap.prefetching(srcmap.crbegin(), srcmap.crend());
+    for (auto itA = stdmap.rbegin(); itA != stdmap.rend(); ++itA, ++pit) {
+      if (pit == srcmap.crend() || pit->first.val != itA->first.val) thrown = false;
+    }
+    if (!thrown || pit != srcmap.crend()) {
+      console.fail();
+      return;
+    }
+    for (int round = 0; round < 20; round++) {
+      IntA a = ret[rand() % ret.size()], b = ret[rand() % ret.size()];
+      if (Compare()(b, a)) std::swap(a.val, b.val);
+      std::vector<int> seen;
+      size_t limit = round % 2 ? 50 : ret.size();
+      srcmap.reverse_scan(a, b, [&](Map::value_type *const *batch, size_t n) {
+        for (size_t i = 0; i < n && seen.size() < limit; i++) seen.push_back(batch[i]->first.val);
+        return seen.size() < limit;
+      });
+      std::vector<int> expect;
+      for (auto itA = std::make_reverse_iterator(stdmap.lower_bound(b));
+           itA != std::make_reverse_iterator(stdmap.lower_bound(a)) && expect.size() < limit; ++itA) {
+        expect.push_back(itA->first.val);
+      }
+      if (seen != expect) {
+        console.fail();
+        return;
+      }
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.pass();
+}
+
+void tester24() {
+  TestCore console("Concurrent map testing...", 24, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::concurrent_map<int, int> Map;
+  try{
+    std::map<int, int> stdmap;
+    Map srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      stdmap[ret[i]] = i;
+    }
+    std::vector<Map::value_type> values;
+    for (auto &x : stdmap) values.push_back(Map::value_type(x.first, x.second));
+    std::atomic<bool> ok(true);
+    std::thread writers[4], readers[4];
+    for (int t = 0; t < 4; t++) {
+      writers[t] = std::thread([&, t]() {
+        size_t from = values.size() * t / 4, to = values.size() * (t + 1) / 4;
+        for (size_t i = from; i < to; i += 100) {
+          if (srcmap.insert(values.begin() + i, values.begin() + std::min(i + 100, to)) != std::min((size_t)100, to - i)) ok = false;
+        }
+        for (size_t i = (from + 2) / 3 * 3; i < to; i += 3) {
+          srcmap.update(values[i].first, [](int &x) { x = -x; });
+        }
+      });
+      readers[t] = std::thread([&]() {
+        for (int round = 0; round < 2000; round++) {
+          const Map::value_type &x = values[rand() % values.size()];
+          int value;
+          if (srcmap.find(x.first, value) && value != x.second && value != -x.second) ok = false;
+        }
+        srcmap.read([&](const Map::base &map) {
+          int last = -1;
+          for (auto it = map.cbegin(); it != map.cend(); ++it) {
+            if (it->first <= last) ok = false;
+            last = it->first;
+          }
+          return 0;
+        });
+      });
+    }
+    for (int t = 0; t < 4; t++) {
+      writers[t].join();
+      readers[t].join();
+    }
+    int i = 0;
+    for (auto &x : stdmap) {
+      if (i++ % 3 == 0) x.second = -x.second;
+    }
+    i = 0;
+    for (auto &x : values) {
+      if (i++ % 3 == 0) x.second = -x.second;
+    }
+    std::vector<int> keys;
+    for (int k = 0; k < (int)ret.size() / 2; k++) {
+      keys.push_back(ret[k]);
+      stdmap.erase(ret[k]);
+    }
+    srcmap.erase(keys.begin(), keys.end());
+    Map copy;
+    copy = srcmap;
+    bool thrown = false;
+    try {
+      srcmap.at(ret[0]);
+    } catch (sjtu::index_out_of_bound) {
+      thrown = true;
+    }
+    if (!ok || !thrown || srcmap.size() != stdmap.size() || !equal_content(stdmap, copy.snapshot())) {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.pass();
+}
+
+void tester25() {
+  TestCore console("Optimistic read testing...", 25, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::concurrent_map<int, int, std::less<int>, sjtu::avl_balance, true, true> Map;
+  try{
+    std::map<int, int> stdmap;
+    Map srcmap;
+    for (int i = 0; i < (int)ret.size(); i += 2) {
+      stdmap[ret[i]] = ret[i] % 100000 * 2;
+      srcmap.assign(ret[i], ret[i] % 100000 * 2);
+    }
+    std::atomic<bool> ok(true), done(false);
+    std::thread readers[4];
+    for (int t = 0; t < 4; t++) {
+      readers[t] = std::thread([&, t]() {
+        unsigned seed = t;
+        while (!done) {
+          int key = ret[rand_r(&seed) % ret.size()], value;
+          if (srcmap.find(key, value) && value != key % 100000 * 2 && value != key % 100000 * 3) ok = false;
+          if (srcmap.count(key) > 1) ok = false;
+          try {
+            value = srcmap.at(key);
+            if (value != key % 100000 * 2 && value != key % 100000 * 3) ok = false;
+          } catch (sjtu::index_out_of_bound) {}
+        }
+      });
+    }
+    for (int i = 0; i < 20000; i++) {
+      int key = ret[rand() % ret.size()];
+      switch (rand() % 4) {
+        case 0:
+          srcmap.erase(key);
+          stdmap.erase(key);
+          break;
+        case 1:
+          srcmap.insert(Map::value_type(key, key % 100000 * 2));
+          stdmap.insert(std::make_pair(key, key % 100000 * 2));
+          break;
+        case 2:
+          srcmap.update(key, [key](int &x) { x = x == key % 100000 * 2 ? key % 100000 * 3 : key % 100000 * 2; });
+          stdmap[key] = stdmap[key] == key % 100000 * 2 ? key % 100000 * 3 : key % 100000 * 2;
+          break;
+        default:
+          srcmap.erase_range(key, key + 1000);
+          stdmap.erase(stdmap.lower_bound(key), stdmap.lower_bound(key + 1000));
+      }
+    }
+    done = true;
+    for (auto &reader : readers) reader.join();
+    Map copy(srcmap);
+    copy = srcmap;
+    srcmap.clear();
+    if (!ok || srcmap.size() || copy.count(stdmap.begin()->first) != 1 || !equal_content(stdmap, copy.snapshot())) {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.pass();
+}
+
+void tester26() {
+  TestCore console("Sharded map testing...", 26, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::sharded_map<int, int> Map;
+  Map::max_shard_size = 1024;
+  try{
+    std::map<int, int> stdmap;
+    Map srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      stdmap[ret[i]] = i;
+    }
+    std::vector<std::pair<int, int>> values(stdmap.begin(), stdmap.end());
+    std::atomic<bool> ok(true);
+    std::thread writers[4], reader;
+    for (int t = 0; t < 4; t++) {
+      writers[t] = std::thread([&, t]() {
+        for (size_t i = t; i < values.size(); i += 4) {
+          if (!srcmap.insert(Map::value_type(values[i].first, -1))) ok = false;
+          srcmap.assign(values[i].first, values[i].second);
+        }
+      });
+    }
+    reader = std::thread([&]() {
+      for (int round = 0; round < 5; round++) {
+        long long last = -1;
+        srcmap.for_each([&](const Map::value_type &x) {
+          if (x.first <= last) ok = false;
+          last = x.first;
+        });
+      }
+    });
+    for (auto &writer : writers) writer.join();
+    reader.join();
+    size_t shards = srcmap.shard_count();
+    std::vector<std::pair<int, int>> seen;
+    srcmap.for_each([&](const Map::value_type &x) { seen.emplace_back(x.first, x.second); });
+    if (!ok || shards < stdmap.size() / 1024 || seen != values || srcmap.size() != stdmap.size()) {
+      console.fail();
+      return;
+    }
+    for (int i = 0; i < (int)ret.size(); i++) {
+      if (i % 10 && stdmap.count(ret[i])) {
+        if (srcmap.erase(ret[i]) != 1) ok = false;
+        stdmap.erase(ret[i]);
+      }
+    }
+    for (int round = 0; round < 20; round++) {
+      int a = ret[rand() % ret.size()], b = ret[rand() % ret.size()];
+      if (b < a) std::swap(a, b);
+      size_t n = srcmap.scan(a, b, [&](const Map::value_type *const *batch, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+          auto it = stdmap.find(batch[i]->first);
+          if (it == stdmap.end() || it->second != batch[i]->second) ok = false;
+        }
+      });
+      if (n != (size_t)std::distance(stdmap.lower_bound(a), stdmap.lower_bound(b))) ok = false;
+    }
+    // a visitor that stops after limit elements, counting them itself:
+    //   its count must carry over from shard to shard, and its false end the scan
+    struct first_keys {
+      size_t limit, taken;
+      std::vector<int> *keys;
+
+      bool operator()(const Map::value_type *const *batch, size_t count) {
+        for (size_t i = 0; i < count; i++) keys->push_back(batch[i]->first);
+        taken += count;
+        return taken < limit;
+      }
+    };
+    std::vector<int> keys;
+    size_t limit = 2 * stdmap.size() / srcmap.shard_count() + 1;
+    size_t n = srcmap.scan(stdmap.begin()->first, stdmap.rbegin()->first + 1, first_keys{limit, 0, &keys});
+    if (srcmap.shard_count() < 4 || n != keys.size() || n < limit || n >= stdmap.size()) ok = false;
+    auto stdit = stdmap.begin();
+    for (size_t i = 0; i < keys.size() && ok; i++, ++stdit) {
+      if (keys[i] != stdit->first) ok = false;
+    }
+    int value;
+    if (!ok || srcmap.shard_count() >= shards || srcmap.size() != stdmap.size()
+        || !srcmap.find(stdmap.begin()->first, value) || value != stdmap.begin()->second) {
+      console.fail();
+      return;
+    }
+    srcmap.clear();
+    if (!srcmap.empty() || srcmap.shard_count() != 1) {
+      console.fail();
+      return;
+    }
+    // in order, the keys fill shards of 512; the second shrinks below a quarter
+    //   while both neighbours are too big to take it, then the first shrinks
+    //   until the two fit in half, which must merge them
+    for (int i = 0; i < 4096; i++) srcmap.insert(Map::value_type(i, i));
+    size_t before = srcmap.shard_count();
+    for (int i = 512; i < 824; i++) srcmap.erase(i);
+    if (srcmap.shard_count() != before) ok = false;
+    for (int i = 0; i < 256; i++) srcmap.erase(i);
+    if (!ok || srcmap.shard_count() != before - 1 || srcmap.size() != 4096 - 312 - 256) {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    Map::max_shard_size = 1 << 16;
+    return;
+  }
+  Map::max_shard_size = 1 << 16;
+  console.pass();
+}
+
+struct epoch_cell {
+  int value;
+  std::atomic<bool> freed{false};
+
+  explicit epoch_cell(int value) : value(value) {}
+};
+
+std::atomic<int> epoch_freed(0);
+
+void free_epoch_cell(void *p) {
+  static_cast<epoch_cell *>(p)->freed = true;
+  epoch_freed++;
+}
+
+void tester27() {
+  TestCore console("Epoch reclamation testing...", 27, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  std::vector<epoch_cell *> cells;
+  try{
+    epoch_freed = 0;
+    {
+      sjtu::epoch_domain domain;
+      std::atomic<bool> pinned(false), release(false);
+      std::thread reader([&]() {
+        sjtu::epoch_domain::guard guard(domain);
+        pinned = true;
+        while (!release) std::this_thread::yield();
+      });
+      while (!pinned) std::this_thread::yield();
+      for (int i = 0; i < 1000; i++) {
+        cells.push_back(new epoch_cell(i));
+        domain.retire(cells.back(), free_epoch_cell);
+      }
+      if (epoch_freed != 0) {
+        release = true;
+        reader.join();
+        for (auto cell : cells) delete cell;
+        console.fail();
+        return;
+      }
+      release = true;
+      reader.join();
+      for (int i = 0; i < 1000; i++) {
+        cells.push_back(new epoch_cell(i));
+        domain.retire(cells.back(), free_epoch_cell);
+      }
+      if (epoch_freed < 1000) {
+        for (auto cell : cells) delete cell;
+        console.fail();
+        return;
+      }
+      epoch_cell *first = new epoch_cell(0);
+      cells.push_back(first);
+      std::atomic<epoch_cell *> shared(first);
+      std::atomic<bool> ok(true);
+      std::thread readers[3];
+      for (auto &reader : readers) {
+        reader = std::thread([&]() {
+          for (int i = 0; i < 20000; i++) {
+            sjtu::epoch_domain::guard guard(domain);
+            epoch_cell *cell = shared.load();
+            if (cell->freed) ok = false;
+            std::this_thread::yield();
+            if (cell->freed) ok = false;
+          }
+        });
+      }
+      std::vector<epoch_cell *> fresh;
+      for (int i = 1; i <= 20000; i++) fresh.push_back(new epoch_cell(i));
+      for (auto cell : fresh) {
+        domain.retire(shared.exchange(cell), free_epoch_cell);
+      }
+      for (auto &reader : readers) reader.join();
+      cells.insert(cells.end(), fresh.begin(), fresh.end());
+      if (!ok) {
+        for (auto cell : cells) delete cell;
+        console.fail();
+        return;
+      }
+    }
+    if (epoch_freed != (int)cells.size() - 1) {
+      for (auto cell : cells) delete cell;
+      console.fail();
+      return;
+    }
+    for (auto cell : cells) delete cell;
+    cells.clear();
+    sjtu::epoch_domain domain;
+    std::map<int, int> stdmap;
+    sjtu::map<int, int> srcmap;
+    srcmap.reclaim_through(domain);
+    for (int i = 0; i < (int)ret.size(); i++) {
+      stdmap[ret[i]] = i;
+      srcmap[ret[i]] = i;
+    }
+    for (int i = 0; i < (int)ret.size(); i += 2) {
+      stdmap.erase(ret[i]);
+      auto it = srcmap.find(ret[i]);
+      if (it != srcmap.end()) srcmap.erase(it);
+    }
+    int lo = ret[0] < ret[1] ? ret[0] : ret[1], hi = ret[0] < ret[1] ? ret[1] : ret[0];
+    stdmap.erase(stdmap.lower_bound(lo), stdmap.lower_bound(hi));
+    srcmap.erase_range(lo, hi);
+    if (!equal_content(stdmap, srcmap)) {
+      console.fail();
+      return;
+    }
+    srcmap.clear();
+    if (!srcmap.empty()) {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    for (auto cell : cells) delete cell;
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.pass();
+}
+
+void tester28() {
+  TestCore console("Skiplist map testing...", 28, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::skiplist_map<int, int> Map;
+  try{
+    std::map<int, int> stdmap;
+    Map srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      stdmap[ret[i]] = i;
+      srcmap[ret[i]] = i;
+      if (srcmap.insert(Map::value_type(ret[i], -1)).first->second != i) {
+        console.fail();
+        return;
+      }
+    }
+    for (int i = 0; i < (int)ret.size(); i += 3) {
+      auto it = srcmap.find(ret[i]);
+      if (it != srcmap.end()) srcmap.erase(it);
+      stdmap.erase(ret[i]);
+    }
+    if (!equal_content(stdmap, srcmap) || srcmap.at(stdmap.begin()->first) != stdmap.begin()->second
+        || srcmap.count(ret[0]) || srcmap.find(ret[0]) != srcmap.cend()) {
+      console.fail();
+      return;
+    }
+    int thrown = 0;
+    try { srcmap.at(ret[0]); } catch (sjtu::index_out_of_bound) { thrown++; }
+    try { --srcmap.begin(); } catch (sjtu::invalid_iterator) { thrown++; }
+    try { ++srcmap.end(); } catch (sjtu::invalid_iterator) { thrown++; }
+    try { srcmap.erase(srcmap.end()); } catch (sjtu::invalid_iterator) { thrown++; }
+    Map other(srcmap);
+    try { srcmap.erase(other.begin()); } catch (sjtu::invalid_iterator) { thrown++; }
+    auto dead = srcmap.begin();
+    srcmap.erase(dead);
+    try { srcmap.erase(dead); } catch (sjtu::invalid_iterator) { thrown++; }
+    srcmap.erase(other.begin()->first);
+    if (thrown != 6 || !equal_content(stdmap, other) || srcmap.size() != stdmap.size() - 1) {
+      console.fail();
+      return;
+    }
+    other.clear();
+    srcmap = other;
+    if (!srcmap.empty() || srcmap.begin() != srcmap.end()) {
+      console.fail();
+      return;
+    }
+    std::atomic<bool> ok(true);
+    std::thread writers[4], eraser, reader;
+    for (int t = 0; t < 4; t++) {
+      writers[t] = std::thread([&, t]() {
+        for (int i = t; i < (int)ret.size(); i += 4) {
+          srcmap.insert(Map::value_type(ret[i], ret[i] % 1000));
+        }
+      });
+    }
+    eraser = std::thread([&]() {
+      for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < (int)ret.size(); i += 7) srcmap.erase(ret[i]);
+      }
+    });
+    reader = std::thread([&]() {
+      for (int round = 0; round < 5; round++) {
+        long long last = -1;
+        for (auto it = srcmap.cbegin(); it != srcmap.cend(); ++it) {
+          if (it->first <= last || it->second != it->first % 1000) ok = false;
+          last = it->first;
+        }
+      }
+    });
+    for (auto &writer : writers) writer.join();
+    eraser.join();
+    reader.join();
+    for (int i = 0; i < (int)ret.size(); i += 7) srcmap.erase(ret[i]);
+    stdmap.clear();
+    for (int i = 0; i < (int)ret.size(); i++) stdmap[ret[i]] = ret[i] % 1000;
+    for (int i = 0; i < (int)ret.size(); i += 7) stdmap.erase(ret[i]);
+    if (!ok || !equal_content(stdmap, srcmap)) {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.pass();
+}
+
+void tester29() {
+  TestCore console("Batch insert testing...", 29, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::map<int, int> Map;
+  Map::parallel_threshold = 64;
+  try{
+    for (unsigned threads = 1; threads <= 7; threads += 3) {
+      Map::parallel_threads = threads;
+      std::map<int, int> stdmap;
+      Map srcmap;
+      for (int i = 0; i < (int)ret.size(); i += 2) {
+        stdmap[ret[i]] = i;
+        srcmap[ret[i]] = i;
+      }
+      auto it = srcmap.find(ret[0]);
+      std::vector<Map::value_type> batch;
+      for (int i = 0; i < (int)ret.size(); i++) {
+        int key = ret[(i * 7) % ret.size()];
+        batch.push_back(Map::value_type(key, -i));
+        stdmap.insert(std::make_pair(key, -i));
+      }
+      size_t before = srcmap.size();
+      size_t inserted = srcmap.insert_batch(batch.begin(), batch.end());
+      if (inserted != srcmap.size() - before || !equal_content(stdmap, srcmap)
+          || it->first != ret[0] || it->second != 0) {
+        Map::parallel_threshold = 1 << 15;
+        Map::parallel_threads = 0;
+        console.fail();
+        return;
+      }
+      for (int k = 0; k < (int)stdmap.size(); k += 97) {
+        if (srcmap.nth(k)->first != std::next(stdmap.begin(), k)->first) {
+          Map::parallel_threshold = 1 << 15;
+          Map::parallel_threads = 0;
+          console.fail();
+          return;
+        }
+      }
+      Map fresh;
+      std::map<int, int> stdfresh(stdmap);
+      if (fresh.insert_batch(srcmap.cbegin(), srcmap.cend()) != stdfresh.size() || !equal_content(stdfresh, fresh)
+          || fresh.insert_batch(batch.begin(), batch.begin()) != 0) {
+        Map::parallel_threshold = 1 << 15;
+        Map::parallel_threads = 0;
+        console.fail();
+        return;
+      }
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    Map::parallel_threshold = 1 << 15;
+    Map::parallel_threads = 0;
+    return;
+  }
+  Map::parallel_threshold = 1 << 15;
+  Map::parallel_threads = 0;
+  console.pass();
+}
+
+template<class Map>
+bool buffered_map_works(const std::vector<int> &ret) {
+  Map::buffer_capacity = 16;
+  Map srcmap;
+  std::map<int, int> stdmap;
+  for (int i = 0; i < (int)ret.size(); i++) {
+    int key = ret[i] % 1000;
+    int value = 0;
+    switch (i % 4) {
+      case 0:
+        srcmap.insert(typename Map::value_type(key, i));
+        stdmap.insert(std::make_pair(key, i));
+        break;
+      case 1:
+        srcmap.assign(key, i);
+        stdmap[key] = i;
+        break;
+      case 2:
+        srcmap.erase(key);
+        stdmap.erase(key);
+        break;
+      default:
+        if (srcmap.find(key, value) != (stdmap.count(key) == 1)) return false;
+        if (stdmap.count(key) && value != stdmap[key]) return false;
+    }
+  }
+  if (!equal_content(stdmap, srcmap.snapshot())) return false;
+  std::atomic<bool> ok(true);
+  std::thread writers[4];
+  for (int t = 0; t < 4; t++) {
+    writers[t] = std::thread([&, t]() {
+      for (int i = 0; i < (int)ret.size(); i++) {
+        int key = ret[i] % 4000 / 4 * 4 + t;
+        int value;
+        if (i % 3 == 2) {
+          srcmap.erase(key);
+          if (srcmap.count(key)) ok = false;
+        } else {
+          srcmap.assign(key, i);
+          if (!srcmap.find(key, value) || value != i) ok = false;
+        }
+      }
+    });
+  }
+  for (auto &writer : writers) writer.join();
+  for (int t = 0; t < 4; t++) {
+    for (int i = 0; i < (int)ret.size(); i++) {
+      int key = ret[i] % 4000 / 4 * 4 + t;
+      if (i % 3 == 2) {
+        stdmap.erase(key);
+      } else {
+        stdmap[key] = i;
+      }
+    }
+  }
+  srcmap.flush();
+  return ok && srcmap.size() == stdmap.size() && equal_content(stdmap, srcmap.snapshot());
+}
+
+void tester30() {
+  TestCore console("Buffered map testing...", 30, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::buffered_map<int, int> Merged;
+  typedef sjtu::buffered_map<int, int, std::less<int>, sjtu::avl_balance, true, true> Flushing;
+  bool ok = false;
+  try{
+    ok = buffered_map_works<Merged>(ret) && buffered_map_works<Flushing>(ret);
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    Merged::buffer_capacity = Flushing::buffer_capacity = 256;
+    return;
+  }
+  Merged::buffer_capacity = Flushing::buffer_capacity = 256;
+  if (!ok) {
+    console.fail();
+    return;
+  }
+  console.pass();
+}
+
+/**
+ * trivially copyable, but with no default constructor.
+ */
+struct Stamp {
+  int val;
+  explicit Stamp(int val) : val(val) {}
+  bool operator<(const Stamp &rhs) const { return val < rhs.val; }
+};
+
+void tester31() {
+  TestCore console("Save and load testing...", 31, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::map<int, int> Map;
+  typedef sjtu::map<std::string, int> Named;
+  try{
+    std::map<int, int> stdmap;
+    Map srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      stdmap[ret[i]] = i;
+      srcmap[ret[i]] = i;
+    }
+    std::stringstream raw;
+    srcmap.save(raw);
+    std::string saved = raw.str();
+    Map loaded;
+    loaded[-1] = -1;
+    loaded.load(raw);
+    if (!equal_content(stdmap, loaded) || (loaded.size() && loaded.nth(loaded.size() / 2)->first != std::next(stdmap.begin(), stdmap.size() / 2)->first)) {
+      console.fail();
+      return;
+    }
+    Map empty, fresh;
+    std::stringstream nothing;
+    empty.save(nothing);
+    fresh.load(nothing);
+    if (!fresh.empty()) {
+      console.fail();
+      return;
+    }
+    // the raw format needs no default constructor
+    typedef sjtu::map<Stamp, Stamp> Stamps;
+    Stamps stamps, stamped;
+    for (int i = 0; i < 1000; i++) stamps.insert(Stamps::value_type(Stamp(ret[i]), Stamp(i)));
+    std::stringstream marks;
+    stamps.save(marks);
+    stamped.load(marks);
+    if (stamped.size() != stamps.size()) {
+      console.fail();
+      return;
+    }
+    for (Stamps::const_iterator a = stamps.cbegin(), b = stamped.cbegin(); a != stamps.cend(); ++a, ++b) {
+      if (a->first.val != b->first.val || a->second.val != b->second.val) {
+        console.fail();
+        return;
+      }
+    }
+    // a truncated or foreign stream throws and leaves the map alone
+    int thrown = 0;
+    std::stringstream truncated(saved.substr(0, saved.size() - 3));
+    try{
+      loaded.load(truncated);
+    } catch(sjtu::runtime_error &) {
+      ++thrown;
+    }
+    std::string corrupt = saved;
+    corrupt[0] = 'x';
+    std::stringstream foreign(corrupt);
+    try{
+      loaded.load(foreign);
+    } catch(sjtu::runtime_error &) {
+      ++thrown;
+    }
+    if (thrown != 2 || !equal_content(stdmap, loaded)) {
+      console.fail();
+      return;
+    }
+    std::map<std::string, int> stdnamed;
+    Named named;
+    for (int i = 0; i < (int)ret.size(); i += 3) {
+      std::string key = std::to_string(ret[i]);
+      stdnamed[key] = i;
+      named[key] = i;
+    }
+    auto write = [](std::ostream &out, const Named::value_type &value) {
+      size_t length = value.first.size();
+      out.write(reinterpret_cast<const char *>(&length), sizeof(length));
+      out.write(value.first.data(), length);
+      out.write(reinterpret_cast<const char *>(&value.second), sizeof(value.second));
+    };
+    auto read = [](std::istream &in) {
+      size_t length = 0;
+      in.read(reinterpret_cast<char *>(&length), sizeof(length));
+      std::string key(in ? length : 0, '\0');
+      in.read(&key[0], key.size());
+      int value = 0;
+      in.read(reinterpret_cast<char *>(&value), sizeof(value));
+      return Named::value_type(key, value);
+    };
+    std::stringstream elements;
+    named.save(elements, write);
+    Named back;
+    back.load(elements, read);
+    std::stringstream mismatched(saved);
+    try{
+      back.load(mismatched, read);
+    } catch(sjtu::runtime_error &) {
+      ++thrown;
+    }
+    if (thrown != 3 || !equal_content(stdnamed, back)) {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.pass();
+}
+
+void tester32() {
+  TestCore console("Mapped map testing...", 32, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::mapped_map<int, int> Mapped;
+  const char *path = "mapped_map_test.bin";
+  try{
+    std::map<int, int> stdmap;
+    sjtu::map<int, int> srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      stdmap[ret[i] / 2 * 2] = i;
+      srcmap[ret[i] / 2 * 2] = i;
+    }
+    Mapped::write(srcmap, path);
+    Mapped mapped(path);
+    if (!equal_content(stdmap, mapped)) {
+      std::remove(path);
+      console.fail();
+      return;
+    }
+    for (int i = 0; i < (int)ret.size(); i++) {
+      int key = ret[i] / 2 * 2 + i % 2;
+      auto a = stdmap.lower_bound(key);
+      auto b = mapped.lower_bound(key);
+      if ((a == stdmap.end()) != (b == mapped.cend()) || (b != mapped.cend() && (a->first != b->first || a->second != b->second))
+          || stdmap.count(key) != mapped.count(key) || (mapped.find(key) != mapped.cend()) != (a != stdmap.end() && a->first == key)) {
+        std::remove(path);
+        console.fail();
+        return;
+      }
+    }
+    int thrown = 0;
+    try{
+      mapped.at(-1);
+    } catch(sjtu::index_out_of_bound &) {
+      ++thrown;
+    }
+    try{
+      ++mapped.cend();
+    } catch(sjtu::invalid_iterator &) {
+      ++thrown;
+    }
+    try{
+      sjtu::mapped_map<long long, int> wrong(path);
+    } catch(sjtu::runtime_error &) {
+      ++thrown;
+    }
+    sjtu::map<int, int> empty;
+    Mapped::write(empty, path);
+    Mapped nothing(path);
+    if (thrown != 3 || !nothing.empty() || nothing.lower_bound(0) != nothing.cend() || mapped.at(ret[0] / 2 * 2) != stdmap[ret[0] / 2 * 2]) {
+      std::remove(path);
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    std::remove(path);
+    return;
+  }
+  std::remove(path);
+  console.pass();
+}
+
+/**
+ * remove the files of the durable map at path.
+ */
+void remove_durable(const std::string &path) {
+  std::remove((path + ".checkpoint").c_str());
+  std::remove((path + ".checkpoint.tmp").c_str());
+  for (int g = 1; g < 1000; g++) std::remove((path + ".log." + std::to_string(g)).c_str());
+}
+
+template<class Map>
+bool durable_map_works(const std::vector<int> &ret, const std::string &path) {
+  remove_durable(path);
+  Map::checkpoint_bytes = 4096;
+  std::map<int, int> stdmap;
+  {
+    Map srcmap(path);
+    for (int i = 0; i < 3000; i++) {
+      int key = ret[i] % 500;
+      if (i % 3 == 0) {
+        stdmap.insert(std::make_pair(key, i));
+        srcmap.insert(typename Map::value_type(key, i));
+      } else if (i % 3 == 1) {
+        stdmap[key] = i;
+        srcmap.assign(key, i);
+      } else if (stdmap.erase(key) != srcmap.erase(key)) {
+        return false;
+      }
+    }
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([&srcmap, t]() {
+        for (int i = 0; i < 200; i++) srcmap.assign(1000 + t * 200 + i, i);
+      });
+    }
+    for (std::thread &t : threads) t.join();
+    for (int i = 0; i < 800; i++) stdmap[1000 + i] = i % 200;
+  }
+  Map::checkpoint_bytes = 64 << 20;
+  {
+    Map reopened(path);
+    if (!equal_content(stdmap, reopened.snapshot())) return false;
+    reopened.checkpoint();
+    reopened.assign(-1, -1);
+    stdmap[-1] = -1;
+  }
+  // a checkpoint that cannot be written fails no write, and leaves no temporary
+  mkdir((path + ".checkpoint.tmp").c_str(), 0755);
+  Map::checkpoint_bytes = 0;
+  {
+    Map blocked(path);
+    bool inserted = blocked.insert(typename Map::value_type(-2, -2));
+    Map::checkpoint_bytes = 64 << 20;
+    if (!inserted || !blocked.checkpoint_failed()) return false;
+    if (std::remove((path + ".checkpoint.tmp").c_str()) == 0) return false;
+    stdmap[-2] = -2;
+  }
+  // a record torn by a crash is dropped, the ones before it kept
+  int last = 1000;
+  while (last > 0 && !std::ifstream(path + ".log." + std::to_string(last))) last--;
+  {
+    std::ofstream torn(path + ".log." + std::to_string(last), std::ios::binary | std::ios::app);
+    torn.write("torn", 4);
+  }
+  {
+    Map recovered(path);
+    if (!equal_content(stdmap, recovered.snapshot())) return false;
+    recovered.erase(-1);
+    stdmap.erase(-1);
+  }
+  Map recovered(path);
+  return equal_content(stdmap, recovered.snapshot());
+}
+
+void tester33() {
+  TestCore console("Durable map testing...", 33, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::durable_map<int, int> Grouped;
+  typedef sjtu::durable_map<int, int, std::less<int>, sjtu::avl_balance, true, false> Single;
+  const std::string path = "durable_map_test";
+  bool ok = false;
+  try{
+    ok = durable_map_works<Grouped>(ret, path) && durable_map_works<Single>(ret, path);
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    Grouped::checkpoint_bytes = Single::checkpoint_bytes = 64 << 20;
+    remove_durable(path);
+    return;
+  }
+  remove_durable(path);
+  if (!ok) {
+    console.fail();
+    return;
+  }
+  console.pass();
+}
+
+void tester34() {
+  TestCore console("Shared memory map testing...", 34, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::mapped_map<int, int> Mapped;
+  const char *name = "/sjtu_map_test";
+  try{
+    std::map<int, int> stdmap;
+    sjtu::map<int, int> srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      stdmap[ret[i]] = i;
+      srcmap[ret[i]] = i;
+    }
+    Mapped::publish(srcmap, name);
+    Mapped first = Mapped::attach(name);
+    Mapped second = Mapped::attach(name);
+    // the two mappings lie at different addresses and read the same
+    if (&*first.cbegin() == &*second.cbegin() || !equal_content(stdmap, first) || !equal_content(stdmap, second)) {
+      Mapped::unpublish(name);
+      console.fail();
+      return;
+    }
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+      bool ok = false;
+      try{
+        Mapped attached = Mapped::attach(name);
+        ok = equal_content(stdmap, attached) && attached.at(ret[0]) == stdmap[ret[0]];
+      } catch(...) {}
+      _exit(ok ? 0 : 1);
+    }
+    int status = 1;
+    if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      Mapped::unpublish(name);
+      console.fail();
+      return;
+    }
+    Mapped::unpublish(name);
+    int thrown = 0;
+    try{
+      Mapped::attach(name);
+    } catch(sjtu::runtime_error &) {
+      ++thrown;
+    }
+    if (thrown != 1 || !equal_content(stdmap, first)) {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    Mapped::unpublish(name);
+    return;
+  }
+  console.pass();
+}
+
+void tester35() {
+  TestCore console("Paged map testing...", 35, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::paged_map<int, int> Paged;
+  const char *path = "paged_map_test.bin";
+  std::remove(path);
+  try{
+    std::map<int, int> stdmap;
+    {
+      Paged srcmap(path, 16);
+      for (int i = 0; i < (int)ret.size(); i++) {
+        int key = ret[i] % 20000;
+        switch (i % 5) {
+          case 0:
+          case 1: {
+            auto result = srcmap.insert(Paged::value_type(key, i));
+            bool fresh = stdmap.insert(std::make_pair(key, i)).second;
+            if (result.second != fresh || result.first->first != key || result.first->second != stdmap[key]) {
+              std::remove(path);
+              console.fail();
+              return;
+            }
+            break;
+          }
+          case 2:
+            srcmap.assign(key, -i);
+            stdmap[key] = -i;
+            break;
+          default:
+            if (srcmap.erase(key) != stdmap.erase(key)) {
+              std::remove(path);
+              console.fail();
+              return;
+            }
+        }
+      }
+      if (!equal_content(stdmap, srcmap)) {
+        std::remove(path);
+        console.fail();
+        return;
+      }
+      for (int key = -5; key < 20005; key += 7) {
+        auto a = stdmap.lower_bound(key);
+        auto b = srcmap.lower_bound(key);
+        if ((a == stdmap.end()) != (b == srcmap.cend()) || (b != srcmap.cend() && a->first != b->first)
+            || stdmap.count(key) != srcmap.count(key)) {
+          std::remove(path);
+          console.fail();
+          return;
+        }
+      }
+      // erasing all but a few collapses the tree back
+      int left = 0;
+      for (auto it = stdmap.begin(); it != stdmap.end();) {
+        if (left++ % 100) {
+          srcmap.erase(srcmap.find(it->first));
+          it = stdmap.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      if (!equal_content(stdmap, srcmap) || srcmap.page_reads() == 0) {
+        std::remove(path);
+        console.fail();
+        return;
+      }
+    }
+    int thrown = 0;
+    {
+      Paged reopened(path, 64);
+      if (!equal_content(stdmap, reopened)) {
+        std::remove(path);
+        console.fail();
+        return;
+      }
+      try{
+        reopened.at(-1);
+      } catch(sjtu::index_out_of_bound &) {
+        ++thrown;
+      }
+      try{
+        reopened.erase(reopened.cend());
+      } catch(sjtu::invalid_iterator &) {
+        ++thrown;
+      }
+    }
+    try{
+      sjtu::paged_map<long long, int> wrong(path);
+    } catch(sjtu::runtime_error &) {
+      ++thrown;
+    }
+    if (thrown != 3) {
+      std::remove(path);
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    std::remove(path);
+    return;
+  }
+  std::remove(path);
+  console.pass();
+}
+
+void tester36() {
+  TestCore console("Non-throwing lookup testing...", 36, 0);
+  console.init();
+  auto ret = generator(MAXN);
+  typedef sjtu::map<int, int> Map;
+  try{
+    std::map<int, int> stdmap;
+    Map srcmap;
+    for (int i = 0; i < (int)ret.size(); i += 2) {
+      stdmap[ret[i]] = i;
+      srcmap[ret[i]] = i;
+    }
+    // a pending run of appends is looked into as well
+    srcmap.begin_bulk();
+    int top = stdmap.empty() ? 0 : stdmap.rbegin()->first;
+    for (int i = 1; i <= 100; i++) {
+      stdmap[top + i] = -i;
+      srcmap.insert(Map::value_type(top + i, -i));
+    }
+    const Map &constmap = srcmap;
+    for (int i = 0; i < (int)ret.size(); i++) {
+      int key = i % 7 ? ret[i] : top + i % 150;
+      auto it = stdmap.find(key);
+      bool present = it != stdmap.end();
+      const int *found = constmap.find_ptr(key);
+      int value = 12345;
+      bool got = constmap.try_at(key, value);
+      if (constmap.contains(key) != present || (found != nullptr) != present || got != present
+          || (present && (*found != it->second || value != it->second)) || (!present && value != 12345)) {
+        console.fail();
+        return;
+      }
+    }
+    srcmap.end_bulk();
+    for (int i = 0; i < (int)ret.size(); i += 3) {
+      if (int *found = srcmap.find_ptr(ret[i])) {
+        *found += 1;
+        stdmap[ret[i]] += 1;
+      } else if (stdmap.count(ret[i])) {
+        console.fail();
+        return;
+      }
+    }
+    if (!equal_content(stdmap, srcmap)) {
+      console.fail();
+      return;
+    }
+    // exceptions still say what they are
+    std::string what;
+    try{
+      constmap.at(top + 1000);
+    } catch (sjtu::exception &error) {
+      what = error.what();
+    }
+    sjtu::invalid_iterator copied(sjtu::invalid_iterator{});
+    if (what != "index_out_of_bound " || copied.what() != "invalid_iterator ") {
+      console.fail();
+      return;
+    }
+  } catch(...) {
+    console.showMessage("Unknown error occured.", Blue);
+    return;
+  }
+  console.pass();
+}
+
 int main() {
 #ifdef SPECIAL
   puts("AATree-Map Checker Version 1.2");
@@ -618,5 +2684,30 @@ int main() {
   tester9();
   tester10();
   tester11();
+  tester12();
+  tester13();
+  tester14();
+  tester15();
+  tester16();
+  tester17();
+  tester18();
+  tester19();
+  tester20();
+  tester21();
+  tester22();
+  tester23();
+  tester24();
+  tester25();
+  tester26();
+  tester27();
+  tester28();
+  tester29();
+  tester30();
+  tester31();
+  tester32();
+  tester33();
+  tester34();
+  tester35();
+  tester36();
   return 0;
 }
@@ -6,16 +6,322 @@
 
 // only for std::less<T>
 #include <functional>
+// only for sorting batches
+#include <algorithm>
 #include <cstddef>
+// only for the parallel copy and the parallel algorithms
+#include <thread>
+#include <exception>
+#include <atomic>
+#include <vector>
+#include <type_traits>
+// only for save and load
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <new>
+#include <ostream>
 #include "utility.hpp"
 #include "exceptions.hpp"
+#include "epoch.hpp"
 
 namespace sjtu {
 
+/**
+ * the balancing policies of sjtu::map.
+ *
+ * every node keeps a rank (an empty tree has rank 0, a new leaf rank 1)
+ *   and a policy bounds the rank difference between a node and its children.
+ * rotations, subtree sizes and threads are left to the map,
+ *   a policy only moves ranks and picks the rotations:
+ *   insert_fix(tree, t) runs after a subtree of t grew,
+ *   erase_fix(tree, t) after a subtree of t shrank;
+ *   two trees whose ranks differ by at most join_slack are joined under a new root,
+ *   build_rank(l, r) ranks a node of a perfectly balanced tree
+ *   from the ranks of its children.
+ */
+
+/**
+ * a child or root pointer of a map with SharedLinks.
+ * concurrent_map's optimistic readers walk the tree while the one writer
+ *   relinks it, so a link is loaded with acquire and stored with release:
+ *   a reader that reaches a node sees it fully built, and neither side
+ *   is a data race. other maps keep plain pointers.
+ */
+template<class Node>
+class node_link {
+  std::atomic<Node *> pointer;
+
+ public:
+  node_link(Node *p = nullptr) : pointer(p) {}
+
+  node_link(const node_link &other) : pointer(other) {}
+
+  node_link &operator=(const node_link &other) {
+    return *this = static_cast<Node *>(other);
+  }
+
+  node_link &operator=(Node *p) {
+    pointer.store(p, std::memory_order_release);
+    return *this;
+  }
+
+  operator Node *() const {
+    return pointer.load(std::memory_order_acquire);
+  }
+
+  Node *operator->() const {
+    return *this;
+  }
+};
+
+/**
+ * AVL: the rank is the height, and siblings differ by at most 1 in height.
+ * the shallowest trees, so the fastest lookups.
+ */
+struct avl_balance {
+  static const int join_slack = 1;
+
+  static int build_rank(int l, int r) {
+    if (l > r) { return l + 1; }
+    return r + 1;
+  }
+
+  template<class Tree, class Link>
+  static void fix_height(Tree &tree, const Link &t) {
+    t->rank = build_rank(tree.rank(t->left), tree.rank(t->right));
+  }
+
+  template<class Tree>
+  static void rebalance(Tree &tree, typename Tree::link_type &t) {
+    int diff = tree.rank(t->left) - tree.rank(t->right);
+    if (diff == 2) {
+      if (tree.rank(t->left->right) > tree.rank(t->left->left)) { tree.LR(t); }
+      else { tree.LL(t); }
+    } else if (diff == -2) {
+      if (tree.rank(t->right->left) > tree.rank(t->right->right)) { tree.RL(t); }
+      else { tree.RR(t); }
+    }
+    if (diff == 2 || diff == -2) {
+      fix_height(tree, t->left);
+      fix_height(tree, t->right);
+    }
+    fix_height(tree, t);
+  }
+
+  template<class Tree>
+  static void insert_fix(Tree &tree, typename Tree::link_type &t) {
+    rebalance(tree, t);
+  }
+
+  template<class Tree>
+  static void erase_fix(Tree &tree, typename Tree::link_type &t) {
+    rebalance(tree, t);
+  }
+};
+
+/**
+ * weak AVL: rank differences are 1 or 2, and leaves have rank 1.
+ * insertions alone build exactly the AVL trees,
+ *   but an erase never rotates more than twice.
+ */
+struct wavl_balance {
+  static const int join_slack = 1;
+
+  static int build_rank(int l, int r) {
+    return avl_balance::build_rank(l, r);
+  }
+
+  /**
+   * a child of t may have reached the rank of t.
+   */
+  template<class Tree>
+  static void insert_fix(Tree &tree, typename Tree::link_type &t) {
+    typedef typename Tree::node Node;
+    int r = t->rank;
+    bool left;
+    if (tree.rank(t->left) == r) { left = true; }
+    else if (tree.rank(t->right) == r) { left = false; }
+    else { return; }
+    Node *x = left ? t->left : t->right;
+    Node *y = left ? t->right : t->left;
+    if (r - tree.rank(y) == 1) {
+      ++t->rank;
+      return;
+    }
+    Node *outer = left ? x->left : x->right;
+    Node *inner = left ? x->right : x->left;
+    if (r - tree.rank(inner) == 1 && r - tree.rank(outer) == 2) {
+      inner->rank = r;
+      x->rank = r - 1;
+      t->rank = r - 1;
+      if (left) { tree.LR(t); }
+      else { tree.RL(t); }
+      return;
+    }
+    // both children of x are 1-children only when a join put x there
+    if (r - tree.rank(inner) == 2) { t->rank = r - 1; }
+    else { x->rank = r + 1; }
+    if (left) { tree.LL(t); }
+    else { tree.RR(t); }
+  }
+
+  /**
+   * a child of t may have fallen 3 ranks below it, or t may be a leaf of rank 2.
+   */
+  template<class Tree>
+  static void erase_fix(Tree &tree, typename Tree::link_type &t) {
+    typedef typename Tree::node Node;
+    int r = t->rank;
+    if (!t->left && !t->right) {
+      t->rank = 1;
+      return;
+    }
+    bool left;
+    if (r - tree.rank(t->left) == 3) { left = true; }
+    else if (r - tree.rank(t->right) == 3) { left = false; }
+    else { return; }
+    Node *y = left ? t->right : t->left;
+    int s = y->rank;
+    if (r - s == 2) {
+      t->rank = r - 1;
+      return;
+    }
+    Node *outer = left ? y->right : y->left;
+    Node *inner = left ? y->left : y->right;
+    if (s - tree.rank(outer) == 1) {
+      y->rank = r;
+      t->rank = r - 1;
+      if (left) { tree.RR(t); }
+      else { tree.LL(t); }
+      Node *down = left ? t->left : t->right;
+      if (!down->left && !down->right) { down->rank = 1; }
+    } else if (s - tree.rank(inner) == 1) {
+      inner->rank = r;
+      y->rank = s - 1;
+      t->rank = r - 2;
+      if (left) { tree.RL(t); }
+      else { tree.LR(t); }
+    } else {
+      y->rank = s - 1;
+      t->rank = r - 1;
+    }
+  }
+};
+
+/**
+ * red-black: rank differences are 0 or 1, and a 0-child has no 0-children;
+ *   a 0-child is a red node and the rank counts the black nodes below.
+ * the loosest balance: the fewest rotations, but the deepest trees.
+ */
+struct red_black_balance {
+  static const int join_slack = 0;
+
+  static int build_rank(int l, int r) {
+    if (l < r) { return l + 1; }
+    return r + 1;
+  }
+
+  /**
+   * a 0-child of t may have got a 0-child.
+   */
+  template<class Tree>
+  static void insert_fix(Tree &tree, typename Tree::link_type &t) {
+    typedef typename Tree::node Node;
+    int r = t->rank;
+    bool left;
+    if (tree.rank(t->left) == r
+        && (tree.rank(t->left->left) == r || tree.rank(t->left->right) == r)) {
+      left = true;
+    } else if (tree.rank(t->right) == r
+               && (tree.rank(t->right->left) == r || tree.rank(t->right->right) == r)) {
+      left = false;
+    } else {
+      return;
+    }
+    Node *x = left ? t->left : t->right;
+    if (tree.rank(left ? t->right : t->left) == r) {
+      ++t->rank;
+      return;
+    }
+    if (tree.rank(left ? x->left : x->right) == r) {
+      if (left) { tree.LL(t); }
+      else { tree.RR(t); }
+    } else {
+      if (left) { tree.LR(t); }
+      else { tree.RL(t); }
+    }
+  }
+
+  /**
+   * a child of t may have fallen 2 ranks below it.
+   */
+  template<class Tree>
+  static void erase_fix(Tree &tree, typename Tree::link_type &t) {
+    typedef typename Tree::node Node;
+    int r = t->rank;
+    bool left;
+    if (r - tree.rank(t->left) == 2) { left = true; }
+    else if (r - tree.rank(t->right) == 2) { left = false; }
+    else { return; }
+    Node *y = left ? t->right : t->left;
+    if (y->rank == r) {
+      // a red sibling: rotate it up, then t has a black one
+      if (left) { tree.RR(t); }
+      else { tree.LL(t); }
+      erase_fix(tree, left ? t->left : t->right);
+      return;
+    }
+    Node *outer = left ? y->right : y->left;
+    Node *inner = left ? y->left : y->right;
+    if (tree.rank(outer) == y->rank) {
+      y->rank = r;
+      t->rank = r - 1;
+      if (left) { tree.RR(t); }
+      else { tree.LL(t); }
+    } else if (tree.rank(inner) == y->rank) {
+      inner->rank = r;
+      t->rank = r - 1;
+      if (left) { tree.RL(t); }
+      else { tree.LR(t); }
+    } else {
+      t->rank = r - 1;
+    }
+  }
+};
+
+/**
+ * what an iterator keeps besides its node.
+ * a checked iterator knows its map, to throw invalid_iterator
+ *   when it would step off either end or is handed to another map.
+ * an unchecked one is a bare node pointer:
+ *   stepping is a single load, and misuse is undefined behaviour.
+ */
+template<class Map, bool Checked>
+class iterator_owner {
+ protected:
+  Map *p_map;
+
+  iterator_owner(Map *p) : p_map(p) {}
+};
+
+template<class Map>
+class iterator_owner<Map, false> {
+ protected:
+  static constexpr Map *p_map = nullptr;
+
+  iterator_owner(Map *) {}
+};
+
 template<
         class Key,
         class T,
-        class Compare = std::less<Key>
+        class Compare = std::less<Key>,
+        class Balance = avl_balance,
+        bool Checked = true,
+        bool SharedLinks = false
 >
 class map {
  public:
@@ -26,6 +332,12 @@ class map {
    */
   typedef pair<const Key, T> value_type;
 
+  class node;
+  /**
+   * a child or root pointer: a plain one unless SharedLinks, see node_link.
+   */
+  typedef typename std::conditional<SharedLinks, node_link<node>, node *>::type link_type;
+
   /**
    * see BidirectionalIterator at CppReference for help.
    *
@@ -34,54 +346,49 @@ class map {
    *       or it = map.end(); ++end();
    */
   class node {
-    friend map<Key, T, Compare>;
+    friend map<Key, T, Compare, Balance, Checked, SharedLinks>;
+    friend Balance;
    private:
     value_type data;
-    node *left;
-    node *right;
-    int height;
+    link_type left;
+    link_type right;
+    int rank;
+    int size;
     node *next;
     node *previous;
 
    public:
     node(const value_type &Data, int h = 1,
          node *l = nullptr,
-         node *r = nullptr) : data(Data), height(h), left(l), right(r) {};
+         node *r = nullptr) : data(Data), rank(h), size(1), left(l), right(r) {};
 
     ~node() {};
   };
 
   class const_iterator;
 
-  class iterator {
-    friend map<Key, T, Compare>;
+  class iterator : iterator_owner<map, Checked> {
+    friend map<Key, T, Compare, Balance, Checked, SharedLinks>;
     friend const_iterator;
    private:
     /**
      * TODO add data members
      *   just add whatever you want.
      */
+    using iterator_owner<map, Checked>::p_map;
     node *pointer;
-    map<Key, T, Compare> *p_map;
 
    public:
-    iterator(node *p1 = nullptr, map<Key, T, Compare> *p2 = nullptr) {
-      // TODO
-      pointer = p1;
-      p_map = p2;
-    }
+    iterator(node *p1 = nullptr, map<Key, T, Compare, Balance, Checked, SharedLinks> *p2 = nullptr)
+            : iterator_owner<map, Checked>(p2), pointer(p1) {}
 
-    iterator(const iterator &other) {
-      // TODO
-      pointer = other.pointer;
-      p_map = other.p_map;
-    }
+    iterator(const iterator &other) = default;
 
     /**
      * TODO iter++
      */
     iterator operator++(int) {
-      if (!pointer || !pointer->next || pointer == p_map->tail) {
+      if (Checked && (!pointer || !pointer->next || pointer == p_map->tail)) {
         invalid_iterator invalid_iterator;
         throw invalid_iterator;
       }
@@ -94,7 +401,7 @@ class map {
      * TODO ++iter
      */
     iterator &operator++() {
-      if (!pointer || !pointer->next || pointer == p_map->tail) {
+      if (Checked && (!pointer || !pointer->next || pointer == p_map->tail)) {
         invalid_iterator invalid_iterator;
         throw invalid_iterator;
       }
@@ -106,10 +413,10 @@ class map {
      * TODO iter--
      */
     iterator operator--(int) {
-      if (!pointer || !pointer->previous
+      if (Checked && (!pointer || !pointer->previous
           || pointer == p_map->head
           || pointer == p_map->head->next
-          || pointer == p_map->tail) {
+          || pointer == p_map->tail)) {
         invalid_iterator invalid_iterator;
         throw invalid_iterator;
       }
@@ -122,9 +429,9 @@ class map {
      * TODO --iter
      */
     iterator &operator--() {
-      if (!pointer || !pointer->previous
+      if (Checked && (!pointer || !pointer->previous
           || pointer == p_map->head
-          || pointer == p_map->head->next) {
+          || pointer == p_map->head->next)) {
         invalid_iterator invalid_iterator;
         throw invalid_iterator;
       }
@@ -167,33 +474,24 @@ class map {
     }
   };
 
-  class const_iterator {
+  class const_iterator : iterator_owner<const map, Checked> {
     // it should have similar member method as iterator.
     //  and it should be able to construct from an iterator.
    private:
     // data members.
+    using iterator_owner<const map, Checked>::p_map;
     const node *pointer;
-    const map<Key, T, Compare> *p_map;
+    friend map<Key, T, Compare, Balance, Checked, SharedLinks>;
     friend iterator;
 
    public:
-    const_iterator(const node *p1 = nullptr, const map<Key, T, Compare> *p2 = nullptr) {
-      // TODO
-      pointer = p1;
-      p_map = p2;
-    }
+    const_iterator(const node *p1 = nullptr, const map<Key, T, Compare, Balance, Checked, SharedLinks> *p2 = nullptr)
+            : iterator_owner<const map, Checked>(p2), pointer(p1) {}
 
-    const_iterator(const const_iterator &other) {
-      // TODO
-      pointer = other.pointer;
-      p_map = other.p_map;
-    }
+    const_iterator(const const_iterator &other) = default;
 
-    const_iterator(const iterator &other) {
-      // TODO
-      pointer = other.pointer;
-      p_map = other.p_map;
-    }
+    const_iterator(const iterator &other)
+            : iterator_owner<const map, Checked>(other.p_map), pointer(other.pointer) {}
 
     // And other methods in iterator.
     // And other methods in iterator.
@@ -202,7 +500,7 @@ class map {
      * TODO iter++
      */
     const_iterator operator++(int) {
-      if (!pointer || !pointer->next || pointer == p_map->tail) {
+      if (Checked && (!pointer || !pointer->next || pointer == p_map->tail)) {
         invalid_iterator invalid_iterator;
         throw invalid_iterator;
       }
@@ -215,7 +513,7 @@ class map {
      * TODO ++iter
      */
     const_iterator &operator++() {
-      if (!pointer || !pointer->next || pointer == p_map->tail) {
+      if (Checked && (!pointer || !pointer->next || pointer == p_map->tail)) {
         invalid_iterator invalid_iterator;
         throw invalid_iterator;
       }
@@ -227,10 +525,10 @@ class map {
      * TODO iter--
      */
     const_iterator operator--(int) {
-      if (!pointer || !pointer->previous
+      if (Checked && (!pointer || !pointer->previous
           || pointer == p_map->head
           || pointer == p_map->head->next
-          || pointer == p_map->tail) {
+          || pointer == p_map->tail)) {
         invalid_iterator invalid_iterator;
         throw invalid_iterator;
       }
@@ -243,9 +541,9 @@ class map {
      * TODO --iter
      */
     const_iterator &operator--() {
-      if (!pointer || !pointer->previous
+      if (Checked && (!pointer || !pointer->previous
           || pointer == p_map->head
-          || pointer == p_map->head->next) {
+          || pointer == p_map->head->next)) {
         invalid_iterator invalid_iterator;
         throw invalid_iterator;
       }
@@ -288,15 +586,202 @@ class map {
     }
   };
 
+  class const_reverse_iterator;
+
+  /**
+   * walks the map from the largest key down along the previous threads.
+   * it points at its element itself, rend() is the node before the smallest,
+   *   so moving past either end throws invalid_iterator like iterator does.
+   */
+  class reverse_iterator : iterator_owner<map, Checked> {
+    friend map<Key, T, Compare, Balance, Checked, SharedLinks>;
+    friend const_reverse_iterator;
+   private:
+    using iterator_owner<map, Checked>::p_map;
+    node *pointer;
+
+   public:
+    reverse_iterator(node *p1 = nullptr, map<Key, T, Compare, Balance, Checked, SharedLinks> *p2 = nullptr)
+            : iterator_owner<map, Checked>(p2), pointer(p1) {}
+
+    reverse_iterator(const reverse_iterator &other) = default;
+
+    reverse_iterator operator++(int) {
+      if (Checked && (!pointer || !pointer->previous)) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      reverse_iterator it(pointer, p_map);
+      pointer = pointer->previous;
+      return it;
+    }
+
+    reverse_iterator &operator++() {
+      if (Checked && (!pointer || !pointer->previous)) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      pointer = pointer->previous;
+      return *this;
+    }
+
+    reverse_iterator operator--(int) {
+      if (Checked && (!pointer || !pointer->next || pointer->next == p_map->tail)) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      reverse_iterator it(pointer, p_map);
+      pointer = pointer->next;
+      return it;
+    }
+
+    reverse_iterator &operator--() {
+      if (Checked && (!pointer || !pointer->next || pointer->next == p_map->tail)) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      pointer = pointer->next;
+      return *this;
+    }
+
+    /**
+     * the iterator to the element after this one in key order,
+     *   as with std::reverse_iterator.
+     */
+    iterator base() const {
+      return iterator(pointer->next, p_map);
+    }
+
+    value_type &operator*() const {
+      return pointer->data;
+    }
+
+    bool operator==(const reverse_iterator &rhs) const {
+      return pointer == rhs.pointer;
+    }
+
+    bool operator==(const const_reverse_iterator &rhs) const {
+      return pointer == rhs.pointer;
+    }
+
+    bool operator!=(const reverse_iterator &rhs) const {
+      return pointer != rhs.pointer;
+    }
+
+    bool operator!=(const const_reverse_iterator &rhs) const {
+      return pointer != rhs.pointer;
+    }
+
+    value_type *operator->() const noexcept {
+      return &(pointer->data);
+    }
+  };
+
+  class const_reverse_iterator : iterator_owner<const map, Checked> {
+    friend map<Key, T, Compare, Balance, Checked, SharedLinks>;
+    friend reverse_iterator;
+   private:
+    using iterator_owner<const map, Checked>::p_map;
+    const node *pointer;
+
+   public:
+    const_reverse_iterator(const node *p1 = nullptr, const map<Key, T, Compare, Balance, Checked, SharedLinks> *p2 = nullptr)
+            : iterator_owner<const map, Checked>(p2), pointer(p1) {}
+
+    const_reverse_iterator(const const_reverse_iterator &other) = default;
+
+    const_reverse_iterator(const reverse_iterator &other)
+            : iterator_owner<const map, Checked>(other.p_map), pointer(other.pointer) {}
+
+    const_reverse_iterator operator++(int) {
+      if (Checked && (!pointer || !pointer->previous)) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      const_reverse_iterator it(pointer, p_map);
+      pointer = pointer->previous;
+      return it;
+    }
+
+    const_reverse_iterator &operator++() {
+      if (Checked && (!pointer || !pointer->previous)) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      pointer = pointer->previous;
+      return *this;
+    }
+
+    const_reverse_iterator operator--(int) {
+      if (Checked && (!pointer || !pointer->next || pointer->next == p_map->tail)) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      const_reverse_iterator it(pointer, p_map);
+      pointer = pointer->next;
+      return it;
+    }
+
+    const_reverse_iterator &operator--() {
+      if (Checked && (!pointer || !pointer->next || pointer->next == p_map->tail)) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      pointer = pointer->next;
+      return *this;
+    }
+
+    const_iterator base() const {
+      return const_iterator(pointer->next, p_map);
+    }
+
+    const value_type &operator*() const {
+      return pointer->data;
+    }
+
+    bool operator==(const reverse_iterator &rhs) const {
+      return pointer == rhs.pointer;
+    }
+
+    bool operator==(const const_reverse_iterator &rhs) const {
+      return pointer == rhs.pointer;
+    }
+
+    bool operator!=(const reverse_iterator &rhs) const {
+      return pointer != rhs.pointer;
+    }
+
+    bool operator!=(const const_reverse_iterator &rhs) const {
+      return pointer != rhs.pointer;
+    }
+
+    const value_type *operator->() const noexcept {
+      return &(pointer->data);
+    }
+  };
+
  private:
-  node *root;
+  link_type root;
   node *head;
   node *tail;
   int number;
+  size_t rotations = 0;
+  /**
+   * in bulk mode, inserts past the largest key are threaded after it
+   *   without entering the tree: the last pending nodes of the list,
+   *   starting at run. whatever needs the tree indexes them first.
+   */
+  bool bulk = false;
+  node *run = nullptr;
+  int pending = 0;
+  /**
+   * while set, erased nodes are retired to epochs, see reclaim_through.
+   */
+  epoch_domain *epochs = nullptr;
 
  public:
-  int height(node *p) {
-    if (p) { return p->height; }
+  int rank(const node *p) {
+    if (p) { return p->rank; }
     return 0;
   }
 
@@ -305,6 +790,19 @@ class map {
     return b;
   }
 
+  static int size(const node *p) {
+    if (p) { return p->size; }
+    return 0;
+  }
+
+  /**
+   * recompute the subtree size of p from its children,
+   *   ranks are the balancing policy's business.
+   */
+  void update(node *p) {
+    p->size = size(p->left) + size(p->right) + 1;
+  }
+
   /**
    * TODO two constructors
    */
@@ -319,27 +817,28 @@ class map {
     tail->next = nullptr;
   }
 
-  void copy(node *&p, const node *other) {
-    if (!other->left && !other->right) { return; }
-    if (other->left) {
-      p->left = new node(other->left->data, other->left->height);
-      p->previous->next = p->left;
-      p->left->previous = p->previous;
-      p->left->next = p;
-      p->previous = p->left;
-      copy(p->left, other->left);
-    }
-    if (other->right) {
-      p->right = new node(other->right->data, other->right->height);
-      p->next->previous = p->right;
-      p->right->previous = p;
-      p->right->next = p->next;
-      p->next = p->right;
-      copy(p->right, other->right);
+  map(const map &other) : root(nullptr), number(0) {
+    void *p = operator new(sizeof(node));
+    head = static_cast<node *>(p);
+    p = operator new(sizeof(node));
+    tail = static_cast<node *>(p);
+    head->previous = nullptr;
+    head->next = tail;
+    tail->previous = head;
+    tail->next = nullptr;
+    try {
+      attach(clone(other));
+    } catch (...) {
+      operator delete(head);
+      operator delete(tail);
+      throw;
     }
   }
 
-  map(const map &other) : root(nullptr) {
+  /**
+   * take over all the nodes of other in O(1), leaving other empty.
+   */
+  map(map &&other) : root(nullptr), number(0) {
     void *p = operator new(sizeof(node));
     head = static_cast<node *>(p);
     p = operator new(sizeof(node));
@@ -348,15 +847,7 @@ class map {
     head->next = tail;
     tail->previous = head;
     tail->next = nullptr;
-    number = other.number;
-    if (number) {
-      root = new node(other.root->data, other.root->height);
-      root->previous = head;
-      root->next = tail;
-      head->next = root;
-      tail->previous = root;
-      copy(root, other.root);
-    }
+    attach(other.release());
   }
 
   /**
@@ -364,6 +855,16 @@ class map {
    */
   map &operator=(const map &other) {
     if (this == &other) { return *this; }
+    segment s = clone(other);
+    clear();
+    attach(s);
+    return *this;
+  }
+
+  /**
+   * TODO Destructors
+   */
+  ~map() {
     if (number) {
       node *p1 = head->next;
       node *p2;
@@ -373,38 +874,45 @@ class map {
         p1 = p2;
       }
     }
-    root = nullptr;
-    head->previous = nullptr;
-    head->next = tail;
-    tail->previous = head;
-    tail->next = nullptr;
-    number = other.number;
-    if (number) {
-      root = new node(other.root->data, other.root->height);
-      root->previous = head;
-      root->next = tail;
-      head->next = root;
-      tail->previous = root;
-      copy(root, other.root);
+    operator delete(head);
+    operator delete(tail);
+  }
+
+  /**
+   * for a map read by threads that do not lock it (see concurrent_map):
+   *   from now on erased nodes are retired to domain, and stay allocated,
+   *   unchanged but for their threads, until no reader pinned in domain
+   *   can still be looking at them.
+   */
+  void reclaim_through(epoch_domain &domain) {
+    epochs = &domain;
+  }
+
+  static void free_node(void *p) {
+    delete static_cast<node *>(p);
+  }
+
+  /**
+   * free a list of nodes chained through next.
+   */
+  static void free_nodes(void *p) {
+    node *p1 = static_cast<node *>(p);
+    while (p1) {
+      node *p2 = p1->next;
+      delete p1;
+      p1 = p2;
     }
-    return *this;
   }
 
   /**
-   * TODO Destructors
+   * free an erased node, or retire it if readers may still see it.
    */
-  ~map() {
-    if (number) {
-      node *p1 = head->next;
-      node *p2;
-      for (int i = 1; i <= number; ++i) {
-        p2 = p1->next;
-        delete p1;
-        p1 = p2;
-      }
+  void dispose(node *p) {
+    if (epochs) {
+      epochs->retire(p, free_node);
+    } else {
+      delete p;
     }
-    operator delete(head);
-    operator delete(tail);
   }
 
   /**
@@ -414,6 +922,7 @@ class map {
    * If no such element exists, an exception of type `index_out_of_bound'
    */
   T &at(const Key &key) {
+    absorb();
     node *p = root;
     Compare compare;
     while (p) {
@@ -433,6 +942,7 @@ class map {
       else if (compare(key, p->data.first)) { p = p->left; }
       else { return p->data.second; }
     }
+    if (node *q = find_pending(key)) { return q->data.second; }
     index_out_of_bound index_out_of_bound;
     throw index_out_of_bound;
   }
@@ -444,6 +954,7 @@ class map {
    *   performing an insertion if such key does not already exist.
    */
   T &operator[](const Key &key) {
+    absorb();
     node *p = root;
     Compare compare;
     while (p) {
@@ -466,6 +977,7 @@ class map {
       else if (compare(key, p->data.first)) { p = p->left; }
       else { return p->data.second; }
     }
+    if (node *q = find_pending(key)) { return q->data.second; }
     index_out_of_bound index_out_of_bound;
     throw index_out_of_bound;
   }
@@ -497,6 +1009,29 @@ class map {
     return it;
   }
 
+  /**
+   * the largest element, and the one before the smallest, for walking down.
+   */
+  reverse_iterator rbegin() {
+    reverse_iterator it(tail->previous, this);
+    return it;
+  }
+
+  const_reverse_iterator crbegin() const {
+    const_reverse_iterator it(tail->previous, this);
+    return it;
+  }
+
+  reverse_iterator rend() {
+    reverse_iterator it(head, this);
+    return it;
+  }
+
+  const_reverse_iterator crend() const {
+    const_reverse_iterator it(head, this);
+    return it;
+  }
+
   /**
    * checks whether the container is empty
    * return true if empty, otherwise false.
@@ -512,11 +1047,21 @@ class map {
     return number;
   }
 
+  /**
+   * the rotations done so far, to compare the balancing policies.
+   */
+  size_t rotation_count() const {
+    return rotations;
+  }
+
   /**
    * clears the contents
    */
   void clear() {
-    if (number) {
+    if (number && epochs) {
+      tail->previous->next = nullptr;
+      epochs->retire(head->next, free_nodes);
+    } else if (number) {
       node *p1 = head->next;
       node *p2;
       for (int i = 1; i <= number; ++i) {
@@ -526,6 +1071,7 @@ class map {
       }
     }
     root = nullptr;
+    pending = 0;
     head->previous = nullptr;
     head->next = tail;
     tail->previous = head;
@@ -539,35 +1085,56 @@ class map {
    *   the iterator to the new element (or the element that prevented the insertion),
    *   the second one is true if insert successfully, or false.
    */
-  void LL(node *&t) {
+  void LL(link_type &t) {
     node *tmp = t->left;
     t->left = tmp->right;
     tmp->right = t;
-    t->height = max(height(t->left), height(t->right)) + 1;
-    tmp->height = max(height(tmp->left), height(t)) + 1;
+    tmp->size = t->size;
+    update(t);
     t = tmp;
+    ++rotations;
   }
 
-  void RR(node *&t) {
+  void RR(link_type &t) {
     node *tmp = t->right;
     t->right = tmp->left;
     tmp->left = t;
-    t->height = max(height(t->right), height(t->left)) + 1;
-    tmp->height = max(height(t->right), height(t)) + 1;
+    tmp->size = t->size;
+    update(t);
     t = tmp;
+    ++rotations;
   }
 
-  void LR(node *&t) {
+  void LR(link_type &t) {
     RR(t->left);
     LL(t);
   }
 
-  void RL(node *&t) {
+  void RL(link_type &t) {
     LL(t->right);
     RR(t);
   }
 
-  pair<iterator, bool> insert_l(const value_type &value, node *&t, node *parent) {
+  /**
+   * a subtree of t got one more node.
+   */
+  void grown(link_type &t) {
+    ++t->size;
+    Balance::insert_fix(*this, t);
+  }
+
+  /**
+   * a subtree of t lost a node (its size is already updated).
+   * return true if the rank of t stays the same,
+   *   so nothing above needs fixing.
+   */
+  bool shrunk(link_type &t) {
+    int old = t->rank;
+    Balance::erase_fix(*this, t);
+    return t->rank == old;
+  }
+
+  pair<iterator, bool> insert_l(const value_type &value, link_type &t, node *parent) {
     if (t == nullptr) {
       t = new node(value, 1);
       t->next = parent;
@@ -575,7 +1142,7 @@ class map {
       t->previous->next = t;
       parent->previous = t;
       ++number;
-      t->height = max(height(t->left), height(t->right)) + 1;
+      update(t);
       iterator it(t, this);
       pair<iterator, bool> result(it, true);
       return result;
@@ -583,19 +1150,11 @@ class map {
       Compare compare;
       if (compare(t->data.first, value.first)) {
         pair<iterator, bool> result = insert_r(value, t->right, t);
-        if (height(t->right) - height(t->left) == 2) {
-          if (compare(value.first, t->right->data.first)) { RL(t); }
-          else { RR(t); }
-        }
-        t->height = max(height(t->left), height(t->right)) + 1;
+        if (result.second) { grown(t); }
         return result;
       } else if (compare(value.first, t->data.first)) {
         pair<iterator, bool> result = insert_l(value, t->left, t);
-        if (height(t->left) - height(t->right) == 2) {
-          if (compare(value.first, t->left->data.first)) { LL(t); }
-          else { LR(t); }
-        }
-        t->height = max(height(t->left), height(t->right)) + 1;
+        if (result.second) { grown(t); }
         return result;
       } else {
         iterator it(t, this);
@@ -605,7 +1164,7 @@ class map {
     }
   }
 
-  pair<iterator, bool> insert_r(const value_type &value, node *&t, node *parent) {
+  pair<iterator, bool> insert_r(const value_type &value, link_type &t, node *parent) {
     if (t == nullptr) {
       t = new node(value, 1);
       t->next = parent->next;
@@ -613,7 +1172,7 @@ class map {
       t->next->previous = t;
       parent->next = t;
       ++number;
-      t->height = max(height(t->left), height(t->right)) + 1;
+      update(t);
       iterator it(t, this);
       pair<iterator, bool> result(it, true);
       return result;
@@ -621,19 +1180,11 @@ class map {
       Compare compare;
       if (compare(t->data.first, value.first)) {
         pair<iterator, bool> result = insert_r(value, t->right, t);
-        if (height(t->right) - height(t->left) == 2) {
-          if (compare(value.first, t->right->data.first)) { RL(t); }
-          else { RR(t); }
-        }
-        t->height = max(height(t->left), height(t->right)) + 1;
+        if (result.second) { grown(t); }
         return result;
       } else if (compare(value.first, t->data.first)) {
         pair<iterator, bool> result = insert_l(value, t->left, t);
-        if (height(t->left) - height(t->right) == 2) {
-          if (compare(value.first, t->left->data.first)) { LL(t); }
-          else { LR(t); }
-        }
-        t->height = max(height(t->left), height(t->right)) + 1;
+        if (result.second) { grown(t); }
         return result;
       } else {
         iterator it(t, this);
@@ -644,23 +1195,30 @@ class map {
   }
 
   pair<iterator, bool> insert(const value_type &value) {
+    if (bulk && number) {
+      Compare compare;
+      if (compare(tail->previous->data.first, value.first)) {
+        node *t = new node(value, 1);
+        t->previous = tail->previous;
+        t->next = tail;
+        tail->previous->next = t;
+        tail->previous = t;
+        if (!pending) { run = t; }
+        ++pending;
+        ++number;
+        return pair<iterator, bool>(iterator(t, this), true);
+      }
+      absorb();
+    }
     if (number) {
       Compare compare;
       if (compare(root->data.first, value.first)) {
         pair<iterator, bool> result = insert_r(value, root->right, root);
-        if (height(root->right) - height(root->left) == 2) {
-          if (compare(value.first, root->right->data.first)) { RL(root); }
-          else { RR(root); }
-        }
-        root->height = max(height(root->left), height(root->right)) + 1;
+        if (result.second) { grown(root); }
         return result;
       } else if (compare(value.first, root->data.first)) {
         pair<iterator, bool> result = insert_l(value, root->left, root);
-        if (height(root->left) - height(root->right) == 2) {
-          if (compare(value.first, root->left->data.first)) { LL(root); }
-          else { LR(root); }
-        }
-        root->height = max(height(root->left), height(root->right)) + 1;
+        if (result.second) { grown(root); }
         return result;
       } else {
         iterator it(root, this);
@@ -685,45 +1243,17 @@ class map {
    *
    * throw if pos pointed to a bad element (pos == this->end() || pos points an element out of this)
    */
-  bool adjust(node *&t, int type) {
-    if (type) {
-      if (height(t->left) - height(t->right) == 1) { return true; }
-      if (height(t->left) - height(t->right) == 0) {
-        --t->height;
-        return false;
-      }
-      if (height(t->left->right) > height(t->left->left)) {
-        LR(t);
-        return false;
-      }
-      LL(t);
-      if (height(t->left) - height(t->right) == 0) { return false; }
-      else { return true; }
-    } else {
-      if (height(t->right) - height(t->left) == 1) { return true; }
-      if (height(t->right) - height(t->left) == 0) {
-        --t->height;
-        return false;
-      }
-      if (height(t->right->left) > height(t->right->right)) {
-        RL(t);
-        return false;
-      }
-      RR(t);
-      if (height(t->right) - height(t->left) == 0) { return false; }
-      else { return true; }
-    }
-  }
-
-  bool erase(const Key &key, node *&t) {
+  bool erase(const Key &key, link_type &t) {
     if (!t) { return true; }
     Compare compare;
     if (compare(key, t->data.first)) {
+      --t->size;
       if (erase(key, t->left)) { return true; }
-      return adjust(t, 0);
+      return shrunk(t);
     } else if (compare(t->data.first, key)) {
+      --t->size;
       if (erase(key, t->right)) { return true; }
-      return adjust(t, 1);
+      return shrunk(t);
     } else {
       if (!t->left || !t->right) {
         node *tmp = t;
@@ -733,7 +1263,7 @@ class map {
         tmp->right = nullptr;
         tmp->previous->next = tmp->next;
         tmp->next->previous = tmp->previous;
-        delete tmp;
+        dispose(tmp);
         return false;
       } else {
         node *tmp1 = t->right;
@@ -744,20 +1274,21 @@ class map {
             tmp2 = tmp1;
             tmp1 = tmp1->left;
           }
-          tmp2->left = new node(tmp1->data, tmp1->height, tmp1->left, tmp1->right);
+          tmp2->left = new node(tmp1->data, tmp1->rank, tmp1->left, tmp1->right);
           tmp1->next->previous = tmp2->left;
           tmp1->previous->next = tmp2->left;
           tmp2->left->previous = tmp1->previous;
           tmp2->left->next = tmp1->next;
         } else {
-          tmp2->right = new node(tmp1->data, tmp1->height, tmp1->left, tmp1->right);
+          tmp2->right = new node(tmp1->data, tmp1->rank, tmp1->left, tmp1->right);
           tmp1->next->previous = tmp2->right;
           tmp1->previous->next = tmp2->right;
           tmp2->right->previous = tmp1->previous;
           tmp2->right->next = tmp1->next;
         }
         t = tmp1;
-        t->height = tmp3->height;
+        t->rank = tmp3->rank;
+        t->size = tmp3->size - 1;
         t->left = tmp3->left;
         t->right = tmp3->right;
         tmp3->previous->next = t;
@@ -766,26 +1297,70 @@ class map {
         t->previous = tmp3->previous;
         tmp3->left = nullptr;
         tmp3->right = nullptr;
-        delete tmp3;
+        dispose(tmp3);
         if (erase(tmp1->data.first, t->right)) { return true; }
-        return adjust(t, 1);
+        return shrunk(t);
       }
     }
   }
 
   void erase(iterator pos) {
-    if (pos == end() || pos.p_map != this) {
+    if (pos == end() || (Checked && pos.p_map != this)) {
       invalid_iterator invalid_iterator;
       throw invalid_iterator;
     } else if (number == 0) {
       container_is_empty container_is_empty;
       throw container_is_empty;
     } else {
+      absorb();
       --number;
       erase(pos->first, root);
     }
   }
 
+  /**
+   * start a batch of ordered appends: until end_bulk(), inserting a key
+   *   larger than every key in the map takes O(1) and leaves the tree alone.
+   * such runs of appends are built into a balanced subtree in O(k) and joined
+   *   to the tree in O(log n) by the next operation that searches the tree,
+   *   so batches in key order (say, a nightly reload) cost O(n) in all.
+   * only appends are deferred: any other insert, and every erase, first
+   *   joins the pending run and then rebalances as usual, at the usual cost.
+   * iterators work as usual meanwhile,
+   *   except that const lookups scan the pending run after missing the tree.
+   */
+  void begin_bulk() {
+    bulk = true;
+  }
+
+  void end_bulk() {
+    absorb();
+    bulk = false;
+  }
+
+  /**
+   * put the pending run of appends into the tree.
+   */
+  void absorb() {
+    if (!pending) { return; }
+    segment tree{root, head->next, run->previous};
+    if (!root) { tree.first = tree.last = nullptr; }
+    root = join(tree, segment{build(run, pending), run, tail->previous}).root;
+    pending = 0;
+  }
+
+  /**
+   * look key up in the pending run.
+   */
+  node *find_pending(const Key &key) const {
+    Compare compare;
+    node *p = run;
+    for (int i = 0; i < pending && !compare(key, p->data.first); ++i, p = p->next) {
+      if (!compare(p->data.first, key)) { return p; }
+    }
+    return nullptr;
+  }
+
   /**
    * Returns the number of elements with key
    *   that compares equivalent to the specified argument,
@@ -801,9 +1376,46 @@ class map {
       else if (compare(key, p->data.first)) { p = p->left; }
       else { return 1; }
     }
+    if (find_pending(key)) { return 1; }
     return 0;
   }
 
+  /**
+   * the value of key, nullptr if key does not exist.
+   * lookups that often miss use these three instead of at() and catch:
+   *   a miss costs the descent only.
+   */
+  const T *find_ptr(const Key &key) const {
+    node *p = root;
+    Compare compare;
+    while (p) {
+      if (compare(p->data.first, key)) { p = p->right; }
+      else if (compare(key, p->data.first)) { p = p->left; }
+      else { return &p->data.second; }
+    }
+    if (node *q = find_pending(key)) { return &q->data.second; }
+    return nullptr;
+  }
+
+  T *find_ptr(const Key &key) {
+    absorb();
+    return const_cast<T *>(static_cast<const map *>(this)->find_ptr(key));
+  }
+
+  /**
+   * copy the value of key into value, return false if key does not exist.
+   */
+  bool try_at(const Key &key, T &value) const {
+    const T *found = find_ptr(key);
+    if (!found) { return false; }
+    value = *found;
+    return true;
+  }
+
+  bool contains(const Key &key) const {
+    return count(key) != 0;
+  }
+
   /**
    * Finds an element with key equivalent to key.
    * key value of the element to search for.
@@ -811,6 +1423,7 @@ class map {
    *   If no such element is found, past-the-end (see end()) iterator is returned.
    */
   iterator find(const Key &key) {
+    absorb();
     node *p = root;
     Compare compare;
     while (p) {
@@ -835,9 +1448,1413 @@ class map {
         return it;
       }
     }
+    if (node *q = find_pending(key)) { return const_iterator(q, this); }
     return cend();
   }
-};
+
+  /**
+   * the k-th (from 0) element in key order, cend() if there are not that many.
+   * O(log n), plus the distance into a pending run of appends.
+   */
+  const_iterator nth(size_t k) const {
+    if (k >= (size_t)number) { return cend(); }
+    if (k < (size_t)size(root)) { return const_iterator(select(root, k), this); }
+    const node *p = run;
+    for (k -= size(root); k; --k) { p = p->next; }
+    return const_iterator(p, this);
+  }
+
+  /**
+   * no policy lets a tree of 2^31 nodes grow deeper than this.
+   */
+  static constexpr int max_depth = 128;
+
+  /**
+   * look key up in a tree a writer may be changing, for readers that
+   *   validate afterwards (see concurrent_map); pending appends are not seen.
+   * a rotation seen half done can lead in circles,
+   *   so complete is false if the search gave up after max_depth nodes.
+   */
+  const value_type *probe(const Key &key, bool &complete) const {
+    const node *p = root;
+    Compare compare;
+    complete = false;
+    for (int depth = 0; p && depth < max_depth; ++depth) {
+      if (compare(p->data.first, key)) { p = p->right; }
+      else if (compare(key, p->data.first)) { p = p->left; }
+      else {
+        complete = true;
+        return &p->data;
+      }
+    }
+    complete = !p;
+    return nullptr;
+  }
+
+  /**
+   * a subtree together with its smallest and largest node.
+   * the threads inside a segment are always in order,
+   *   but first->previous and last->next are left dangling
+   *   until the segment is attached back between head and tail.
+   */
+  struct segment {
+    link_type root;
+    node *first;
+    node *last;
+  };
+
+  segment left_of(node *t, const segment &s) {
+    if (!t->left) { return segment{nullptr, nullptr, nullptr}; }
+    return segment{t->left, s.first, t->previous};
+  }
+
+  segment right_of(node *t, const segment &s) {
+    if (!t->right) { return segment{nullptr, nullptr, nullptr}; }
+    return segment{t->right, t->next, s.last};
+  }
+
+  /**
+   * detach every node from the map and leave it empty.
+   */
+  segment release() {
+    absorb();
+    segment s{root, head->next, tail->previous};
+    if (!root) { s.first = s.last = nullptr; }
+    root = nullptr;
+    head->next = tail;
+    tail->previous = head;
+    number = 0;
+    return s;
+  }
+
+  /**
+   * make s the content of the (empty) map.
+   */
+  void attach(const segment &s) {
+    root = s.root;
+    number = size(root);
+    if (root) {
+      head->next = s.first;
+      s.first->previous = head;
+      tail->previous = s.last;
+      s.last->next = tail;
+    }
+  }
+
+  void destroy(const segment &s) {
+    if (!s.first) { return; }
+    node *p1 = s.first;
+    node *p2;
+    while (p1 != s.last) {
+      p2 = p1->next;
+      dispose(p1);
+      p1 = p2;
+    }
+    dispose(p1);
+  }
+
+  /**
+   * shape the n nodes threaded from first into a perfectly balanced tree.
+   * iterative: the explicit stack only grows with log n.
+   */
+  node *build(node *first, int n) {
+    struct frame {
+      int n;
+      int state;
+      node *t;
+    };
+    frame stack[64];
+    int top = 0;
+    node *cur = first;
+    node *result = nullptr;
+    stack[top++] = frame{n, 0, nullptr};
+    while (top) {
+      frame &f = stack[top - 1];
+      if (f.n == 0) {
+        result = nullptr;
+        --top;
+      } else if (f.state == 0) {
+        f.state = 1;
+        stack[top++] = frame{f.n / 2, 0, nullptr};
+      } else if (f.state == 1) {
+        f.state = 2;
+        f.t = cur;
+        cur = cur->next;
+        f.t->left = result;
+        stack[top++] = frame{f.n - f.n / 2 - 1, 0, nullptr};
+      } else {
+        f.t->right = result;
+        f.t->rank = Balance::build_rank(rank(f.t->left), rank(result));
+        update(f.t);
+        result = f.t;
+        --top;
+      }
+    }
+    return result;
+  }
+
+  /**
+   * the k-th (from 0) smallest node under t.
+   */
+  static const node *select(const node *t, int k) {
+    while (k != size(t->left)) {
+      if (k < size(t->left)) {
+        t = t->left;
+      } else {
+        k -= size(t->left) + 1;
+        t = t->right;
+      }
+    }
+    return t;
+  }
+
+  /**
+   * copy count nodes following the threads from src,
+   *   then balance the copied run.
+   */
+  segment copy_chain(const node *src, int count) {
+    node *first = new node(src->data);
+    node *last = first;
+    try {
+      for (int i = 1; i < count; ++i) {
+        src = src->next;
+        last->next = new node(src->data);
+        last->next->previous = last;
+        last = last->next;
+      }
+    } catch (...) {
+      destroy(segment{nullptr, first, last});
+      throw;
+    }
+    return segment{build(first, count), first, last};
+  }
+
+  /**
+   * copies of at least parallel_copy_threshold elements are cut into
+   *   equal runs copied on copy_threads threads (0 for one per core),
+   *   then stitched together with join.
+   * the copy constructors of Key and T then run on several threads at once,
+   *   raise the threshold for types where that is not safe.
+   */
+  inline static size_t parallel_copy_threshold = 1 << 17;
+  inline static unsigned copy_threads = 0;
+
+  /**
+   * run task(0), ..., task(threads - 1) at once, task(0) on the calling thread.
+   * the task of a thread that cannot be started runs on the calling thread,
+   *   and so do all of them if there is no memory for the threads:
+   *   only the tasks throw, so a caller may hold the tree apart meanwhile.
+   */
+  template<class Task>
+  static void run_on(unsigned threads, Task &task) {
+    std::thread *workers = new(std::nothrow) std::thread[threads];
+    if (!workers) {
+      for (unsigned i = 0; i < threads; ++i) { task(i); }
+      return;
+    }
+    for (unsigned i = 1; i < threads; ++i) {
+      try {
+        workers[i] = std::thread(task, i);
+      } catch (...) {
+        task(i);
+      }
+    }
+    task(0);
+    for (unsigned i = 1; i < threads; ++i) {
+      if (workers[i].joinable()) { workers[i].join(); }
+    }
+    delete[] workers;
+  }
+
+  segment clone(const map &other) {
+    int n = other.number;
+    if (n == 0) { return segment{nullptr, nullptr, nullptr}; }
+    unsigned threads = copy_threads ? copy_threads : std::thread::hardware_concurrency();
+    if (threads <= 1 || (size_t)n < parallel_copy_threshold || other.pending) {
+      return copy_chain(other.head->next, n);
+    }
+    if (threads > (unsigned)n) { threads = n; }
+    segment *parts = new segment[threads];
+    std::exception_ptr *errors = new std::exception_ptr[threads];
+    auto task = [&](unsigned i) {
+      long long from = (long long)n * i / threads;
+      long long to = (long long)n * (i + 1) / threads;
+      try {
+        parts[i] = copy_chain(select(other.root, from), to - from);
+      } catch (...) {
+        parts[i] = segment{nullptr, nullptr, nullptr};
+        errors[i] = std::current_exception();
+      }
+    };
+    run_on(threads, task);
+    std::exception_ptr error;
+    for (unsigned i = 0; i < threads; ++i) {
+      if (errors[i]) { error = errors[i]; }
+    }
+    segment result = parts[0];
+    if (error) {
+      for (unsigned i = 0; i < threads; ++i) { destroy(parts[i]); }
+    } else {
+      for (unsigned i = 1; i < threads; ++i) { result = join(result, parts[i]); }
+    }
+    delete[] parts;
+    delete[] errors;
+    if (error) { std::rethrow_exception(error); }
+    return result;
+  }
+
+  /**
+   * parallel_for_each and parallel_reduce cut ranges of at least
+   *   parallel_threshold elements into chunks_per_thread chunks
+   *   for each of parallel_threads threads (0 for one per core).
+   */
+  inline static size_t parallel_threshold = 1 << 15;
+  inline static unsigned parallel_threads = 0;
+  static constexpr unsigned chunks_per_thread = 8;
+
+  /**
+   * run work(c) for every chunk c in [0, chunks) on threads threads.
+   * each thread owns a share of the chunks and takes them from its front;
+   *   a thread out of work steals the back half of another thread's share,
+   *   so a slow chunk or a descheduled thread does not hold the others up.
+   * a share [lo, hi) is packed into one word, so taking and stealing are
+   *   single compare-and-swaps.
+   * after an exception no more chunks are handed out, the first one is rethrown.
+   */
+  template<class Work>
+  static void parallel_chunks(unsigned threads, unsigned chunks, Work &work) {
+    struct alignas(64) share {
+      std::atomic<unsigned long long> range;
+    };
+    auto pack = [](unsigned long long lo, unsigned long long hi) { return lo << 32 | hi; };
+    share *shares = new share[threads];
+    for (unsigned i = 0; i < threads; ++i) {
+      shares[i].range.store(pack((unsigned long long)chunks * i / threads,
+                                 (unsigned long long)chunks * (i + 1) / threads));
+    }
+    std::atomic<bool> failed(false);
+    std::exception_ptr *errors = new std::exception_ptr[threads];
+    auto take = [&](unsigned i, unsigned &c) {
+      unsigned long long range = shares[i].range.load();
+      while ((unsigned)(range >> 32) < (unsigned)range) {
+        if (shares[i].range.compare_exchange_weak(range, range + (1ull << 32))) {
+          c = range >> 32;
+          return true;
+        }
+      }
+      return false;
+    };
+    auto steal = [&](unsigned i) {
+      for (unsigned k = 1; k < threads; ++k) {
+        share &victim = shares[(i + k) % threads];
+        unsigned long long range = victim.range.load();
+        for (;;) {
+          unsigned lo = range >> 32, hi = (unsigned)range;
+          if (lo >= hi) { break; }
+          unsigned mid = lo + (hi - lo) / 2;
+          if (victim.range.compare_exchange_weak(range, pack(lo, mid))) {
+            shares[i].range.store(pack(mid, hi));
+            return true;
+          }
+        }
+      }
+      return false;
+    };
+    auto task = [&](unsigned i) {
+      try {
+        unsigned c;
+        while (!failed.load(std::memory_order_relaxed)) {
+          if (take(i, c)) {
+            work(c);
+          } else if (!steal(i)) {
+            break;
+          }
+        }
+      } catch (...) {
+        errors[i] = std::current_exception();
+        failed = true;
+      }
+    };
+    run_on(threads, task);
+    std::exception_ptr error;
+    for (unsigned i = 0; i < threads; ++i) {
+      if (errors[i] && !error) { error = errors[i]; }
+    }
+    delete[] shares;
+    delete[] errors;
+    if (error) { std::rethrow_exception(error); }
+  }
+
+  /**
+   * the position of p in key order, number for the end
+   *   and -1 for the node before the first, in O(log n).
+   */
+  int index_of(const node *p) const {
+    if (p == tail) { return number; }
+    if (p == head) { return -1; }
+    Compare compare;
+    int k = 0;
+    const node *t = root;
+    while (t != p) {
+      if (compare(p->data.first, t->data.first)) {
+        t = t->left;
+      } else {
+        k += size(t->left) + 1;
+        t = t->right;
+      }
+    }
+    return k + size(t->left);
+  }
+
+  /**
+   * whether a comes before b in the list, head first and tail last.
+   * O(1) by their keys, so it holds for pending appends too.
+   */
+  bool before(const node *a, const node *b) const {
+    if (a == b || a == tail || b == head) { return false; }
+    if (a == head || b == tail) { return true; }
+    Compare compare;
+    return compare(a->data.first, b->data.first);
+  }
+
+  /**
+   * how [first, last) is cut: chunk c runs from the
+   *   (from + (to - from) * c / chunks)-th node up to the start of chunk c + 1.
+   */
+  struct plan {
+    const node *first;
+    const node *last;
+    int from;
+    int to;
+    unsigned threads;
+    unsigned chunks;
+  };
+
+  /**
+   * the boundaries are found from the subtree sizes, O(log n) each,
+   *   so nothing walks the range before the chunks start.
+   * a range that is short, or holds pending appends (whose positions
+   *   are unknown until the tree takes them in), makes one chunk.
+   * throw invalid_iterator if last comes before first.
+   */
+  plan make_plan(const node *first, const node *last) const {
+    if (before(last, first)) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    plan p{first, last, 0, 0, 1, 1};
+    if (pending) { return p; }
+    p.from = index_of(first);
+    p.to = index_of(last);
+    unsigned n = p.to - p.from;
+    unsigned threads = parallel_threads ? parallel_threads : std::thread::hardware_concurrency();
+    if (threads <= 1 || n < parallel_threshold) { return p; }
+    p.threads = threads;
+    p.chunks = threads * chunks_per_thread < n ? threads * chunks_per_thread : n;
+    return p;
+  }
+
+  const node *chunk_start(const plan &p, unsigned c) const {
+    if (c == 0) { return p.first; }
+    if (c == p.chunks) { return p.last; }
+    return select(root, p.from + (long long)(p.to - p.from) * c / p.chunks);
+  }
+
+  /**
+   * call visit(c, begin, end) for the nodes [begin, end) of every chunk c.
+   */
+  template<class Visit>
+  void run_plan(const plan &p, Visit &visit) const {
+    auto work = [&](unsigned c) {
+      visit(c, chunk_start(p, c), chunk_start(p, c + 1));
+    };
+    parallel_chunks(p.threads, p.chunks, work);
+  }
+
+  /**
+   * call fn(value) for every element in [first, last),
+   *   on several threads when the range is long enough.
+   * fn runs concurrently on distinct elements, in no particular order;
+   *   it may change the values but not the keys, nor the map.
+   * throw invalid_iterator if first or last is not from this map,
+   *   or if last comes before first.
+   * an exception from fn is rethrown once every thread has stopped.
+   */
+  template<class Fn>
+  void parallel_for_each(iterator first, iterator last, Fn fn) {
+    if (Checked && (first.p_map != this || last.p_map != this)) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    absorb();
+    auto visit = [&](unsigned, const node *begin, const node *end) {
+      for (node *p = const_cast<node *>(begin); p != end; p = p->next) { fn(p->data); }
+    };
+    run_plan(make_plan(first.pointer, last.pointer), visit);
+  }
+
+  template<class Fn>
+  void parallel_for_each(const_iterator first, const_iterator last, Fn fn) const {
+    if (Checked && (first.p_map != this || last.p_map != this)) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    auto visit = [&](unsigned, const node *begin, const node *end) {
+      for (const node *p = begin; p != end; p = p->next) { fn(p->data); }
+    };
+    run_plan(make_plan(first.pointer, last.pointer), visit);
+  }
+
+  /**
+   * fold [first, last) into one result, on several threads when the range
+   *   is long enough: each chunk is folded from a copy of init with
+   *   op(result, value), then the chunk results are folded in key order
+   *   with combine(result, result).
+   * init should therefore be an identity of both (0 for a sum),
+   *   and combine associative; it need not be commutative.
+   * exceptions as in parallel_for_each.
+   */
+  template<class R, class Op, class Combine = std::plus<R>>
+  R parallel_reduce(const_iterator first, const_iterator last, R init, Op op, Combine combine = Combine()) const {
+    if (Checked && (first.p_map != this || last.p_map != this)) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    plan p = make_plan(first.pointer, last.pointer);
+    if (p.chunks == 0) { return init; }
+    std::vector<R> results(p.chunks, init);
+    auto visit = [&](unsigned c, const node *begin, const node *end) {
+      R result = init;
+      for (; begin != end; begin = begin->next) { result = op(std::move(result), begin->data); }
+      results[c] = std::move(result);
+    };
+    run_plan(p, visit);
+    R result = std::move(results[0]);
+    for (unsigned c = 1; c < p.chunks; ++c) { result = combine(std::move(result), std::move(results[c])); }
+    return result;
+  }
+
+  static void prefetch(const void *p) {
+#ifdef __GNUC__
+    __builtin_prefetch(p);
+#endif
+  }
+
+  /**
+   * scans hand their visitor up to scan_block elements at a time,
+   *   gathered along scan_ways stripes at once.
+   */
+  static constexpr int scan_ways = 8;
+  static constexpr int scan_block = 1024;
+
+  template<bool Reverse>
+  static const node *step(const node *p) {
+    if (Reverse) { return p->previous; }
+    return p->next;
+  }
+
+  /**
+   * call store(k, node) for the k-th of up to scan_block nodes from p,
+   *   the position-th node with remaining nodes left before last
+   *   (-1 when positions are unknown, which walks up to last),
+   *   going up in key order, or down if Reverse.
+   * following one run of next pointers allows one cache miss at a time,
+   *   so the block is cut into scan_ways stripes, each started with select,
+   *   walked side by side with the next node of every stripe prefetched.
+   * return the number of nodes gathered, p moves past them.
+   */
+  template<bool Reverse, class Store>
+  int gather(const node *&p, const node *last, int position, int remaining, Store &store) const {
+    if (remaining < 0) {
+      int k = 0;
+      for (; k < scan_block && p != last; ++k, p = step<Reverse>(p)) { store(k, p); }
+      return k;
+    }
+    int count = remaining < scan_block ? remaining : scan_block;
+    int ways = count >= scan_ways * 16 ? scan_ways : 1;
+    const node *cursor[scan_ways];
+    int start[scan_ways + 1];
+    for (int j = 0; j <= ways; ++j) { start[j] = count * j / ways; }
+    cursor[0] = p;
+    for (int j = 1; j < ways; ++j) { cursor[j] = select(root, Reverse ? position - start[j] : position + start[j]); }
+    for (int i = 0; i < count - start[ways - 1]; ++i) {
+      for (int j = 0; j < ways; ++j) {
+        if (start[j] + i < start[j + 1]) {
+          store(start[j] + i, cursor[j]);
+          cursor[j] = step<Reverse>(cursor[j]);
+          prefetch(cursor[j]);
+        }
+      }
+    }
+    p = cursor[ways - 1];
+    return count;
+  }
+
+  /**
+   * the first node in the tree whose key is not less than key
+   *   (tail if there is none) and its position.
+   */
+  const node *first_not_less(const Key &key, int &position) const {
+    Compare compare;
+    const node *t = root, *result = tail;
+    int k = 0;
+    position = size(root);
+    while (t) {
+      if (compare(t->data.first, key)) {
+        k += size(t->left) + 1;
+        t = t->right;
+      } else {
+        result = t;
+        position = k + size(t->left);
+        t = t->left;
+      }
+    }
+    if (result == tail && pending) {
+      result = run;
+      for (int i = 0; i < pending && compare(result->data.first, key); ++i) { result = result->next; }
+    }
+    return result;
+  }
+
+  template<bool Reverse, class Value, class Visitor>
+  size_t scan_range(const Key &lo, const Key &hi, Visitor &visitor) const {
+    Compare compare;
+    if (!compare(lo, hi)) { return 0; }
+    Value *batch[scan_block];
+    auto store = [&](int k, const node *p) { batch[k] = &const_cast<node *>(p)->data; };
+    int from, to;
+    const node *p = first_not_less(lo, from);
+    const node *last = first_not_less(hi, to);
+    int remaining = pending ? -1 : to - from;
+    if (Reverse) {
+      const node *first = last->previous;
+      last = p->previous;
+      p = first;
+      from = to - 1;
+    }
+    size_t total = 0;
+    for (int n; (n = gather<Reverse>(p, last, from, remaining, store)); total += n) {
+      if constexpr (std::is_same<decltype(visitor(batch, (size_t)n)), bool>::value) {
+        if (!visitor(static_cast<Value *const *>(batch), (size_t)n)) { return total + n; }
+      } else {
+        visitor(static_cast<Value *const *>(batch), (size_t)n);
+      }
+      from += Reverse ? -n : n;
+      if (remaining > 0) { remaining -= n; }
+    }
+    return total;
+  }
+
+  /**
+   * call visitor(batch, n) for consecutive batches of n pointers to the
+   *   elements whose keys lie in [lo, hi), in key order.
+   * the batches are gathered without walking one next pointer after another,
+   *   which makes scans over maps larger than the cache several times faster
+   *   than ++ on an iterator.
+   * the visitor may change the values but not the keys, nor the map;
+   *   a visitor returning bool stops the scan by returning false.
+   * return the number of elements handed to the visitor.
+   */
+  template<class Visitor>
+  size_t scan(const Key &lo, const Key &hi, Visitor visitor) {
+    absorb();
+    return scan_range<false, value_type>(lo, hi, visitor);
+  }
+
+  template<class Visitor>
+  size_t scan(const Key &lo, const Key &hi, Visitor visitor) const {
+    return scan_range<false, const value_type>(lo, hi, visitor);
+  }
+
+  /**
+   * like scan, from the largest key in [lo, hi) down,
+   *   so "the last k keys before hi" cost O(log n + k)
+   *   with a visitor that stops after k.
+   */
+  template<class Visitor>
+  size_t reverse_scan(const Key &lo, const Key &hi, Visitor visitor) {
+    absorb();
+    return scan_range<true, value_type>(lo, hi, visitor);
+  }
+
+  template<class Visitor>
+  size_t reverse_scan(const Key &lo, const Key &hi, Visitor visitor) const {
+    return scan_range<true, const value_type>(lo, hi, visitor);
+  }
+
+  /**
+   * a read-only, forward-only iterator over a range that gathers a block
+   *   ahead the way scan does; compare it to the end of the range to stop.
+   * Reverse walks a range of const_reverse_iterators.
+   * copies share their block until one of them moves on to the next,
+   *   so a copy allocates nothing and cannot throw.
+   */
+  template<bool Reverse>
+  class basic_prefetch_iterator {
+    friend map<Key, T, Compare, Balance, Checked, SharedLinks>;
+    typedef typename std::conditional<Reverse, const_reverse_iterator, const_iterator>::type range_iterator;
+   private:
+    const map *owner;
+    std::shared_ptr<const node *[]> buffer;
+    int count;
+    int index;
+    const node *p;
+    const node *last;
+    int position;
+    int remaining;
+
+    basic_prefetch_iterator(const map *owner, const node *first, const node *last, int position, int remaining)
+            : owner(owner), buffer(new const node *[scan_block]), count(0), index(0),
+              p(first), last(last), position(position), remaining(remaining) {
+      refill();
+    }
+
+    void refill() {
+      if (buffer.use_count() > 1) { buffer.reset(new const node *[scan_block]); }
+      auto store = [this](int k, const node *q) { buffer[k] = q; };
+      index = 0;
+      count = owner->template gather<Reverse>(p, last, position, remaining, store);
+      position += Reverse ? -count : count;
+      if (remaining > 0) { remaining -= count; }
+    }
+
+    const node *current() const {
+      if (index < count) { return buffer[index]; }
+      return last;
+    }
+
+   public:
+    /**
+     * throw invalid_iterator at the end of the range.
+     */
+    basic_prefetch_iterator &operator++() {
+      if (Checked && index == count) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      if (++index == count) { refill(); }
+      return *this;
+    }
+
+    const value_type &operator*() const {
+      return current()->data;
+    }
+
+    const value_type *operator->() const noexcept {
+      return &(current()->data);
+    }
+
+    bool operator==(const range_iterator &rhs) const {
+      return current() == rhs.pointer;
+    }
+
+    bool operator!=(const range_iterator &rhs) const {
+      return current() != rhs.pointer;
+    }
+  };
+
+  typedef basic_prefetch_iterator<false> prefetch_iterator;
+  typedef basic_prefetch_iterator<true> reverse_prefetch_iterator;
+
+  /**
+   * a prefetch_iterator over [first, last).
+   * throw invalid_iterator if first or last is not from this map,
+   *   or if last comes before first.
+   */
+  prefetch_iterator prefetching(const_iterator first, const_iterator last) const {
+    if (Checked && (first.p_map != this || last.p_map != this)) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    if (before(last.pointer, first.pointer)) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    if (pending) { return prefetch_iterator(this, first.pointer, last.pointer, 0, -1); }
+    int from = index_of(first.pointer), to = index_of(last.pointer);
+    return prefetch_iterator(this, first.pointer, last.pointer, from, to - from);
+  }
+
+  reverse_prefetch_iterator prefetching(const_reverse_iterator first, const_reverse_iterator last) const {
+    if (Checked && (first.p_map != this || last.p_map != this)) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    if (before(first.pointer, last.pointer)) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    if (pending) { return reverse_prefetch_iterator(this, first.pointer, last.pointer, 0, -1); }
+    int from = index_of(first.pointer), to = index_of(last.pointer);
+    return reverse_prefetch_iterator(this, first.pointer, last.pointer, from, from - to);
+  }
+
+  /**
+   * hang l and r under k, a root one rank above the higher of them.
+   */
+  void join_root(node *l, node *k, node *r) {
+    k->left = l;
+    k->right = r;
+    k->rank = max(rank(l), rank(r)) + 1;
+    update(k);
+  }
+
+  void join_right(link_type &t, node *k, node *r) {
+    if (rank(t->right) <= rank(r) + Balance::join_slack) {
+      join_root(t->right, k, r);
+      t->right = k;
+    } else {
+      join_right(t->right, k, r);
+    }
+    update(t);
+    Balance::insert_fix(*this, t);
+  }
+
+  void join_left(node *l, node *k, link_type &t) {
+    if (rank(t->left) <= rank(l) + Balance::join_slack) {
+      join_root(l, k, t->left);
+      t->left = k;
+    } else {
+      join_left(l, k, t->left);
+    }
+    update(t);
+    Balance::insert_fix(*this, t);
+  }
+
+  /**
+   * concatenate l, k and r, where every key in l is less than k's
+   *   and every key in r is greater.
+   * O(|rank(l) - rank(r)| + 1).
+   */
+  segment join(segment l, node *k, segment r) {
+    segment result{nullptr, k, k};
+    if (l.root) {
+      l.last->next = k;
+      k->previous = l.last;
+      result.first = l.first;
+    }
+    if (r.root) {
+      r.first->previous = k;
+      k->next = r.first;
+      result.last = r.last;
+    }
+    if (rank(l.root) > rank(r.root) + Balance::join_slack) {
+      join_right(l.root, k, r.root);
+      result.root = l.root;
+    } else if (rank(r.root) > rank(l.root) + Balance::join_slack) {
+      join_left(l.root, k, r.root);
+      result.root = r.root;
+    } else {
+      join_root(l.root, k, r.root);
+      result.root = k;
+    }
+    return result;
+  }
+
+  /**
+   * cut off the largest node of s (which must not be empty).
+   */
+  node *split_last(segment s, segment &rest) {
+    node *t = s.root;
+    segment l = left_of(t, s);
+    if (!t->right) {
+      rest = l;
+      return t;
+    }
+    node *last = split_last(right_of(t, s), rest);
+    rest = join(l, t, rest);
+    return last;
+  }
+
+  /**
+   * join without a middle node.
+   */
+  segment join(segment l, segment r) {
+    if (!l.root) { return r; }
+    if (!r.root) { return l; }
+    segment rest;
+    node *k = split_last(l, rest);
+    return join(rest, k, r);
+  }
+
+  /**
+   * split s into the keys less than key and the keys greater than key.
+   * return the node holding key itself, or nullptr if there is none.
+   * O(log n).
+   */
+  node *split(segment s, const Key &key, segment &less, segment &greater) {
+    node *t = s.root;
+    if (!t) {
+      less = greater = segment{nullptr, nullptr, nullptr};
+      return nullptr;
+    }
+    segment l = left_of(t, s);
+    segment r = right_of(t, s);
+    Compare compare;
+    if (compare(key, t->data.first)) {
+      node *match = split(l, key, less, greater);
+      greater = join(greater, t, r);
+      return match;
+    } else if (compare(t->data.first, key)) {
+      node *match = split(r, key, less, greater);
+      less = join(l, t, less);
+      return match;
+    } else {
+      less = l;
+      greater = r;
+      return t;
+    }
+  }
+
+  /**
+   * the resolver used when the caller does not give one:
+   *   the value already in *this wins.
+   */
+  struct keep_first {};
+
+  template<class Resolve>
+  void resolve_value(node *t, const node *other, Resolve &resolve) {
+    t->data.second = resolve(t->data.second, other->data.second);
+  }
+
+  void resolve_value(node *, const node *, keep_first &) {}
+
+  template<class Resolve>
+  segment unite(segment a, segment b, Resolve &resolve) {
+    if (!a.root) { return b; }
+    if (!b.root) { return a; }
+    node *t = a.root;
+    segment l = left_of(t, a);
+    segment r = right_of(t, a);
+    segment less, greater;
+    node *match = split(b, t->data.first, less, greater);
+    l = unite(l, less, resolve);
+    r = unite(r, greater, resolve);
+    if (match) {
+      resolve_value(t, match, resolve);
+      dispose(match);
+    }
+    return join(l, t, r);
+  }
+
+  template<class Resolve>
+  segment intersect(segment a, segment b, Resolve &resolve) {
+    if (!a.root || !b.root) {
+      destroy(a);
+      destroy(b);
+      return segment{nullptr, nullptr, nullptr};
+    }
+    node *t = a.root;
+    segment l = left_of(t, a);
+    segment r = right_of(t, a);
+    segment less, greater;
+    node *match = split(b, t->data.first, less, greater);
+    l = intersect(l, less, resolve);
+    r = intersect(r, greater, resolve);
+    if (match) {
+      resolve_value(t, match, resolve);
+      dispose(match);
+      return join(l, t, r);
+    }
+    dispose(t);
+    return join(l, r);
+  }
+
+  segment subtract(segment a, segment b) {
+    if (!a.root || !b.root) {
+      destroy(b);
+      return a;
+    }
+    node *t = b.root;
+    segment l = left_of(t, b);
+    segment r = right_of(t, b);
+    segment less, greater;
+    node *match = split(a, t->data.first, less, greater);
+    less = subtract(less, l);
+    greater = subtract(greater, r);
+    if (match) {
+      dispose(match);
+    }
+    dispose(t);
+    return join(less, greater);
+  }
+
+  /**
+   * move every element of other into *this, leaving other empty.
+   * for a key present in both, the value becomes resolve(mine, theirs),
+   *   which must not throw.
+   * O(m log(n / m + 1)) where m <= n are the two sizes.
+   * iterators of both maps are invalidated.
+   */
+  template<class Resolve>
+  void unite(map &other, Resolve resolve) {
+    if (this == &other) { return; }
+    segment a = release();
+    segment b = other.release();
+    attach(unite(a, b, resolve));
+  }
+
+  void unite(map &other) {
+    unite(other, keep_first());
+  }
+
+  /**
+   * keep only the keys present in both maps, other is emptied.
+   */
+  template<class Resolve>
+  void intersect(map &other, Resolve resolve) {
+    if (this == &other) { return; }
+    segment a = release();
+    segment b = other.release();
+    attach(intersect(a, b, resolve));
+  }
+
+  void intersect(map &other) {
+    intersect(other, keep_first());
+  }
+
+  /**
+   * remove the keys present in other, other is emptied.
+   */
+  void subtract(map &other) {
+    if (this == &other) {
+      clear();
+      return;
+    }
+    segment a = release();
+    segment b = other.release();
+    attach(subtract(a, b));
+  }
+
+  /**
+   * sort batch by key, equal keys staying in batch order, on threads threads:
+   *   each sorts a run of its own, then the runs are merged pairwise,
+   *   the merges of a round side by side.
+   */
+  static void sort_batch(std::vector<node *> &batch, unsigned threads) {
+    auto less = [](const node *a, const node *b) { return Compare()(a->data.first, b->data.first); };
+    size_t k = batch.size();
+    auto bound = [k, threads](unsigned i) { return k * i / threads; };
+    auto sort_run = [&](unsigned i) {
+      std::stable_sort(batch.begin() + bound(i), batch.begin() + bound(i + 1), less);
+    };
+    run_on(threads, sort_run);
+    if (threads == 1) { return; }
+    std::vector<node *> buffer(k);
+    for (unsigned width = 1; width < threads; width *= 2) {
+      auto merge_runs = [&](unsigned m) {
+        unsigned lo = 2 * width * m;
+        unsigned mid = std::min(lo + width, threads);
+        unsigned hi = std::min(lo + 2 * width, threads);
+        std::merge(batch.begin() + bound(lo), batch.begin() + bound(mid),
+                   batch.begin() + bound(mid), batch.begin() + bound(hi),
+                   buffer.begin() + bound(lo), less);
+      };
+      run_on((threads + 2 * width - 1) / (2 * width), merge_runs);
+      batch.swap(buffer);
+    }
+  }
+
+  /**
+   * insert the value_types in [first, last) as insert would one by one:
+   *   a key already in the map, or met earlier in the batch, is left alone.
+   *   return how many were new.
+   *
+   * the batch is copied into nodes, sorted in parallel, and cut into
+   *   parallel_threads parts (0 for one per core) at evenly spaced keys of
+   *   its own; the tree is split at the same keys in O(threads log n).
+   *   each part of the batch is then built into a balanced tree in linear
+   *   time and united with its part of the tree on a thread of its own,
+   *   and the parts are joined back, which restores ranks and threads.
+   * a batch below parallel_threshold is done the same way on one thread.
+   * if copying an element throws, nothing is inserted.
+   * iterators stay valid.
+   */
+  template<class InputIterator>
+  size_t insert_batch(InputIterator first, InputIterator last) {
+    std::vector<node *> batch;
+    try {
+      for (; first != last; ++first) {
+        batch.push_back(nullptr);
+        batch.back() = new node(*first);
+      }
+    } catch (...) {
+      for (node *p : batch) { delete p; }
+      throw;
+    }
+    if (batch.empty()) { return 0; }
+    unsigned threads = parallel_threads ? parallel_threads : std::thread::hardware_concurrency();
+    if (threads == 0 || batch.size() < parallel_threshold) { threads = 1; }
+    if (threads > batch.size()) { threads = batch.size(); }
+    std::vector<segment> parts;
+    std::vector<size_t> cuts;
+    std::vector<node *> separators;
+    map *workers = nullptr;
+    try {
+      sort_batch(batch, threads);
+      parts.resize(threads);
+      cuts.resize(threads + 1);
+      separators.resize(threads);
+      workers = new map[threads];
+    } catch (...) {
+      for (node *p : batch) { delete p; }
+      throw;
+    }
+    Compare compare;
+    size_t kept = 0;
+    for (node *p : batch) {
+      if (kept && !compare(batch[kept - 1]->data.first, p->data.first)) {
+        delete p;
+      } else {
+        batch[kept++] = p;
+      }
+    }
+    batch.resize(kept);
+    if (threads > kept) { threads = kept; }
+    // batch[cuts[i]] separates part i - 1 from part i, unless the tree
+    //   holds its key: then that node does, and batch[cuts[i]] goes.
+    cuts[0] = 0;
+    cuts[threads] = kept;
+    size_t before = number;
+    segment rest = release();
+    for (unsigned i = threads - 1; i > 0; --i) {
+      cuts[i] = kept * i / threads;
+      segment less;
+      node *match = split(rest, batch[cuts[i]]->data.first, less, parts[i]);
+      rest = less;
+      if (match) {
+        delete batch[cuts[i]];
+        separators[i] = match;
+      } else {
+        separators[i] = batch[cuts[i]];
+      }
+    }
+    parts[0] = rest;
+    auto merge_part = [&](unsigned i) {
+      map &worker = workers[i];
+      worker.epochs = epochs;
+      size_t from = i ? cuts[i] + 1 : 0;
+      size_t to = cuts[i + 1];
+      if (from == to) { return; }
+      for (size_t j = from; j < to; ++j) {
+        batch[j]->previous = j > from ? batch[j - 1] : nullptr;
+        batch[j]->next = j + 1 < to ? batch[j + 1] : nullptr;
+      }
+      segment b{worker.build(batch[from], to - from), batch[from], batch[to - 1]};
+      keep_first keep;
+      parts[i] = worker.unite(parts[i], b, keep);
+    };
+    run_on(threads, merge_part);
+    segment result = parts[0];
+    for (unsigned i = 1; i < threads; ++i) { result = join(result, separators[i], parts[i]); }
+    for (unsigned i = 0; i < threads; ++i) { rotations += workers[i].rotations; }
+    delete[] workers;
+    attach(result);
+    return number - before;
+  }
+
+  /**
+   * move every element whose key is not less than key into a new map.
+   * O(log n), iterators to the moved elements are invalidated.
+   */
+  map split(const Key &key) {
+    segment less, greater;
+    node *match = split(release(), key, less, greater);
+    if (match) {
+      greater = join(segment{nullptr, nullptr, nullptr}, match, greater);
+    }
+    attach(less);
+    map result;
+    result.attach(greater);
+    return result;
+  }
+
+  /**
+   * append all the elements of other, whose keys must all be greater
+   *   (or all be less) than every key of *this; other is left empty.
+   * throw runtime_error if the two key ranges overlap.
+   * O(log n), iterators of other are invalidated.
+   */
+  void concatenate(map &&other) {
+    if (this == &other || other.number == 0) { return; }
+    if (number == 0) {
+      attach(other.release());
+      return;
+    }
+    Compare compare;
+    if (compare(tail->previous->data.first, other.head->next->data.first)) {
+      segment a = release();
+      segment b = other.release();
+      attach(join(a, b));
+    } else if (compare(other.tail->previous->data.first, head->next->data.first)) {
+      segment a = other.release();
+      segment b = release();
+      attach(join(a, b));
+    } else {
+      runtime_error runtime_error;
+      throw runtime_error;
+    }
+  }
+
+  /**
+   * erase every element whose key lies in [lo, hi).
+   * the range is cut out with two splits and a join in O(log n),
+   *   then its k nodes are freed in one walk along the threads.
+   * return the number of erased elements.
+   */
+  size_t erase_range(const Key &lo, const Key &hi) {
+    Compare compare;
+    if (!compare(lo, hi)) { return 0; }
+    segment empty{nullptr, nullptr, nullptr};
+    segment less, middle, greater, rest;
+    node *low = split(release(), lo, less, rest);
+    node *high = split(rest, hi, middle, greater);
+    if (low) { middle = join(empty, low, middle); }
+    if (high) { greater = join(empty, high, greater); }
+    size_t removed = size(middle.root);
+    destroy(middle);
+    attach(join(less, greater));
+    return removed;
+  }
+
+  /**
+   * erase the elements in [first, last), return last.
+   * throw invalid_iterator if first or last is not from this map,
+   *   or if last comes before first.
+   */
+  iterator erase(iterator first, iterator last) {
+    if (Checked && (first.p_map != this || last.p_map != this)) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    if (first == last) { return last; }
+    Compare compare;
+    if (first == end() || (last != end() && !compare(first->first, last->first))) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    if (last != end()) {
+      erase_range(first->first, last->first);
+      return last;
+    }
+    segment less, greater;
+    node *low = split(release(), first->first, less, greater);
+    greater = join(segment{nullptr, nullptr, nullptr}, low, greater);
+    destroy(greater);
+    attach(less);
+    return end();
+  }
+
+  /**
+   * the header of a saved map, in the byte order of the machine that saved it.
+   * key_size and value_size are 0 when the elements went through a serializer.
+   */
+  struct saved_header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t order;
+    std::uint32_t key_size;
+    std::uint32_t value_size;
+    std::uint64_t count;
+  };
+
+  inline static const char saved_magic[8] = {'s', 'j', 't', 'u', 'm', 'a', 'p', '\0'};
+  static constexpr std::uint32_t saved_version = 1;
+  static constexpr std::uint32_t saved_order = 0x01020304;
+  /**
+   * raw elements are written and read this many at a time.
+   */
+  static constexpr size_t saved_chunk = 1 << 12;
+
+  static void save_failed() {
+    runtime_error runtime_error;
+    throw runtime_error;
+  }
+
+  void save_header(std::ostream &out, bool raw) const {
+    saved_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, saved_magic, sizeof(saved_magic));
+    header.version = saved_version;
+    header.order = saved_order;
+    header.key_size = raw ? sizeof(Key) : 0;
+    header.value_size = raw ? sizeof(T) : 0;
+    header.count = number;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  }
+
+  /**
+   * return the number of elements that follow the header.
+   */
+  static size_t load_header(std::istream &in, bool raw) {
+    saved_header header;
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!in || std::memcmp(header.magic, saved_magic, sizeof(saved_magic)) != 0
+        || header.version == 0 || header.version > saved_version || header.order != saved_order
+        || header.key_size != (raw ? sizeof(Key) : 0) || header.value_size != (raw ? sizeof(T) : 0)
+        || header.count > (std::uint64_t)std::numeric_limits<int>::max()) {
+      save_failed();
+    }
+    return header.count;
+  }
+
+  /**
+   * replace the content by the n nodes next() makes, which must come
+   *   in strictly increasing key order: they are threaded as they come
+   *   and built into a balanced tree in one linear pass.
+   * if anything throws, the map is left as it was.
+   */
+  template<class Next>
+  void load_chain(size_t n, Next next) {
+    Compare compare;
+    node *first = nullptr;
+    node *last = nullptr;
+    try {
+      for (size_t i = 0; i < n; ++i) {
+        node *p = next();
+        if (!last) {
+          first = p;
+        } else {
+          last->next = p;
+          p->previous = last;
+        }
+        node *before = last;
+        last = p;
+        if (before && !compare(before->data.first, p->data.first)) { save_failed(); }
+      }
+    } catch (...) {
+      destroy(segment{nullptr, first, last});
+      throw;
+    }
+    segment loaded{build(first, n), first, last};
+    clear();
+    attach(loaded);
+  }
+
+  /**
+   * write the map to out in the saved format.
+   * Key and T must be trivially copyable: the elements are copied out
+   *   raw, saved_chunk of them to a write.
+   * throw runtime_error if out fails.
+   */
+  void save(std::ostream &out) const {
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<T>::value,
+                  "save a map of other types with a serializer");
+    save_header(out, true);
+    const size_t width = sizeof(Key) + sizeof(T);
+    std::vector<char> chunk(saved_chunk * width);
+    size_t filled = 0;
+    for (const node *p = head->next; p != tail; p = p->next) {
+      char *at = chunk.data() + filled * width;
+      std::memcpy(at, &p->data.first, sizeof(Key));
+      std::memcpy(at + sizeof(Key), &p->data.second, sizeof(T));
+      if (++filled == saved_chunk) {
+        out.write(chunk.data(), filled * width);
+        filled = 0;
+      }
+    }
+    out.write(chunk.data(), filled * width);
+    if (!out) { save_failed(); }
+  }
+
+  /**
+   * write the map to out, each element by write(out, value), in key order.
+   */
+  template<class Write>
+  void save(std::ostream &out, Write write) const {
+    save_header(out, false);
+    for (const node *p = head->next; p != tail && out; p = p->next) { write(out, p->data); }
+    if (!out) { save_failed(); }
+  }
+
+  /**
+   * replace the content by a map written by save(out), in O(n):
+   *   no element is inserted, the tree is built balanced at once.
+   * throw runtime_error if in fails or does not hold such a map,
+   *   leaving the map as it was.
+   */
+  void load(std::istream &in) {
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<T>::value,
+                  "load a map of other types with a serializer");
+    size_t n = load_header(in, true);
+    const size_t width = sizeof(Key) + sizeof(T);
+    std::vector<char> chunk(std::min(n, saved_chunk) * width);
+    size_t left = n;
+    size_t used = 0;
+    size_t available = 0;
+    load_chain(n, [&]() {
+      if (used == available) {
+        available = std::min(left, saved_chunk);
+        left -= available;
+        used = 0;
+        in.read(chunk.data(), available * width);
+        if (!in) { save_failed(); }
+      }
+      // raw storage, so that Key and T need no default constructor
+      const char *at = chunk.data() + used++ * width;
+      alignas(Key) unsigned char key[sizeof(Key)];
+      alignas(T) unsigned char value[sizeof(T)];
+      std::memcpy(key, at, sizeof(Key));
+      std::memcpy(value, at + sizeof(Key), sizeof(T));
+      return new node(value_type(*reinterpret_cast<const Key *>(key), *reinterpret_cast<const T *>(value)));
+    });
+  }
+
+  /**
+   * as load, for a map written by save(out, write):
+   *   read(in) returns the next element.
+   */
+  template<class Read>
+  void load(std::istream &in, Read read) {
+    size_t n = load_header(in, false);
+    load_chain(n, [&]() {
+      node *p = new node(read(in));
+      if (!in) {
+        delete p;
+        save_failed();
+      }
+      return p;
+    });
+  }
+};
+
+/**
+ * set algorithms consuming both inputs and reusing their nodes.
+ */
+template<class Key, class T, class Compare, class Balance, bool Checked, bool SharedLinks, class Resolve>
+map<Key, T, Compare, Balance, Checked, SharedLinks> map_union(map<Key, T, Compare, Balance, Checked, SharedLinks> &&a, map<Key, T, Compare, Balance, Checked, SharedLinks> &&b, Resolve resolve) {
+  map<Key, T, Compare, Balance, Checked, SharedLinks> result(std::move(a));
+  result.unite(b, resolve);
+  return result;
+}
+
+template<class Key, class T, class Compare, class Balance, bool Checked, bool SharedLinks>
+map<Key, T, Compare, Balance, Checked, SharedLinks> map_union(map<Key, T, Compare, Balance, Checked, SharedLinks> &&a, map<Key, T, Compare, Balance, Checked, SharedLinks> &&b) {
+  map<Key, T, Compare, Balance, Checked, SharedLinks> result(std::move(a));
+  result.unite(b);
+  return result;
+}
+
+template<class Key, class T, class Compare, class Balance, bool Checked, bool SharedLinks, class Resolve>
+map<Key, T, Compare, Balance, Checked, SharedLinks> map_intersection(map<Key, T, Compare, Balance, Checked, SharedLinks> &&a, map<Key, T, Compare, Balance, Checked, SharedLinks> &&b, Resolve resolve) {
+  map<Key, T, Compare, Balance, Checked, SharedLinks> result(std::move(a));
+  result.intersect(b, resolve);
+  return result;
+}
+
+template<class Key, class T, class Compare, class Balance, bool Checked, bool SharedLinks>
+map<Key, T, Compare, Balance, Checked, SharedLinks> map_intersection(map<Key, T, Compare, Balance, Checked, SharedLinks> &&a, map<Key, T, Compare, Balance, Checked, SharedLinks> &&b) {
+  map<Key, T, Compare, Balance, Checked, SharedLinks> result(std::move(a));
+  result.intersect(b);
+  return result;
+}
+
+template<class Key, class T, class Compare, class Balance, bool Checked, bool SharedLinks>
+map<Key, T, Compare, Balance, Checked, SharedLinks> map_difference(map<Key, T, Compare, Balance, Checked, SharedLinks> &&a, map<Key, T, Compare, Balance, Checked, SharedLinks> &&b) {
+  map<Key, T, Compare, Balance, Checked, SharedLinks> result(std::move(a));
+  result.subtract(b);
+  return result;
+}
 
 }
 
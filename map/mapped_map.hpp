@@ -0,0 +1,451 @@
+/**
+ * a read-only map served straight from a file
+ */
+#ifndef SJTU_MAPPED_MAP_HPP
+#define SJTU_MAPPED_MAP_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "utility.hpp"
+#include "exceptions.hpp"
+
+namespace sjtu {
+
+/**
+ * the file is laid out to be searched where it lies, so opening it
+ *   maps it and checks its header, nothing else: no parsing, no allocation,
+ *   and pages are read in by the first search or walk that touches them.
+ *
+ * the file holds, each section starting on a 64-byte boundary:
+ *   a header;
+ *   the keys in order (level 0), then every fanout-th key of the level
+ *   below (levels 1, 2, ...) until a level fits in one block of fanout keys,
+ *   fanout keys filling a cache line: a static B+-tree, searched top-down
+ *   with one block, one line, per level;
+ *   the elements in order, as value_types, which the iterators point into.
+ *
+ * Key and T must be trivially copyable, and the file is only read on
+ *   machines with the byte order and type sizes of the one that wrote it.
+ * it must have been written with the same Compare.
+ * nothing may change the file while it is mapped: write() replaces
+ *   a file by renaming a new one over it, which maps already open
+ *   keep seeing the old one through.
+ *
+ * the file holds offsets from its start, never addresses, so it reads
+ *   the same wherever it is mapped. publish() lays it out in a POSIX
+ *   shared memory object instead, once, and any number of processes
+ *   attach() to that read-only: they all read the one copy in memory.
+ */
+template<
+        class Key,
+        class T,
+        class Compare = std::less<Key>
+>
+class mapped_map {
+  static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<T>::value,
+                "mapped elements are read as they lie in the file");
+
+ public:
+  typedef pair<const Key, T> value_type;
+
+  static constexpr size_t fanout = sizeof(Key) * 2 <= 64 ? 64 / sizeof(Key) : 2;
+
+ private:
+  static constexpr unsigned max_levels = 32;
+  static constexpr std::uint32_t version = 1;
+  static constexpr std::uint32_t order = 0x01020304;
+  static constexpr size_t line = 64;
+
+  struct header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t order;
+    std::uint32_t key_size;
+    std::uint32_t element_size;
+    std::uint32_t fanout;
+    std::uint32_t depth;
+    std::uint64_t count;
+    std::uint64_t elements;
+    std::uint64_t levels[max_levels];
+    std::uint64_t sizes[max_levels];
+  };
+
+  inline static const char magic[8] = {'s', 'j', 't', 'u', 'f', 'l', 'a', 't'};
+
+  static void failed() {
+    runtime_error runtime_error;
+    throw runtime_error;
+  }
+
+  static std::uint64_t aligned(std::uint64_t offset) {
+    return (offset + line - 1) / line * line;
+  }
+
+  /**
+   * the sections of a file of count elements.
+   * throw runtime_error if they need more than max_levels levels,
+   *   which a fanout of 2 does past 2^32 elements.
+   */
+  static header layout(size_t count) {
+    header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, magic, sizeof(magic));
+    h.version = version;
+    h.order = order;
+    h.key_size = sizeof(Key);
+    h.element_size = sizeof(value_type);
+    h.fanout = fanout;
+    h.count = count;
+    std::uint64_t offset = aligned(sizeof(header));
+    size_t size = count;
+    do {
+      if (h.depth == max_levels) { failed(); }
+      h.levels[h.depth] = offset;
+      h.sizes[h.depth] = size;
+      ++h.depth;
+      offset = aligned(offset + size * sizeof(Key));
+      size = (size + fanout - 1) / fanout;
+    } while (h.sizes[h.depth - 1] > fanout);
+    h.elements = offset;
+    return h;
+  }
+
+  /**
+   * lay the elements of source out at base, zeroed, in the sections of h.
+   * the magic goes in last, so whoever maps the memory before it is
+   *   complete rejects it.
+   */
+  template<class Map>
+  static void fill(const Map &source, char *base, const header &h) {
+    Key *keys = reinterpret_cast<Key *>(base + h.levels[0]);
+    value_type *elements = reinterpret_cast<value_type *>(base + h.elements);
+    size_t i = 0;
+    for (auto it = source.cbegin(); it != source.cend(); ++it, ++i) {
+      std::memcpy(keys + i, &it->first, sizeof(Key));
+      new (elements + i) value_type(it->first, it->second);
+    }
+    for (unsigned l = 1; l < h.depth; ++l) {
+      const Key *below = reinterpret_cast<const Key *>(base + h.levels[l - 1]);
+      Key *level = reinterpret_cast<Key *>(base + h.levels[l]);
+      for (size_t j = 0; j < h.sizes[l]; ++j) { std::memcpy(level + j, below + j * fanout, sizeof(Key)); }
+    }
+    header incomplete = h;
+    std::memset(incomplete.magic, 0, sizeof(magic));
+    std::memcpy(base, &incomplete, sizeof(header));
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(base, magic, sizeof(magic));
+  }
+
+  /**
+   * size the file fd to hold source, laid out as h, map it and fill it.
+   */
+  template<class Map>
+  static bool build(const Map &source, const header &h, int fd) {
+    size_t total = h.elements + h.count * sizeof(value_type);
+    if (ftruncate(fd, total) != 0) { return false; }
+    void *p = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) { return false; }
+    fill(source, static_cast<char *>(p), h);
+    return munmap(p, total) == 0;
+  }
+
+  const char *base = nullptr;
+  size_t length = 0;
+  const header *info = nullptr;
+  const value_type *elements = nullptr;
+
+  const Key *level(unsigned l) const {
+    return reinterpret_cast<const Key *>(base + info->levels[l]);
+  }
+
+  /**
+   * the index of the first key not less than key: on each level, counting
+   *   the keys of one block less than key picks the block below.
+   */
+  size_t search(const Key &key) const {
+    Compare compare;
+    size_t lo = 0;
+    size_t hi = info->sizes[info->depth - 1];
+    for (unsigned l = info->depth - 1;; --l) {
+      const Key *keys = level(l);
+      size_t c = lo;
+      for (size_t i = lo; i < hi; ++i) { c += compare(keys[i], key); }
+      if (l == 0) { return c; }
+      lo = c ? (c - 1) * fanout : 0;
+      hi = std::min<size_t>(lo + fanout, info->sizes[l - 1]);
+    }
+  }
+
+  void unmap() {
+    if (base) { munmap(const_cast<char *>(base), length); }
+    base = nullptr;
+    info = nullptr;
+    elements = nullptr;
+  }
+
+  /**
+   * throw runtime_error unless the mapped file is one we can read.
+   */
+  void check() const {
+    if (length < sizeof(header)) { failed(); }
+    const header &h = *info;
+    if (std::memcmp(h.magic, magic, sizeof(magic)) != 0 || h.version != version || h.order != order
+        || h.key_size != sizeof(Key) || h.element_size != sizeof(value_type) || h.fanout != fanout) {
+      failed();
+    }
+    if (h.count > length / sizeof(value_type)) { failed(); }
+    header expected = layout(h.count);
+    if (h.depth != expected.depth || h.elements != expected.elements
+        || expected.elements + h.count * sizeof(value_type) > length) {
+      failed();
+    }
+    for (unsigned l = 0; l < h.depth; ++l) {
+      if (h.levels[l] != expected.levels[l] || h.sizes[l] != expected.sizes[l]) { failed(); }
+    }
+  }
+
+ public:
+  class const_iterator {
+   private:
+    const value_type *pointer;
+    const mapped_map *p_map;
+    friend mapped_map;
+
+   public:
+    const_iterator(const value_type *p1 = nullptr, const mapped_map *p2 = nullptr) : pointer(p1), p_map(p2) {}
+
+    const_iterator operator++(int) {
+      const_iterator it(*this);
+      ++*this;
+      return it;
+    }
+
+    const_iterator &operator++() {
+      if (!p_map || pointer == p_map->elements + p_map->size()) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      ++pointer;
+      return *this;
+    }
+
+    const_iterator operator--(int) {
+      const_iterator it(*this);
+      --*this;
+      return it;
+    }
+
+    const_iterator &operator--() {
+      if (!p_map || pointer == p_map->elements) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      --pointer;
+      return *this;
+    }
+
+    const value_type &operator*() const {
+      return *pointer;
+    }
+
+    const value_type *operator->() const noexcept {
+      return pointer;
+    }
+
+    bool operator==(const const_iterator &rhs) const {
+      return pointer == rhs.pointer;
+    }
+
+    bool operator!=(const const_iterator &rhs) const {
+      return pointer != rhs.pointer;
+    }
+  };
+
+ private:
+  mapped_map() = default;
+
+  /**
+   * map the file fd read-only, and close it.
+   */
+  void map_descriptor(int fd) {
+    struct stat status;
+    if (fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(header)) {
+      close(fd);
+      failed();
+    }
+    length = status.st_size;
+    void *p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) { failed(); }
+    base = static_cast<const char *>(p);
+    info = reinterpret_cast<const header *>(base);
+    try {
+      check();
+    } catch (...) {
+      unmap();
+      throw;
+    }
+    elements = reinterpret_cast<const value_type *>(base + info->elements);
+  }
+
+ public:
+  /**
+   * map the file at path.
+   * throw runtime_error if it cannot be read or is not a mapped_map file.
+   */
+  explicit mapped_map(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { failed(); }
+    map_descriptor(fd);
+  }
+
+  /**
+   * map the shared memory object name, as publish left it.
+   * throw runtime_error if there is none or it is not complete.
+   */
+  static mapped_map attach(const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) { failed(); }
+    mapped_map mapped;
+    mapped.map_descriptor(fd);
+    return mapped;
+  }
+
+  mapped_map(const mapped_map &other) = delete;
+
+  mapped_map &operator=(const mapped_map &other) = delete;
+
+  mapped_map(mapped_map &&other) noexcept
+          : base(other.base), length(other.length), info(other.info), elements(other.elements) {
+    other.base = nullptr;
+    other.info = nullptr;
+    other.elements = nullptr;
+  }
+
+  ~mapped_map() {
+    unmap();
+  }
+
+  /**
+   * write the elements of source, a sorted map of Key and T by Compare
+   *   (a sjtu::map, say), to a file at path that mapped_map can open.
+   * the file is written next to path and renamed over it when complete.
+   * throw runtime_error if it cannot be written.
+   */
+  template<class Map>
+  static void write(const Map &source, const char *path) {
+    header h = layout(source.size());
+    std::string temporary = std::string(path) + ".tmp";
+    int fd = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { failed(); }
+    bool ok = build(source, h, fd);
+    ok = close(fd) == 0 && ok;
+    if (!ok || std::rename(temporary.c_str(), path) != 0) {
+      std::remove(temporary.c_str());
+      failed();
+    }
+  }
+
+  /**
+   * as write, to a new POSIX shared memory object name (such as "/lookup"),
+   *   which replaces any object of that name: maps attached to the old one
+   *   keep it until they are destroyed.
+   * throw runtime_error if it cannot be made.
+   */
+  template<class Map>
+  static void publish(const Map &source, const char *name) {
+    header h = layout(source.size());
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) { failed(); }
+    bool ok = build(source, h, fd);
+    close(fd);
+    if (!ok) {
+      shm_unlink(name);
+      failed();
+    }
+  }
+
+  /**
+   * remove the shared memory object name; its memory goes
+   *   once the last map attached to it is destroyed.
+   */
+  static void unpublish(const char *name) {
+    shm_unlink(name);
+  }
+
+  size_t size() const {
+    return info->count;
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  /**
+   * the size of the mapping, index and header included.
+   */
+  size_t bytes() const {
+    return length;
+  }
+
+  const_iterator cbegin() const {
+    return const_iterator(elements, this);
+  }
+
+  const_iterator cend() const {
+    return const_iterator(elements + size(), this);
+  }
+
+  /**
+   * the first element whose key is not less than key, or cend().
+   */
+  const_iterator lower_bound(const Key &key) const {
+    return const_iterator(elements + search(key), this);
+  }
+
+  /**
+   * return cend() if key does not exist.
+   */
+  const_iterator find(const Key &key) const {
+    size_t i = search(key);
+    Compare compare;
+    if (i == size() || compare(key, elements[i].first)) { return cend(); }
+    return const_iterator(elements + i, this);
+  }
+
+  size_t count(const Key &key) const {
+    return find(key) == cend() ? 0 : 1;
+  }
+
+  /**
+   * throw index_out_of_bound if key does not exist.
+   */
+  const T &at(const Key &key) const {
+    const_iterator it = find(key);
+    if (it == cend()) {
+      index_out_of_bound index_out_of_bound;
+      throw index_out_of_bound;
+    }
+    return it->second;
+  }
+
+  const T &operator[](const Key &key) const {
+    return at(key);
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,942 @@
+/**
+ * an ordered map kept on disk, a page at a time
+ */
+#ifndef SJTU_PAGED_MAP_HPP
+#define SJTU_PAGED_MAP_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "utility.hpp"
+#include "exceptions.hpp"
+
+namespace sjtu {
+
+/**
+ * a B+-tree in a file of page_size pages: the elements in the leaves,
+ *   in order and linked both ways, and the inner pages holding separator
+ *   keys only, so that a few levels cover a file of any size.
+ *   page 0 describes the tree, and freed pages are kept on a list in it
+ *   for reuse.
+ *
+ * pages are read into a buffer pool of a fixed number of frames and stay
+ *   there until evicted, CLOCK style: a frame used since the hand last
+ *   passed gets another round. a changed page is written back only when
+ *   evicted, or by flush(), which the destructor calls.
+ * an iterator keeps its leaf pinned, so a pool must have room for every
+ *   iterator alive plus a path from the root; it has at least min_pool
+ *   frames, and running out throws runtime_error.
+ * an iterator moving along the leaves asks the kernel to start reading
+ *   the next prefetch_leaves of them, which the parent of its leaf lists,
+ *   so that a scan finds them on its way; it asks again once it has
+ *   walked through them.
+ *
+ * any write invalidates every iterator. lookups return copies, and
+ *   values are written with assign.
+ * Key and T must be trivially copyable and default constructible,
+ *   and a file is only read back on a machine with the byte order and type
+ *   sizes of the one that wrote it, with the same Compare.
+ * a crash between flushes can leave the file inconsistent,
+ *   durable_map is for maps that must survive one.
+ */
+template<
+        class Key,
+        class T,
+        class Compare = std::less<Key>
+>
+class paged_map {
+  static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<T>::value,
+                "pages hold keys and values raw");
+
+ public:
+  typedef pair<const Key, T> value_type;
+
+  static constexpr size_t page_size = 4096;
+  static constexpr size_t min_pool = 16;
+
+  inline static unsigned prefetch_leaves = 8;
+
+ private:
+  typedef std::uint64_t page_id;
+
+  struct node_header {
+    std::uint32_t leaf;
+    std::uint32_t count;
+    page_id next;
+    page_id previous;
+  };
+
+  static constexpr size_t leaf_capacity = (page_size - sizeof(node_header)) / sizeof(value_type);
+  static constexpr size_t inner_capacity =
+          (page_size - sizeof(node_header) - 2 * sizeof(page_id)) / (sizeof(Key) + sizeof(page_id));
+  static constexpr size_t children_offset =
+          (sizeof(node_header) + inner_capacity * sizeof(Key) + sizeof(page_id) - 1) / sizeof(page_id) * sizeof(page_id);
+
+  static_assert(alignof(value_type) <= alignof(node_header) && alignof(Key) <= alignof(node_header),
+                "elements and keys follow the page header");
+  static_assert(leaf_capacity >= 4 && inner_capacity >= 4, "a page holds too few elements");
+
+  static constexpr size_t leaf_minimum = leaf_capacity / 2;
+  static constexpr size_t inner_minimum = inner_capacity / 2;
+
+  struct meta_page {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t page_size;
+    std::uint32_t key_size;
+    std::uint32_t value_size;
+    page_id root;
+    page_id first;
+    page_id last;
+    page_id pages;
+    page_id free;
+    std::uint64_t count;
+    std::uint32_t height;
+    std::uint32_t order;
+  };
+
+  inline static const char magic[8] = {'s', 'j', 't', 'u', 'p', 'a', 'g', 'e'};
+  static constexpr std::uint32_t version = 1;
+  static constexpr std::uint32_t order = 0x01020304;
+
+  struct frame {
+    page_id id = 0;
+    unsigned pins = 0;
+    bool dirty = false;
+    bool referenced = false;
+    char *data = nullptr;
+  };
+
+  /**
+   * a page held in its frame while the handle lives.
+   */
+  class pinned {
+    frame *f = nullptr;
+
+   public:
+    pinned() = default;
+
+    explicit pinned(frame *f) : f(f) {
+      ++f->pins;
+    }
+
+    pinned(const pinned &other) : f(other.f) {
+      if (f) { ++f->pins; }
+    }
+
+    pinned &operator=(const pinned &other) {
+      if (other.f) { ++other.f->pins; }
+      if (f) { --f->pins; }
+      f = other.f;
+      return *this;
+    }
+
+    ~pinned() {
+      if (f) { --f->pins; }
+    }
+
+    explicit operator bool() const {
+      return f != nullptr;
+    }
+
+    page_id id() const {
+      return f->id;
+    }
+
+    char *data() const {
+      return f->data;
+    }
+
+    node_header &header() const {
+      return *reinterpret_cast<node_header *>(f->data);
+    }
+
+    value_type *elements() const {
+      return reinterpret_cast<value_type *>(f->data + sizeof(node_header));
+    }
+
+    Key *keys() const {
+      return reinterpret_cast<Key *>(f->data + sizeof(node_header));
+    }
+
+    page_id *children() const {
+      return reinterpret_cast<page_id *>(f->data + children_offset);
+    }
+
+    /**
+     * the page changed, write it back before its frame is reused.
+     */
+    void touch() const {
+      f->dirty = true;
+    }
+  };
+
+  struct split_result {
+    bool split = false;
+    Key separator;
+    page_id right = 0;
+  };
+
+  int fd = -1;
+  meta_page info;
+  mutable std::vector<char> memory;
+  mutable std::vector<frame> frames;
+  mutable std::unordered_map<page_id, size_t> table;
+  mutable size_t hand = 0;
+  mutable size_t reads = 0;
+  mutable size_t writes = 0;
+
+  static void failed() {
+    runtime_error runtime_error;
+    throw runtime_error;
+  }
+
+  void read_page(page_id id, char *data) const {
+    size_t done = 0;
+    while (done < page_size) {
+      ssize_t got = pread(fd, data + done, page_size - done, id * page_size + done);
+      if (got < 0 && errno == EINTR) { continue; }
+      if (got <= 0) { failed(); }
+      done += got;
+    }
+    ++reads;
+  }
+
+  void write_page(page_id id, const char *data) const {
+    size_t done = 0;
+    while (done < page_size) {
+      ssize_t put = pwrite(fd, data + done, page_size - done, id * page_size + done);
+      if (put < 0 && errno == EINTR) { continue; }
+      if (put <= 0) { failed(); }
+      done += put;
+    }
+    ++writes;
+  }
+
+  /**
+   * a frame to reuse, its page written back if changed.
+   */
+  size_t victim() const {
+    for (size_t scanned = 0; scanned < 2 * frames.size(); ++scanned) {
+      size_t i = hand;
+      hand = (hand + 1) % frames.size();
+      frame &f = frames[i];
+      if (f.pins) { continue; }
+      if (f.referenced) {
+        f.referenced = false;
+        continue;
+      }
+      if (f.id) {
+        if (f.dirty) { write_page(f.id, f.data); }
+        table.erase(f.id);
+        f.id = 0;
+        f.dirty = false;
+      }
+      return i;
+    }
+    failed();
+    return 0;
+  }
+
+  /**
+   * page id, read in if it is not in the pool.
+   */
+  pinned fetch(page_id id) const {
+    typename std::unordered_map<page_id, size_t>::const_iterator it = table.find(id);
+    if (it != table.end()) {
+      frame &f = frames[it->second];
+      f.referenced = true;
+      return pinned(&f);
+    }
+    size_t i = victim();
+    frame &f = frames[i];
+    read_page(id, f.data);
+    f.id = id;
+    f.referenced = true;
+    table[id] = i;
+    return pinned(&f);
+  }
+
+  /**
+   * a frame for page id, not read: it is new.
+   */
+  pinned claim(page_id id) {
+    size_t i = victim();
+    frame &f = frames[i];
+    f.id = id;
+    f.referenced = true;
+    table[id] = i;
+    return pinned(&f);
+  }
+
+  pinned allocate(bool leaf) {
+    pinned p;
+    if (info.free) {
+      p = fetch(info.free);
+      std::memcpy(&info.free, p.data(), sizeof(page_id));
+    } else {
+      p = claim(info.pages++);
+    }
+    std::memset(p.data(), 0, page_size);
+    p.header().leaf = leaf;
+    p.touch();
+    return p;
+  }
+
+  void release(const pinned &p) {
+    std::memset(p.data(), 0, page_size);
+    std::memcpy(p.data(), &info.free, sizeof(page_id));
+    info.free = p.id();
+    p.touch();
+  }
+
+  /**
+   * ask the kernel to start reading page id, unless it is in the pool.
+   */
+  void advise(page_id id) const {
+    if (table.count(id)) { return; }
+    posix_fadvise(fd, id * page_size, page_size, POSIX_FADV_WILLNEED);
+  }
+
+  /**
+   * the child of inner page n whose subtree may hold key.
+   */
+  static size_t child_index(const pinned &n, const Key &key) {
+    Compare compare;
+    const Key *keys = n.keys();
+    size_t lo = 0;
+    size_t hi = n.header().count;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (compare(key, keys[mid])) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    return lo;
+  }
+
+  /**
+   * the first element of leaf n whose key is not less than key.
+   */
+  static size_t position(const pinned &n, const Key &key) {
+    Compare compare;
+    const value_type *elements = n.elements();
+    size_t lo = 0;
+    size_t hi = n.header().count;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (compare(elements[mid].first, key)) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  pinned leaf_for(const Key &key) const {
+    pinned n = fetch(info.root);
+    while (!n.header().leaf) { n = fetch(n.children()[child_index(n, key)]); }
+    return n;
+  }
+
+  /**
+   * advise the leaves after leaf that share its parent, prefetch_leaves
+   *   at most, return how many.
+   */
+  unsigned prefetch_after(const pinned &leaf) const {
+    if (!prefetch_leaves || !leaf.header().count) { return 0; }
+    const Key key = leaf.elements()[0].first;
+    pinned parent;
+    size_t index = 0;
+    pinned n = fetch(info.root);
+    while (!n.header().leaf) {
+      index = child_index(n, key);
+      parent = n;
+      n = fetch(n.children()[index]);
+    }
+    unsigned advised = 0;
+    for (size_t j = index + 1; parent && j <= parent.header().count && advised < prefetch_leaves; ++j, ++advised) {
+      advise(parent.children()[j]);
+    }
+    return advised;
+  }
+
+  /**
+   * put key and child at position p of inner page n, which has room.
+   */
+  static void inner_put(const pinned &n, size_t p, const Key &key, page_id child) {
+    node_header &h = n.header();
+    Key *keys = n.keys();
+    page_id *children = n.children();
+    std::memmove(keys + p + 1, keys + p, (h.count - p) * sizeof(Key));
+    std::memcpy(keys + p, &key, sizeof(Key));
+    std::memmove(children + p + 2, children + p + 1, (h.count - p) * sizeof(page_id));
+    children[p + 1] = child;
+    ++h.count;
+    n.touch();
+  }
+
+  bool insert_leaf(const pinned &leaf, const value_type &value, split_result &up, pinned &placed, size_t &slot) {
+    Compare compare;
+    size_t p = position(leaf, value.first);
+    node_header &h = leaf.header();
+    if (p < h.count && !compare(value.first, leaf.elements()[p].first)) {
+      placed = leaf;
+      slot = p;
+      return false;
+    }
+    pinned target = leaf;
+    pinned right;
+    if (h.count == leaf_capacity) {
+      right = allocate(true);
+      node_header &r = right.header();
+      size_t mid = leaf_capacity / 2;
+      std::memcpy(static_cast<void *>(right.elements()), leaf.elements() + mid, (h.count - mid) * sizeof(value_type));
+      r.count = h.count - mid;
+      h.count = mid;
+      r.next = h.next;
+      r.previous = leaf.id();
+      if (h.next) {
+        pinned next = fetch(h.next);
+        next.header().previous = right.id();
+        next.touch();
+      } else {
+        info.last = right.id();
+      }
+      h.next = right.id();
+      leaf.touch();
+      if (p > mid) {
+        target = right;
+        p -= mid;
+      }
+    }
+    node_header &t = target.header();
+    value_type *elements = target.elements();
+    std::memmove(static_cast<void *>(elements + p + 1), elements + p, (t.count - p) * sizeof(value_type));
+    new (elements + p) value_type(value.first, value.second);
+    ++t.count;
+    target.touch();
+    if (right) {
+      up.split = true;
+      up.separator = right.elements()[0].first;
+      up.right = right.id();
+    }
+    placed = target;
+    slot = p;
+    return true;
+  }
+
+  /**
+   * insert value under page id; if the page splits, up holds the new
+   *   page to its right and the key separating them.
+   */
+  bool insert_into(page_id id, const value_type &value, split_result &up, pinned &placed, size_t &slot) {
+    pinned n = fetch(id);
+    if (n.header().leaf) { return insert_leaf(n, value, up, placed, slot); }
+    size_t i = child_index(n, value.first);
+    split_result below;
+    bool inserted = insert_into(n.children()[i], value, below, placed, slot);
+    if (!below.split) { return inserted; }
+    node_header &h = n.header();
+    if (h.count < inner_capacity) {
+      inner_put(n, i, below.separator, below.right);
+      return inserted;
+    }
+    pinned right = allocate(false);
+    size_t m = inner_capacity / 2;
+    node_header &r = right.header();
+    r.count = h.count - m - 1;
+    std::memcpy(right.keys(), n.keys() + m + 1, r.count * sizeof(Key));
+    std::memcpy(right.children(), n.children() + m + 1, (r.count + 1) * sizeof(page_id));
+    std::memcpy(&up.separator, n.keys() + m, sizeof(Key));
+    h.count = m;
+    n.touch();
+    if (i <= m) {
+      inner_put(n, i, below.separator, below.right);
+    } else {
+      inner_put(right, i - m - 1, below.separator, below.right);
+    }
+    up.split = true;
+    up.right = right.id();
+    return inserted;
+  }
+
+  static size_t minimum(const pinned &n) {
+    return n.header().leaf ? leaf_minimum : inner_minimum;
+  }
+
+  /**
+   * move one element or key into child i of parent from its left sibling.
+   */
+  static void borrow_left(const pinned &parent, size_t i, const pinned &left, const pinned &child) {
+    node_header &l = left.header();
+    node_header &c = child.header();
+    Key *separators = parent.keys();
+    if (c.leaf) {
+      value_type *elements = child.elements();
+      std::memmove(static_cast<void *>(elements + 1), elements, c.count * sizeof(value_type));
+      std::memcpy(static_cast<void *>(elements), left.elements() + l.count - 1, sizeof(value_type));
+      std::memcpy(separators + i - 1, &elements[0].first, sizeof(Key));
+    } else {
+      Key *keys = child.keys();
+      page_id *children = child.children();
+      std::memmove(keys + 1, keys, c.count * sizeof(Key));
+      std::memmove(children + 1, children, (c.count + 1) * sizeof(page_id));
+      std::memcpy(keys, separators + i - 1, sizeof(Key));
+      children[0] = left.children()[l.count];
+      std::memcpy(separators + i - 1, left.keys() + l.count - 1, sizeof(Key));
+    }
+    --l.count;
+    ++c.count;
+    parent.touch();
+    left.touch();
+    child.touch();
+  }
+
+  /**
+   * move one element or key into child i of parent from its right sibling.
+   */
+  static void borrow_right(const pinned &parent, size_t i, const pinned &child, const pinned &right) {
+    node_header &c = child.header();
+    node_header &r = right.header();
+    Key *separators = parent.keys();
+    if (c.leaf) {
+      value_type *elements = right.elements();
+      std::memcpy(static_cast<void *>(child.elements() + c.count), elements, sizeof(value_type));
+      std::memmove(static_cast<void *>(elements), elements + 1, (r.count - 1) * sizeof(value_type));
+      std::memcpy(separators + i, &elements[0].first, sizeof(Key));
+    } else {
+      std::memcpy(child.keys() + c.count, separators + i, sizeof(Key));
+      child.children()[c.count + 1] = right.children()[0];
+      std::memcpy(separators + i, right.keys(), sizeof(Key));
+      std::memmove(right.keys(), right.keys() + 1, (r.count - 1) * sizeof(Key));
+      std::memmove(right.children(), right.children() + 1, r.count * sizeof(page_id));
+    }
+    ++c.count;
+    --r.count;
+    parent.touch();
+    child.touch();
+    right.touch();
+  }
+
+  /**
+   * move everything in b, child i + 1 of parent, into a, child i, and free b.
+   */
+  void merge(const pinned &parent, size_t i, const pinned &a, const pinned &b) {
+    node_header &x = a.header();
+    node_header &y = b.header();
+    if (x.leaf) {
+      std::memcpy(static_cast<void *>(a.elements() + x.count), b.elements(), y.count * sizeof(value_type));
+      x.count += y.count;
+      x.next = y.next;
+      if (y.next) {
+        pinned next = fetch(y.next);
+        next.header().previous = a.id();
+        next.touch();
+      } else {
+        info.last = a.id();
+      }
+    } else {
+      std::memcpy(a.keys() + x.count, parent.keys() + i, sizeof(Key));
+      std::memcpy(a.keys() + x.count + 1, b.keys(), y.count * sizeof(Key));
+      std::memcpy(a.children() + x.count + 1, b.children(), (y.count + 1) * sizeof(page_id));
+      x.count += y.count + 1;
+    }
+    a.touch();
+    release(b);
+    node_header &h = parent.header();
+    std::memmove(parent.keys() + i, parent.keys() + i + 1, (h.count - i - 1) * sizeof(Key));
+    std::memmove(parent.children() + i + 1, parent.children() + i + 2, (h.count - i - 1) * sizeof(page_id));
+    --h.count;
+    parent.touch();
+  }
+
+  /**
+   * child i of parent has too few elements or keys: borrow one from
+   *   a sibling that can spare it, or merge with a sibling.
+   */
+  void rebalance(const pinned &parent, size_t i, const pinned &child) {
+    pinned left, right;
+    if (i > 0) {
+      left = fetch(parent.children()[i - 1]);
+      if (left.header().count > minimum(left)) {
+        borrow_left(parent, i, left, child);
+        return;
+      }
+    }
+    if (i < parent.header().count) {
+      right = fetch(parent.children()[i + 1]);
+      if (right.header().count > minimum(right)) {
+        borrow_right(parent, i, child, right);
+        return;
+      }
+    }
+    if (left) {
+      merge(parent, i - 1, left, child);
+    } else {
+      merge(parent, i, child, right);
+    }
+  }
+
+  bool erase_from(const pinned &n, const Key &key) {
+    Compare compare;
+    node_header &h = n.header();
+    if (h.leaf) {
+      size_t p = position(n, key);
+      if (p == h.count || compare(key, n.elements()[p].first)) { return false; }
+      value_type *elements = n.elements();
+      std::memmove(static_cast<void *>(elements + p), elements + p + 1, (h.count - p - 1) * sizeof(value_type));
+      --h.count;
+      n.touch();
+      return true;
+    }
+    size_t i = child_index(n, key);
+    pinned child = fetch(n.children()[i]);
+    if (!erase_from(child, key)) { return false; }
+    if (child.header().count < minimum(child)) { rebalance(n, i, child); }
+    return true;
+  }
+
+ public:
+  class const_iterator {
+   private:
+    const paged_map *p_map = nullptr;
+    pinned leaf;
+    size_t index = 0;
+    unsigned ahead = 0;
+    friend paged_map;
+
+    /**
+     * past the last element of a leaf is the first of the next.
+     */
+    void settle() {
+      while (leaf && index == leaf.header().count) {
+        page_id next = leaf.header().next;
+        if (!next) {
+          leaf = pinned();
+          index = 0;
+          return;
+        }
+        leaf = p_map->fetch(next);
+        index = 0;
+        if (ahead) {
+          --ahead;
+        } else {
+          ahead = p_map->prefetch_after(leaf);
+        }
+      }
+    }
+
+   public:
+    const_iterator() = default;
+
+    const_iterator(const paged_map *p_map, const pinned &leaf, size_t index) : p_map(p_map), leaf(leaf), index(index) {
+      settle();
+    }
+
+    const_iterator operator++(int) {
+      const_iterator it(*this);
+      ++*this;
+      return it;
+    }
+
+    const_iterator &operator++() {
+      if (!leaf) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      ++index;
+      settle();
+      return *this;
+    }
+
+    const_iterator operator--(int) {
+      const_iterator it(*this);
+      --*this;
+      return it;
+    }
+
+    const_iterator &operator--() {
+      if (!p_map) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      if (!leaf) {
+        if (p_map->empty()) {
+          invalid_iterator invalid_iterator;
+          throw invalid_iterator;
+        }
+        leaf = p_map->fetch(p_map->info.last);
+        index = leaf.header().count - 1;
+      } else if (index > 0) {
+        --index;
+      } else {
+        page_id previous = leaf.header().previous;
+        if (!previous) {
+          invalid_iterator invalid_iterator;
+          throw invalid_iterator;
+        }
+        leaf = p_map->fetch(previous);
+        index = leaf.header().count - 1;
+      }
+      return *this;
+    }
+
+    /**
+     * valid until the iterator moves or the map is written.
+     */
+    const value_type &operator*() const {
+      if (!leaf) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      return leaf.elements()[index];
+    }
+
+    const value_type *operator->() const {
+      return &**this;
+    }
+
+    bool operator==(const const_iterator &rhs) const {
+      return (leaf ? leaf.id() : 0) == (rhs.leaf ? rhs.leaf.id() : 0) && index == rhs.index;
+    }
+
+    bool operator!=(const const_iterator &rhs) const {
+      return !(*this == rhs);
+    }
+  };
+
+  /**
+   * open the map in the file at path, making it if there is none,
+   *   with a pool of pool_pages frames (min_pool at least).
+   * throw runtime_error if the file cannot be used or holds something else.
+   */
+  explicit paged_map(const char *path, size_t pool_pages = 1024) {
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) { failed(); }
+    try {
+      pool_pages = std::max(pool_pages, min_pool);
+      memory.resize(pool_pages * page_size);
+      frames.resize(pool_pages);
+      for (size_t i = 0; i < pool_pages; ++i) { frames[i].data = memory.data() + i * page_size; }
+      struct stat status;
+      if (fstat(fd, &status) != 0) { failed(); }
+      if (status.st_size == 0) {
+        std::memset(&info, 0, sizeof(info));
+        std::memcpy(info.magic, magic, sizeof(magic));
+        info.version = version;
+        info.page_size = page_size;
+        info.key_size = sizeof(Key);
+        info.value_size = sizeof(T);
+        info.order = order;
+        info.pages = 1;
+        info.height = 1;
+        pinned root = allocate(true);
+        info.root = info.first = info.last = root.id();
+      } else {
+        std::vector<char> page(page_size);
+        read_page(0, page.data());
+        std::memcpy(&info, page.data(), sizeof(info));
+        if (std::memcmp(info.magic, magic, sizeof(magic)) != 0 || info.version != version
+            || info.page_size != page_size || info.key_size != sizeof(Key) || info.value_size != sizeof(T)
+            || info.order != order || (std::uint64_t)status.st_size < info.pages * page_size) {
+          failed();
+        }
+      }
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+  }
+
+  paged_map(const paged_map &other) = delete;
+
+  paged_map &operator=(const paged_map &other) = delete;
+
+  /**
+   * flush, ignoring errors: call flush() first to see them.
+   */
+  ~paged_map() {
+    try {
+      flush();
+    } catch (...) {}
+    close(fd);
+  }
+
+  /**
+   * write back every changed page and the description of the tree,
+   *   and wait for the disk.
+   */
+  void flush() {
+    for (frame &f : frames) {
+      if (f.id && f.dirty) {
+        write_page(f.id, f.data);
+        f.dirty = false;
+      }
+    }
+    std::vector<char> page(page_size);
+    std::memcpy(page.data(), &info, sizeof(info));
+    write_page(0, page.data());
+    if (fdatasync(fd) != 0) { failed(); }
+  }
+
+  size_t size() const {
+    return info.count;
+  }
+
+  bool empty() const {
+    return info.count == 0;
+  }
+
+  /**
+   * pages read from and written to the file so far.
+   */
+  size_t page_reads() const {
+    return reads;
+  }
+
+  size_t page_writes() const {
+    return writes;
+  }
+
+  const_iterator cbegin() const {
+    pinned first = fetch(info.first);
+    const_iterator it(this, first, 0);
+    it.ahead = prefetch_after(first);
+    return it;
+  }
+
+  const_iterator cend() const {
+    const_iterator it;
+    it.p_map = this;
+    return it;
+  }
+
+  /**
+   * the first element whose key is not less than key, or cend().
+   */
+  const_iterator lower_bound(const Key &key) const {
+    pinned leaf = leaf_for(key);
+    return const_iterator(this, leaf, position(leaf, key));
+  }
+
+  /**
+   * return cend() if key does not exist.
+   */
+  const_iterator find(const Key &key) const {
+    Compare compare;
+    pinned leaf = leaf_for(key);
+    size_t p = position(leaf, key);
+    if (p == leaf.header().count || compare(key, leaf.elements()[p].first)) { return cend(); }
+    return const_iterator(this, leaf, p);
+  }
+
+  size_t count(const Key &key) const {
+    Compare compare;
+    pinned leaf = leaf_for(key);
+    size_t p = position(leaf, key);
+    return p < leaf.header().count && !compare(key, leaf.elements()[p].first);
+  }
+
+  /**
+   * throw index_out_of_bound if key does not exist.
+   */
+  T at(const Key &key) const {
+    Compare compare;
+    pinned leaf = leaf_for(key);
+    size_t p = position(leaf, key);
+    if (p == leaf.header().count || compare(key, leaf.elements()[p].first)) {
+      index_out_of_bound index_out_of_bound;
+      throw index_out_of_bound;
+    }
+    return leaf.elements()[p].second;
+  }
+
+  T operator[](const Key &key) const {
+    return at(key);
+  }
+
+  /**
+   * as map::insert: the iterator points to the element of that key,
+   *   the bool tells whether it is new.
+   */
+  pair<const_iterator, bool> insert(const value_type &value) {
+    split_result up;
+    pinned placed;
+    size_t slot = 0;
+    page_id root = info.root;
+    bool inserted = insert_into(root, value, up, placed, slot);
+    if (up.split) {
+      pinned top = allocate(false);
+      top.header().count = 1;
+      std::memcpy(top.keys(), &up.separator, sizeof(Key));
+      top.children()[0] = root;
+      top.children()[1] = up.right;
+      info.root = top.id();
+      ++info.height;
+    }
+    if (inserted) { ++info.count; }
+    return pair<const_iterator, bool>(const_iterator(this, placed, slot), inserted);
+  }
+
+  /**
+   * insert key or overwrite its value.
+   */
+  void assign(const Key &key, const T &value) {
+    Compare compare;
+    pinned leaf = leaf_for(key);
+    size_t p = position(leaf, key);
+    if (p < leaf.header().count && !compare(key, leaf.elements()[p].first)) {
+      leaf.elements()[p].second = value;
+      leaf.touch();
+      return;
+    }
+    insert(value_type(key, value));
+  }
+
+  /**
+   * return the number of erased elements, 0 or 1.
+   * a page left less than half full takes from a sibling or merges with it,
+   *   and a merged page goes on the free list.
+   */
+  size_t erase(const Key &key) {
+    pinned root = fetch(info.root);
+    if (!erase_from(root, key)) { return 0; }
+    --info.count;
+    if (!root.header().leaf && root.header().count == 0) {
+      info.root = root.children()[0];
+      release(root);
+      --info.height;
+    }
+    return 1;
+  }
+
+  /**
+   * throw invalid_iterator if pos is end() or not from this map.
+   */
+  void erase(const_iterator pos) {
+    if (pos.p_map != this || !pos.leaf) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+    Key key = pos->first;
+    pos = const_iterator();
+    erase(key);
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,388 @@
+/**
+ * a thread-safe sjtu::map cut into key ranges
+ */
+#ifndef SJTU_SHARDED_MAP_HPP
+#define SJTU_SHARDED_MAP_HPP
+
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+#include "map.hpp"
+
+namespace sjtu {
+
+/**
+ * the key space is cut into ranges, each held by a shard:
+ *   a map of its own under a reader-writer lock of its own,
+ *   so writers to different ranges never wait for each other.
+ *
+ * a shard that grows past max_shard_size is split at its median key,
+ *   one that shrinks below a quarter of it is merged into a neighbour
+ *   if both fit in half; both take O(log n) with split and concatenate.
+ * when the neighbours are too big, the shard looks again once it has
+ *   halved, and each neighbour once the two would fit.
+ *
+ * which shard holds a key is looked up in a directory that only
+ *   rebalancing changes. it is guarded by one reader-writer lock per slot
+ *   of threads (a thread shares the one its id hashes to, rebalancing takes
+ *   them all), so the directory lock is no cache line every operation writes to.
+ *
+ * as with concurrent_map, nothing that points into a shard leaves its lock;
+ *   whole-map reads (scan, for_each, size) see each shard at a different
+ *   moment, but always go in key order.
+ */
+template<
+        class Key,
+        class T,
+        class Compare = std::less<Key>,
+        class Balance = avl_balance,
+        bool Checked = true
+>
+class sharded_map {
+ public:
+  typedef map<Key, T, Compare, Balance, Checked> base;
+  typedef typename base::value_type value_type;
+
+  inline static size_t max_shard_size = 1 << 16;
+
+ private:
+  struct shard {
+    alignas(64) mutable std::shared_mutex lock;
+    base content;
+    /**
+     * a merge is looked for once the shard is smaller than this.
+     */
+    size_t merge_below = max_shard_size / 4;
+
+    shard() {}
+
+    explicit shard(base &&content) : content(std::move(content)) {}
+  };
+
+  struct alignas(64) slot {
+    std::shared_mutex lock;
+  };
+
+  static constexpr unsigned directory_slots = 64;
+
+  slot *slots;
+  /**
+   * shards in key order, shards[i + 1] holding the keys from bounds[i]
+   *   up to bounds[i + 1].
+   */
+  std::vector<shard *> shards;
+  std::vector<Key> bounds;
+
+  unsigned my_slot() const {
+    static thread_local unsigned mine = std::hash<std::thread::id>()(std::this_thread::get_id()) % directory_slots;
+    return mine;
+  }
+
+  /**
+   * keeps the directory from changing while held.
+   */
+  struct reading {
+    std::shared_mutex &lock;
+
+    explicit reading(const sharded_map *owner) : lock(owner->slots[owner->my_slot()].lock) {
+      lock.lock_shared();
+    }
+
+    ~reading() {
+      lock.unlock_shared();
+    }
+  };
+
+  /**
+   * keeps everybody else out of the directory while held.
+   */
+  struct rebuilding {
+    slot *slots;
+
+    explicit rebuilding(slot *slots) : slots(slots) {
+      for (unsigned i = 0; i < directory_slots; ++i) { slots[i].lock.lock(); }
+    }
+
+    ~rebuilding() {
+      for (unsigned i = 0; i < directory_slots; ++i) { slots[i].lock.unlock(); }
+    }
+  };
+
+  /**
+   * the index of the only shard that may hold key.
+   */
+  size_t position(const Key &key) const {
+    Compare compare;
+    size_t lo = 0, hi = bounds.size();
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (compare(key, bounds[mid])) { hi = mid; }
+      else { lo = mid + 1; }
+    }
+    return lo;
+  }
+
+  shard *locate(const Key &key) const {
+    return shards[position(key)];
+  }
+
+  /**
+   * a shard is worth a look when it is too big, and when it shrank below
+   *   its merge_below, not at every erase from a small shard.
+   */
+  bool unbalanced(const shard *s) const {
+    size_t n = s->content.size();
+    return n > max_shard_size || (n < s->merge_below && shards.size() > 1);
+  }
+
+  /**
+   * with every directory slot held: split the shard holding key
+   *   if it is still too big, or merge it with its smaller neighbour
+   *   that it fits together with, if either of the two is below a quarter.
+   * a shard too small to stay alone that found no such neighbour
+   *   looks again at half its size, and has its neighbours look again
+   *   once they shrink enough to take it.
+   */
+  void rebalance(const Key &key) {
+    rebuilding rebuilding(slots);
+    size_t i = position(key);
+    shard *s = shards[i];
+    size_t n = s->content.size();
+    if (n > max_shard_size) {
+      s->merge_below = max_shard_size / 4;
+      Key median = s->content.nth(n / 2)->first;
+      base upper = s->content.split(median);
+      try {
+        bounds.insert(bounds.begin() + i, median);
+        try {
+          shards.insert(shards.begin() + i + 1, new shard(std::move(upper)));
+        } catch (...) {
+          bounds.erase(bounds.begin() + i);
+          throw;
+        }
+      } catch (...) {
+        s->content.concatenate(std::move(upper));
+        throw;
+      }
+    } else if (shards.size() > 1) {
+      size_t quarter = max_shard_size / 4;
+      size_t partner = i;
+      for (size_t j : {i - 1, i + 1}) {
+        if (j >= shards.size()) { continue; }
+        size_t m = shards[j]->content.size();
+        if ((n < quarter || m < quarter) && n + m < max_shard_size / 2
+            && (partner == i || m < shards[partner]->content.size())) {
+          partner = j;
+        }
+      }
+      if (partner != i) {
+        size_t upper = partner > i ? partner : i;
+        shards[upper - 1]->content.concatenate(std::move(shards[upper]->content));
+        shards[upper - 1]->merge_below = quarter;
+        delete shards[upper];
+        shards.erase(shards.begin() + upper);
+        bounds.erase(bounds.begin() + upper - 1);
+      } else if (n < quarter) {
+        s->merge_below = n / 2;
+        for (size_t j : {i - 1, i + 1}) {
+          if (j < shards.size() && shards[j]->merge_below < max_shard_size / 2 - n) {
+            shards[j]->merge_below = max_shard_size / 2 - n;
+          }
+        }
+      } else {
+        s->merge_below = quarter;
+      }
+    }
+  }
+
+  /**
+   * call fn(map) for the shard of key, shared with other readers.
+   */
+  template<class Fn>
+  auto read(const Key &key, Fn fn) const {
+    reading reading(this);
+    const shard *s = locate(key);
+    std::shared_lock<std::shared_mutex> lock(s->lock);
+    return fn(static_cast<const base &>(s->content));
+  }
+
+  /**
+   * call fn(map) for the shard of key to ourselves,
+   *   then rebalance if that left the shard too big or too small.
+   */
+  template<class Fn>
+  auto write(const Key &key, Fn fn) {
+    bool rebalancing;
+    auto result = [&]() {
+      reading reading(this);
+      shard *s = locate(key);
+      std::unique_lock<std::shared_mutex> lock(s->lock);
+      auto result = fn(s->content);
+      rebalancing = unbalanced(s);
+      return result;
+    }();
+    if (rebalancing) { rebalance(key); }
+    return result;
+  }
+
+ public:
+  sharded_map() : slots(new slot[directory_slots]) {
+    try {
+      shards.push_back(new shard);
+    } catch (...) {
+      delete[] slots;
+      throw;
+    }
+  }
+
+  sharded_map(const sharded_map &other) = delete;
+
+  sharded_map &operator=(const sharded_map &other) = delete;
+
+  ~sharded_map() {
+    for (shard *s : shards) { delete s; }
+    delete[] slots;
+  }
+
+  /**
+   * the number of shards the keys are cut into now.
+   */
+  size_t shard_count() const {
+    reading reading(this);
+    return shards.size();
+  }
+
+  /**
+   * throw index_out_of_bound if key does not exist.
+   */
+  T at(const Key &key) const {
+    return read(key, [&key](const base &map) { return map.at(key); });
+  }
+
+  T operator[](const Key &key) const {
+    return at(key);
+  }
+
+  /**
+   * copy the value of key into value, return false if key does not exist.
+   */
+  bool find(const Key &key, T &value) const {
+    return read(key, [&](const base &map) {
+      typename base::const_iterator it = map.find(key);
+      if (it == map.cend()) { return false; }
+      value = it->second;
+      return true;
+    });
+  }
+
+  size_t count(const Key &key) const {
+    return read(key, [&key](const base &map) { return map.count(key); });
+  }
+
+  size_t size() const {
+    reading reading(this);
+    size_t n = 0;
+    for (const shard *s : shards) {
+      std::shared_lock<std::shared_mutex> lock(s->lock);
+      n += s->content.size();
+    }
+    return n;
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  /**
+   * as map::scan, with the values read-only, one shard at a time.
+   * every shard is handed the one visitor, so its state carries over,
+   *   and a false from it ends the whole scan.
+   */
+  template<class Visitor>
+  size_t scan(const Key &lo, const Key &hi, Visitor visitor) const {
+    Compare compare;
+    reading reading(this);
+    size_t total = 0;
+    bool stopped = false;
+    auto forward = [&visitor, &stopped](auto batch, size_t n) {
+      if constexpr (std::is_same<decltype(visitor(batch, n)), bool>::value) {
+        stopped = !visitor(batch, n);
+      } else {
+        visitor(batch, n);
+      }
+      return !stopped;
+    };
+    for (size_t i = position(lo); i < shards.size() && !stopped; ++i) {
+      if (i && !compare(bounds[i - 1], hi)) { break; }
+      std::shared_lock<std::shared_mutex> lock(shards[i]->lock);
+      total += static_cast<const base &>(shards[i]->content).scan(lo, hi, forward);
+    }
+    return total;
+  }
+
+  /**
+   * call fn(value) for every element in key order.
+   */
+  template<class Fn>
+  void for_each(Fn fn) const {
+    reading reading(this);
+    for (const shard *s : shards) {
+      std::shared_lock<std::shared_mutex> lock(s->lock);
+      for (typename base::const_iterator it = s->content.cbegin(); it != s->content.cend(); ++it) { fn(*it); }
+    }
+  }
+
+  void clear() {
+    rebuilding rebuilding(slots);
+    for (size_t i = 1; i < shards.size(); ++i) { delete shards[i]; }
+    shards.resize(1);
+    bounds.clear();
+    shards[0]->content.clear();
+    shards[0]->merge_below = max_shard_size / 4;
+  }
+
+  /**
+   * return false if the key already exists, leaving it alone.
+   */
+  bool insert(const value_type &value) {
+    return write(value.first, [&value](base &map) { return map.insert(value).second; });
+  }
+
+  /**
+   * insert key or overwrite its value.
+   */
+  void assign(const Key &key, const T &value) {
+    write(key, [&](base &map) {
+      map[key] = value;
+      return 0;
+    });
+  }
+
+  /**
+   * call fn(value) on the value of key, default-constructing it first
+   *   if key does not exist.
+   */
+  template<class Fn>
+  void update(const Key &key, Fn fn) {
+    write(key, [&](base &map) {
+      fn(map[key]);
+      return 0;
+    });
+  }
+
+  /**
+   * return the number of erased elements, 0 or 1.
+   */
+  size_t erase(const Key &key) {
+    return write(key, [&key](base &map) -> size_t {
+      typename base::iterator it = map.find(key);
+      if (it == map.end()) { return 0; }
+      map.erase(it);
+      return 1;
+    });
+  }
+};
+
+}
+
+#endif
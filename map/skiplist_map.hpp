@@ -0,0 +1,661 @@
+/**
+ * a lock-free ordered map with the interface of sjtu::map
+ */
+#ifndef SJTU_SKIPLIST_MAP_HPP
+#define SJTU_SKIPLIST_MAP_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include "utility.hpp"
+#include "exceptions.hpp"
+#include "epoch.hpp"
+
+namespace sjtu {
+
+/**
+ * any number of threads may insert, erase, look up and iterate at once,
+ *   and none of them ever waits for another: every change is a compare
+ *   and swap on one link.
+ *
+ * a node has a tower of links, one per level, its height drawn at random
+ *   (a quarter of the nodes reach each level above the one below).
+ *   an erase marks the links of the node, top down, in their low bit;
+ *   marking the bottom one is the moment the element is gone. whoever walks
+ *   past a marked node then unlinks it on that level.
+ * the thread that erased a node and the one that inserted it (which may
+ *   still be linking its upper levels) meet on the node's state: the last
+ *   one of them to finish unlinks it from every level and retires it
+ *   to the map's epoch_domain.
+ *
+ * lookups and iterators pin the epoch while they look at a node, so
+ *   nothing they can reach is freed under them: an iterator keeps its
+ *   thread pinned for as long as it lives, and must be destroyed by the
+ *   thread that made (or copied) it. a long-lived iterator only delays
+ *   reclamation, it never blocks a writer.
+ * references returned by at and operator[] are valid until the element
+ *   is erased, as with sjtu::map; with other threads erasing, keep
+ *   an iterator instead.
+ *
+ * --it looks its predecessor up again, in O(log n).
+ * size is a sum of counters striped by thread, exact once writers are done.
+ * clear erases the elements one by one, and copying or assigning
+ *   a skiplist_map that is being changed by others is not atomic.
+ */
+template<
+        class Key,
+        class T,
+        class Compare = std::less<Key>
+>
+class skiplist_map {
+ public:
+  typedef pair<const Key, T> value_type;
+
+  static constexpr int max_level = 32;
+
+ private:
+  /**
+   * a node is allocated with height links in next, the head with max_level
+   *   and no data.
+   */
+  struct node {
+    value_type data;
+    int height;
+    std::atomic<int> state;
+    std::atomic<uintptr_t> next[1];
+
+    node(const value_type &data, int height) : data(data), height(height), state(0), next{0} {}
+  };
+
+  /**
+   * the two parties to a node's end.
+   */
+  static constexpr int linked = 1;
+  static constexpr int erased = 2;
+
+  struct alignas(64) counter {
+    std::atomic<long long> count{0};
+  };
+
+  static constexpr unsigned counter_slots = 64;
+
+  mutable epoch_domain epochs;
+  node *head;
+  counter *counters;
+  alignas(64) std::atomic<int> levels{1};
+
+  static node *pointer_of(uintptr_t link) {
+    return reinterpret_cast<node *>(link & ~uintptr_t(1));
+  }
+
+  static bool marked(uintptr_t link) {
+    return link & 1;
+  }
+
+  static uintptr_t link_to(const node *p) {
+    return reinterpret_cast<uintptr_t>(p);
+  }
+
+  static size_t bytes(int height) {
+    return sizeof(node) + (height - 1) * sizeof(std::atomic<uintptr_t>);
+  }
+
+  static node *make_head() {
+    node *p = static_cast<node *>(operator new(bytes(max_level)));
+    p->height = max_level;
+    new(&p->state) std::atomic<int>(linked);
+    for (int i = 0; i < max_level; ++i) { new(&p->next[i]) std::atomic<uintptr_t>(0); }
+    return p;
+  }
+
+  static node *make_node(const value_type &value, int height) {
+    void *raw = operator new(bytes(height));
+    node *p;
+    try {
+      p = new(raw) node(value, height);
+    } catch (...) {
+      operator delete(raw);
+      throw;
+    }
+    for (int i = 1; i < height; ++i) { new(&p->next[i]) std::atomic<uintptr_t>(0); }
+    return p;
+  }
+
+  static void free_node(void *p) {
+    static_cast<node *>(p)->~node();
+    operator delete(p);
+  }
+
+  /**
+   * 1 + the number of times two random bits are both 0.
+   */
+  static int random_height() {
+    static thread_local unsigned long long seed = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    unsigned long long bits = seed;
+    int height = 1;
+    while (height < max_level && (bits & 3) == 0) {
+      ++height;
+      bits >>= 2;
+    }
+    return height;
+  }
+
+  counter &my_counter() const {
+    static thread_local unsigned mine = std::hash<std::thread::id>()(std::this_thread::get_id()) % counter_slots;
+    return counters[mine];
+  }
+
+  /**
+   * fill preds and succs with the nodes around key on every level,
+   *   unlinking the marked nodes met on the way;
+   *   return false if a link changed under us.
+   */
+  bool search_once(const Key &key, node **preds, node **succs) {
+    Compare compare;
+    node *pred = head;
+    for (int level = levels.load() - 1; level >= 0; --level) {
+      node *curr = pointer_of(pred->next[level].load(std::memory_order_acquire));
+      while (curr) {
+        uintptr_t succ = curr->next[level].load(std::memory_order_acquire);
+        if (marked(succ)) {
+          uintptr_t expected = link_to(curr);
+          if (!pred->next[level].compare_exchange_strong(expected, succ & ~uintptr_t(1))) { return false; }
+          curr = pointer_of(succ);
+        } else if (compare(curr->data.first, key)) {
+          pred = curr;
+          curr = pointer_of(succ);
+        } else {
+          break;
+        }
+      }
+      preds[level] = pred;
+      succs[level] = curr;
+    }
+    return true;
+  }
+
+  /**
+   * as search_once, until it gets through; return whether succs[0] holds key.
+   */
+  bool search(const Key &key, node **preds, node **succs) {
+    while (!search_once(key, preds, succs)) {}
+    return succs[0] && !Compare()(key, succs[0]->data.first);
+  }
+
+  /**
+   * unlink every marked node holding key, on every level;
+   *   return false if a link changed under us.
+   * nodes with equal keys need not lie in the same order on every level,
+   *   so each level walks the whole run of them.
+   */
+  bool sweep_once(const Key &key) {
+    Compare compare;
+    node *pred = head;
+    for (int level = levels.load() - 1; level >= 0; --level) {
+      node *curr = pointer_of(pred->next[level].load(std::memory_order_acquire));
+      while (curr) {
+        uintptr_t succ = curr->next[level].load(std::memory_order_acquire);
+        if (marked(succ)) {
+          uintptr_t expected = link_to(curr);
+          if (!pred->next[level].compare_exchange_strong(expected, succ & ~uintptr_t(1))) { return false; }
+          curr = pointer_of(succ);
+        } else if (compare(curr->data.first, key)) {
+          pred = curr;
+          curr = pointer_of(succ);
+        } else {
+          break;
+        }
+      }
+      node *before = pred;
+      while (curr && !compare(key, curr->data.first)) {
+        uintptr_t succ = curr->next[level].load(std::memory_order_acquire);
+        if (marked(succ)) {
+          uintptr_t expected = link_to(curr);
+          if (!before->next[level].compare_exchange_strong(expected, succ & ~uintptr_t(1))) { return false; }
+        } else {
+          before = curr;
+        }
+        curr = pointer_of(succ);
+      }
+    }
+    return true;
+  }
+
+  /**
+   * the last one done with p takes it off every level and retires it.
+   */
+  void finish(node *p, int party) {
+    if (!(p->state.fetch_or(party) & (linked | erased) & ~party)) { return; }
+    while (!sweep_once(p->data.first)) {}
+    epochs.retire(p, free_node);
+  }
+
+  /**
+   * link value in, unless its key is there;
+   *   return the node holding the key and whether it is new.
+   * the caller is pinned.
+   */
+  pair<node *, bool> add(const value_type &value) {
+    node *preds[max_level];
+    node *succs[max_level];
+    int height = random_height();
+    for (int top = levels.load(); top < height && !levels.compare_exchange_weak(top, height);) {}
+    if (search(value.first, preds, succs)) { return pair<node *, bool>(succs[0], false); }
+    node *p = make_node(value, height);
+    for (;;) {
+      for (int i = 0; i < height; ++i) { p->next[i].store(link_to(succs[i]), std::memory_order_relaxed); }
+      uintptr_t expected = link_to(succs[0]);
+      if (preds[0]->next[0].compare_exchange_strong(expected, link_to(p))) { break; }
+      if (search(value.first, preds, succs)) {
+        free_node(p);
+        return pair<node *, bool>(succs[0], false);
+      }
+    }
+    my_counter().count.fetch_add(1, std::memory_order_relaxed);
+    for (int level = 1; level < height; ++level) {
+      for (;;) {
+        uintptr_t old = p->next[level].load();
+        if (marked(old)) { goto done; }
+        if (old != link_to(succs[level])
+            && !p->next[level].compare_exchange_strong(old, link_to(succs[level]))) { goto done; }
+        uintptr_t expected = link_to(succs[level]);
+        if (preds[level]->next[level].compare_exchange_strong(expected, link_to(p))) { break; }
+        search(value.first, preds, succs);
+        if (succs[0] != p) { goto done; }
+      }
+    }
+   done:
+    finish(p, linked);
+    return pair<node *, bool>(p, true);
+  }
+
+  /**
+   * mark p erased, return false if somebody else did first.
+   * the caller is pinned.
+   */
+  bool remove(node *p) {
+    for (int level = p->height - 1; level > 0; --level) {
+      uintptr_t link = p->next[level].load();
+      while (!marked(link) && !p->next[level].compare_exchange_weak(link, link | 1)) {}
+    }
+    uintptr_t link = p->next[0].load();
+    do {
+      if (marked(link)) { return false; }
+    } while (!p->next[0].compare_exchange_weak(link, link | 1));
+    my_counter().count.fetch_sub(1, std::memory_order_relaxed);
+    finish(p, erased);
+    return true;
+  }
+
+  /**
+   * the node holding key and not erased, or nullptr.
+   *   marked nodes are stepped over, not unlinked, so lookups only read.
+   * the caller is pinned.
+   */
+  node *lookup(const Key &key) const {
+    Compare compare;
+    node *pred = head;
+    node *curr = nullptr;
+    for (int level = levels.load() - 1; level >= 0; --level) {
+      curr = pointer_of(pred->next[level].load(std::memory_order_acquire));
+      while (curr) {
+        uintptr_t succ = curr->next[level].load(std::memory_order_acquire);
+        if (marked(succ)) {
+          curr = pointer_of(succ);
+        } else if (compare(curr->data.first, key)) {
+          pred = curr;
+          curr = pointer_of(succ);
+        } else {
+          break;
+        }
+      }
+    }
+    if (curr && !compare(key, curr->data.first)) { return curr; }
+    return nullptr;
+  }
+
+  /**
+   * the first node from p on, p included, that is not erased.
+   */
+  static node *live_from(node *p) {
+    while (p && marked(p->next[0].load(std::memory_order_acquire))) {
+      p = pointer_of(p->next[0].load(std::memory_order_acquire));
+    }
+    return p;
+  }
+
+  /**
+   * the last node not erased before p (or before the end for nullptr),
+   *   the head if there is none. the caller is pinned.
+   */
+  node *before(const node *p) const {
+    Compare compare;
+    node *pred = head;
+    for (int level = levels.load() - 1; level >= 0; --level) {
+      node *curr = pointer_of(pred->next[level].load(std::memory_order_acquire));
+      while (curr) {
+        uintptr_t succ = curr->next[level].load(std::memory_order_acquire);
+        if (marked(succ)) {
+          curr = pointer_of(succ);
+        } else if (!p || compare(curr->data.first, p->data.first)) {
+          pred = curr;
+          curr = pointer_of(succ);
+        } else {
+          break;
+        }
+      }
+    }
+    return pred;
+  }
+
+  /**
+   * append value after the largest key, with nobody else around.
+   */
+  void append(const value_type &value, node **last) {
+    int height = random_height();
+    node *p = make_node(value, height);
+    if (height > levels.load(std::memory_order_relaxed)) { levels.store(height, std::memory_order_relaxed); }
+    for (int i = 0; i < height; ++i) {
+      last[i]->next[i].store(link_to(p), std::memory_order_relaxed);
+      last[i] = p;
+    }
+    p->state.store(linked, std::memory_order_relaxed);
+    my_counter().count.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void copy_from(const skiplist_map &other) {
+    node *last[max_level];
+    for (int i = 0; i < max_level; ++i) { last[i] = head; }
+    for (const_iterator it = other.cbegin(); it != other.cend(); ++it) { append(*it, last); }
+  }
+
+  void destroy() {
+    node *p = pointer_of(head->next[0].load());
+    while (p) {
+      node *q = pointer_of(p->next[0].load());
+      free_node(p);
+      p = q;
+    }
+    operator delete(head);
+    delete[] counters;
+  }
+
+ public:
+  template<bool Constant>
+  class basic_iterator {
+    friend skiplist_map;
+    template<bool> friend class basic_iterator;
+
+    typedef typename std::conditional<Constant, const value_type, value_type>::type element;
+
+    const skiplist_map *p_map = nullptr;
+    epoch_domain::participant *self = nullptr;
+    node *pointer = nullptr;
+
+    basic_iterator(node *p, const skiplist_map *m) : p_map(m), self(m->epochs.local()), pointer(p) {
+      p_map->epochs.pin(self);
+    }
+
+    void release() {
+      if (p_map) { p_map->epochs.unpin(self); }
+    }
+
+   public:
+    basic_iterator() {}
+
+    basic_iterator(const basic_iterator &other) : p_map(other.p_map), pointer(other.pointer) {
+      if (p_map) {
+        self = p_map->epochs.local();
+        p_map->epochs.pin(self);
+      }
+    }
+
+    /**
+     * an iterator converts to a const_iterator.
+     */
+    template<bool Other, class = typename std::enable_if<Constant && !Other>::type>
+    basic_iterator(const basic_iterator<Other> &other) : p_map(other.p_map), pointer(other.pointer) {
+      if (p_map) {
+        self = p_map->epochs.local();
+        p_map->epochs.pin(self);
+      }
+    }
+
+    basic_iterator &operator=(const basic_iterator &other) {
+      if (this == &other) { return *this; }
+      epoch_domain::participant *pinned = nullptr;
+      if (other.p_map) {
+        pinned = other.p_map->epochs.local();
+        other.p_map->epochs.pin(pinned);
+      }
+      release();
+      p_map = other.p_map;
+      self = pinned;
+      pointer = other.pointer;
+      return *this;
+    }
+
+    ~basic_iterator() {
+      release();
+    }
+
+    basic_iterator &operator++() {
+      if (!pointer) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      pointer = live_from(pointer_of(pointer->next[0].load(std::memory_order_acquire)));
+      return *this;
+    }
+
+    basic_iterator operator++(int) {
+      basic_iterator it(*this);
+      ++*this;
+      return it;
+    }
+
+    basic_iterator &operator--() {
+      node *p = p_map ? p_map->before(pointer) : nullptr;
+      if (!p || p == p_map->head) {
+        invalid_iterator invalid_iterator;
+        throw invalid_iterator;
+      }
+      pointer = p;
+      return *this;
+    }
+
+    basic_iterator operator--(int) {
+      basic_iterator it(*this);
+      --*this;
+      return it;
+    }
+
+    element &operator*() const {
+      return pointer->data;
+    }
+
+    element *operator->() const noexcept {
+      return &(pointer->data);
+    }
+
+    template<bool Other>
+    bool operator==(const basic_iterator<Other> &rhs) const {
+      return pointer == rhs.pointer;
+    }
+
+    template<bool Other>
+    bool operator!=(const basic_iterator<Other> &rhs) const {
+      return pointer != rhs.pointer;
+    }
+  };
+
+  typedef basic_iterator<false> iterator;
+  typedef basic_iterator<true> const_iterator;
+
+  skiplist_map() : head(make_head()) {
+    try {
+      counters = new counter[counter_slots];
+    } catch (...) {
+      operator delete(head);
+      throw;
+    }
+  }
+
+  skiplist_map(const skiplist_map &other) : skiplist_map() {
+    try {
+      copy_from(other);
+    } catch (...) {
+      destroy();
+      throw;
+    }
+  }
+
+  skiplist_map &operator=(const skiplist_map &other) {
+    if (this == &other) { return *this; }
+    clear();
+    for (const_iterator it = other.cbegin(); it != other.cend(); ++it) { insert(*it); }
+    return *this;
+  }
+
+  /**
+   * nobody may use a map while it is destroyed,
+   *   so the nodes left are freed at once, those retired with the epochs.
+   */
+  ~skiplist_map() {
+    destroy();
+  }
+
+  /**
+   * throw index_out_of_bound if key does not exist.
+   */
+  T &at(const Key &key) {
+    epoch_domain::guard pinned(epochs);
+    if (node *p = lookup(key)) { return p->data.second; }
+    index_out_of_bound index_out_of_bound;
+    throw index_out_of_bound;
+  }
+
+  const T &at(const Key &key) const {
+    epoch_domain::guard pinned(epochs);
+    if (node *p = lookup(key)) { return p->data.second; }
+    index_out_of_bound index_out_of_bound;
+    throw index_out_of_bound;
+  }
+
+  /**
+   * the value of key, inserting a default one first if key does not exist.
+   */
+  T &operator[](const Key &key) {
+    epoch_domain::guard pinned(epochs);
+    if (node *p = lookup(key)) { return p->data.second; }
+    return add(value_type(key, T())).first->data.second;
+  }
+
+  /**
+   * behave like at() throw index_out_of_bound if such key does not exist.
+   */
+  const T &operator[](const Key &key) const {
+    return at(key);
+  }
+
+  iterator begin() {
+    epoch_domain::guard pinned(epochs);
+    return iterator(live_from(pointer_of(head->next[0].load(std::memory_order_acquire))), this);
+  }
+
+  const_iterator cbegin() const {
+    epoch_domain::guard pinned(epochs);
+    return const_iterator(live_from(pointer_of(head->next[0].load(std::memory_order_acquire))), this);
+  }
+
+  iterator end() {
+    return iterator(nullptr, this);
+  }
+
+  const_iterator cend() const {
+    return const_iterator(nullptr, this);
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  size_t size() const {
+    long long n = 0;
+    for (unsigned i = 0; i < counter_slots; ++i) { n += counters[i].count.load(std::memory_order_relaxed); }
+    return n > 0 ? n : 0;
+  }
+
+  /**
+   * erase the elements one at a time, each of them atomically.
+   */
+  void clear() {
+    epoch_domain::guard pinned(epochs);
+    for (node *p = live_from(pointer_of(head->next[0].load())); p;
+         p = live_from(pointer_of(p->next[0].load()))) {
+      remove(p);
+    }
+  }
+
+  /**
+   * insert an element with the key of value, unless the key is there;
+   *   return an iterator to the element with the key, and whether it is new.
+   */
+  pair<iterator, bool> insert(const value_type &value) {
+    epoch_domain::guard pinned(epochs);
+    pair<node *, bool> result = add(value);
+    return pair<iterator, bool>(iterator(result.first, this), result.second);
+  }
+
+  /**
+   * throw invalid_iterator if pos is end(), belongs to another map,
+   *   or its element was erased already.
+   */
+  void erase(iterator pos) {
+    if (!pos.pointer || pos.p_map != this || !remove(pos.pointer)) {
+      invalid_iterator invalid_iterator;
+      throw invalid_iterator;
+    }
+  }
+
+  /**
+   * return the number of erased elements, 0 or 1.
+   */
+  size_t erase(const Key &key) {
+    epoch_domain::guard pinned(epochs);
+    for (;;) {
+      node *p = lookup(key);
+      if (!p) { return 0; }
+      if (remove(p)) { return 1; }
+    }
+  }
+
+  size_t count(const Key &key) const {
+    epoch_domain::guard pinned(epochs);
+    return lookup(key) ? 1 : 0;
+  }
+
+  /**
+   * an iterator to the element with key, or end().
+   */
+  iterator find(const Key &key) {
+    epoch_domain::guard pinned(epochs);
+    return iterator(lookup(key), this);
+  }
+
+  const_iterator find(const Key &key) const {
+    epoch_domain::guard pinned(epochs);
+    return const_iterator(lookup(key), this);
+  }
+};
+
+}
+
+#endif